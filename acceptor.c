@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server.h"
+
+//Most connections taken off a listening socket before they are queued
+#define ACCEPT_BATCH 64
+
+//Most bytes the kernel may hold unsent for a connection. The rest waits in
+//the connection's own output, where control frames can still overtake chat
+#define UNSENT_LIMIT (16 * 1024)
+
+//Epoll data of the listening sockets and the wakeup, in Listeners order
+#define TCP_LISTENER 0
+#define UNIX_LISTENER 1
+#define ACCEPT_WAKE 2
+
+//Milliseconds a listening socket is left alone after accepting from it ran
+//out of descriptors or memory, as it stays readable until the backlog drains
+#define ACCEPT_BACKOFF 100
+
+/*
+* Take every connection waiting on a listening socket, up to a batch at a
+* time, and queue them for the workers together. A slot in the accept queue
+* is taken before each one, so while the queue is full the rest wait in the
+* listen backlog rather than in the acceptor.
+*
+* Parameters:
+*     server: the server the connections are for
+*     listenfd: the non-blocking listening socket
+*     tcp: whether the connections are TCP, and so need Nagle turned off and
+*     their unsent bytes limited
+*
+* Returns:
+*     true if accepting failed for want of descriptors or memory, and the
+*     listening socket should be left alone for a while
+*/
+bool accept_batch(struct ServerInf* server, int listenfd, bool tcp) {
+
+    struct WorkerPool* pool = &server->pool;
+    int fds[ACCEPT_BATCH];
+    int numFds = 0;
+    bool exhausted = false;
+
+    //Only the first slot is waited for, so a batch is never held back
+    while (numFds < ACCEPT_BATCH && (numFds == 0 ? reserve_slot(pool) :
+            sem_trywait(&pool->queue.freeSlots) == 0)) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            release_lock(&pool->queue.freeSlots);
+        }
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;
+        } else if (fd < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            __atomic_fetch_add(&pool->queue.acceptErrors, 1,
+                    __ATOMIC_RELAXED);
+            exhausted = true;
+            break;
+        } else if (fd < 0) {
+            break;
+        }
+        TRACE_EVENT(TRACE_ACCEPT, TRACE_INSTANT, fd);
+
+        //Small protocol lines must not wait on Nagle's algorithm
+        if (tcp) {
+            int optVal = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+            optVal = UNSENT_LIMIT;
+            setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optVal,
+                    sizeof(int));
+        }
+        fds[numFds++] = fd;
+    }
+
+    if (numFds > 0) {
+        submit_connections(server, fds, numFds);
+    }
+
+    return exhausted;
+}
+
+/*
+* Add a listening socket to an acceptor's epoll set, or take it out. The
+* sockets are exclusive, which epoll does not allow to be modified.
+*
+* Parameters:
+*     acceptor: the acceptor watching the socket
+*     kind: TCP_LISTENER or UNIX_LISTENER
+*     watch: whether to add the socket rather than take it out
+*/
+void watch_listener(struct Acceptor* acceptor, int kind, bool watch) {
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+            .data.u32 = kind};
+
+    epoll_ctl(acceptor->epollfd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+            acceptor->listeners[kind], &event);
+    acceptor->resting[kind] = !watch;
+}
+
+/*
+* Thread function for an acceptor. Every acceptor waits on the same listening
+* sockets, but the kernel wakes only one of them for each new connection.
+*
+* Parameters:
+*     arg: compulsary void* arg to thread function. Actually the acceptor this
+*     thread runs as.
+*
+* Returns:
+*     compulsary void* return value. Never returns.
+*/
+void* acceptor_thread(void* arg) {
+
+    struct Acceptor* acceptor = (struct Acceptor*) arg;
+    struct ServerInf* server = acceptor->server;
+    struct WorkerPool* pool = &server->pool;
+    struct epoll_event events[3];
+
+    TRACE_THREAD("acceptor");
+
+    while (true) {
+        if (__atomic_load_n(&pool->draining, __ATOMIC_ACQUIRE)) {
+            release_lock(&pool->parked);
+            take_lock(&pool->resume);
+        }
+
+        bool resting = acceptor->resting[TCP_LISTENER] ||
+                acceptor->resting[UNIX_LISTENER];
+        int numEvents = epoll_wait(acceptor->epollfd, events, 3,
+                resting ? ACCEPT_BACKOFF : -1);
+
+        //A rested socket is tried again after a tick, or sooner if parked
+        for (int kind = TCP_LISTENER; kind <= UNIX_LISTENER; kind++) {
+            if (acceptor->resting[kind]) {
+                watch_listener(acceptor, kind, true);
+            }
+        }
+
+        for (int index = 0; index < numEvents; index++) {
+            int kind = events[index].data.u32;
+            if (kind != ACCEPT_WAKE && accept_batch(server,
+                    acceptor->listeners[kind], kind == TCP_LISTENER)) {
+                watch_listener(acceptor, kind, false);
+            }
+        }
+    }
+
+    return (void*) 0;
+}
+
+/*
+* Make the listening sockets non-blocking, give them the configured backlog
+* and start the acceptor threads.
+*
+* Parameters:
+*     server: the server to accept connections for
+*     listeners: the sockets to accept on
+*/
+void init_acceptors(struct ServerInf* server, struct Listeners* listeners) {
+
+    struct ServerConfig* config = server->config;
+    struct WorkerPool* pool = &server->pool;
+    int fds[] = {listeners->serverfd, listeners->unixfd};
+
+    for (int index = TCP_LISTENER; index <= UNIX_LISTENER; index++) {
+        if (fds[index] >= 0) {
+            fcntl(fds[index], F_SETFL, fcntl(fds[index], F_GETFL) |
+                    O_NONBLOCK);
+            //Also resizes the backlog of sockets taken over
+            listen(fds[index], config->backlog);
+        }
+    }
+
+    pool->acceptWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->acceptors = calloc(config->numAcceptors, sizeof(struct Acceptor));
+
+    size_t stackSize = (size_t) config->stackSize * 1024;
+    if (stackSize < PTHREAD_STACK_MIN) {
+        stackSize = PTHREAD_STACK_MIN;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stackSize);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int index = 0; index < config->numAcceptors; index++) {
+        struct Acceptor* acceptor = &pool->acceptors[index];
+        acceptor->server = server;
+        acceptor->listeners[TCP_LISTENER] = fds[TCP_LISTENER];
+        acceptor->listeners[UNIX_LISTENER] = fds[UNIX_LISTENER];
+        acceptor->epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+        for (int kind = TCP_LISTENER; kind <= UNIX_LISTENER; kind++) {
+            if (fds[kind] >= 0) {
+                watch_listener(acceptor, kind, true);
+            }
+        }
+
+        //Every acceptor is woken when the pool is parked
+        struct epoll_event event = {.events = EPOLLIN,
+                .data.u32 = ACCEPT_WAKE};
+        epoll_ctl(acceptor->epollfd, EPOLL_CTL_ADD, pool->acceptWake, &event);
+
+        pthread_create(&acceptor->threadId, &attr, acceptor_thread, acceptor);
+    }
+    pool->numAcceptors = config->numAcceptors;
+
+    pthread_attr_destroy(&attr);
+}
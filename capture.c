@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "server.h"
+#include "capture.h"
+
+//Bytes of records each worker collects before handing them to the writer
+#define CAPTURE_BUF_SIZE 65536
+
+//Most full buffers that may wait for the writer. Beyond this buffers are
+//dropped rather than letting a slow disk hold the workers up
+#define MAX_CAPTURE_QUEUE 256
+
+//Microseconds a worker holds on to records before handing them over anyway
+#define CAPTURE_FLUSH 250000
+
+//Prefix of the line that carries the authentication string, which is left
+//out of the capture
+#define AUTH_LINE "AUTH:"
+
+//Records collected by one worker, waiting to be written. next chains the
+//buffers waiting for the writer
+struct CaptureBuf {
+    struct CaptureBuf* next;
+    long long firstTime;
+    int records;
+    size_t used;
+    char data[CAPTURE_BUF_SIZE];
+};
+
+//The capture file and its writer thread. head to tail are the buffers
+//waiting to be written, guarded by lock, with ready counting them. Once
+//finishing is set the writer posts drained when it runs out of buffers
+struct Capture {
+    int fd;
+    long long startUs;
+    unsigned int nextConn;
+    struct CaptureBuf* head;
+    struct CaptureBuf* tail;
+    int queued;
+    bool finishing;
+    sem_t lock;
+    sem_t ready;
+    sem_t drained;
+    long long records;
+    long long bytes;
+    long long dropped;
+};
+
+/*
+* Hand a worker's buffer of records to the writer thread, or throw it away
+* if the writer is too far behind.
+*
+* Parameters:
+*     capture: the capture the records are for
+*     buf: the buffer to write
+*/
+void submit_capture(struct Capture* capture, struct CaptureBuf* buf) {
+
+    take_lock(&capture->lock);
+
+    if (capture->queued >= MAX_CAPTURE_QUEUE) {
+        capture->dropped += 1;
+        release_lock(&capture->lock);
+        free(buf);
+        return;
+    }
+
+    buf->next = NULL;
+    if (capture->tail == NULL) {
+        capture->head = buf;
+    } else {
+        capture->tail->next = buf;
+    }
+    capture->tail = buf;
+    capture->queued += 1;
+
+    release_lock(&capture->lock);
+    release_lock(&capture->ready);
+}
+
+/*
+* Add a record to the calling worker's buffer. Nothing is written here, the
+* buffer goes to the writer thread once it is full or has been held long
+* enough.
+*
+* Parameters:
+*     worker: the worker the connection belongs to
+*     client: the connection the record is about
+*     kind: what happened
+*     line: the line received, if any
+*     length: the number of bytes in line
+*/
+void capture_record(struct Worker* worker, struct ClientInf* client,
+        enum CaptureKind kind, const char* line, size_t length) {
+
+    struct Capture* capture = worker->server->capture;
+    long long now = get_time_us();
+
+    if (client->connId == 0) {
+        client->connId = __atomic_add_fetch(&capture->nextConn, 1,
+                __ATOMIC_RELAXED);
+    }
+
+    size_t size = sizeof(struct CaptureRecord) + length;
+    struct CaptureBuf* buf = worker->capture;
+
+    if (buf != NULL && buf->used + size > CAPTURE_BUF_SIZE) {
+        submit_capture(capture, buf);
+        buf = NULL;
+    }
+    if (buf == NULL) {
+        buf = malloc(sizeof(struct CaptureBuf));
+        buf->firstTime = now;
+        buf->records = 0;
+        buf->used = 0;
+        worker->capture = buf;
+    }
+
+    struct CaptureRecord record = {.time = now - capture->startUs,
+            .conn = client->connId, .length = length, .kind = kind};
+    memcpy(buf->data + buf->used, &record, sizeof(struct CaptureRecord));
+    memcpy(buf->data + buf->used + sizeof(struct CaptureRecord), line, length);
+    buf->used += size;
+    buf->records += 1;
+}
+
+/*
+* Record a line received on a connection, if the server is capturing. The
+* authentication string is left out, replay supplies its own. Lines from
+* peer links are not recorded.
+*
+* Parameters:
+*     worker: the worker the connection belongs to
+*     client: the connection the line came in on
+*     line: the line, before it has been processed
+*/
+void capture_line(struct Worker* worker, struct ClientInf* client,
+        const char* line) {
+
+    if (worker->server->capture == NULL || client->state == CONN_PEER) {
+        return;
+    }
+
+    size_t length = strlen(line);
+    if (!strncmp(line, AUTH_LINE, strlen(AUTH_LINE))) {
+        length = strlen(AUTH_LINE);
+    } else if (length > UINT16_MAX) {
+        length = UINT16_MAX;
+    }
+    capture_record(worker, client, CAPTURE_LINE, line, length);
+}
+
+/*
+* Record a connection being torn down, if the server is capturing and the
+* connection sent anything.
+*
+* Parameters:
+*     worker: the worker the connection belongs to
+*     client: the connection going away
+*/
+void capture_close(struct Worker* worker, struct ClientInf* client) {
+
+    if (worker->server->capture != NULL && client->connId != 0) {
+        capture_record(worker, client, CAPTURE_CLOSE, NULL, 0);
+    }
+}
+
+/*
+* Hand the calling worker's records to the writer if they have been held
+* for long enough, so a quiet server still writes its capture out promptly.
+*
+* Parameters:
+*     worker: the worker whose records to hand over
+*     force: whether to hand them over however new they are
+*/
+void flush_capture(struct Worker* worker, bool force) {
+
+    struct CaptureBuf* buf = worker->capture;
+
+    if (buf != NULL && (force ||
+            get_time_us() - buf->firstTime >= CAPTURE_FLUSH)) {
+        submit_capture(worker->server->capture, buf);
+        worker->capture = NULL;
+    }
+}
+
+/*
+* Thread function for the capture writer. Writes each buffer the workers
+* hand over to the capture file, in the order they were handed over.
+*
+* Parameters:
+*     arg: compulsary void* arg to thread function. Actually the capture to
+*     write.
+*
+* Returns:
+*     compulsary void* return value. Never returns.
+*/
+void* capture_thread(void* arg) {
+
+    struct Capture* capture = (struct Capture*) arg;
+
+    TRACE_THREAD("capture");
+
+    while (true) {
+        take_lock(&capture->ready);
+        take_lock(&capture->lock);
+        struct CaptureBuf* buf = capture->head;
+        if (buf != NULL) {
+            capture->head = buf->next;
+            if (capture->head == NULL) {
+                capture->tail = NULL;
+            }
+            capture->queued -= 1;
+        }
+        bool finishing = capture->finishing;
+        release_lock(&capture->lock);
+
+        if (buf == NULL) {
+            if (finishing) {
+                release_lock(&capture->drained);
+            }
+            continue;
+        }
+
+        for (size_t written = 0; written < buf->used;) {
+            ssize_t result = write(capture->fd, buf->data + written,
+                    buf->used - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            } else if (result < 0) {
+                perror("capture");
+                break;
+            }
+            written += result;
+        }
+
+        __atomic_add_fetch(&capture->records, buf->records, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&capture->bytes, buf->used, __ATOMIC_RELAXED);
+        free(buf);
+    }
+
+    return (void*) 0;
+}
+
+/*
+* Start capturing every line the server receives into a file, with a writer
+* thread to keep the disk off the workers' path. A file that already holds a
+* capture, left by the server this one took over from, is carried on with
+* the same start time.
+*
+* Parameters:
+*     server: the server to capture
+*     fd: the capture file, opened for reading and appending
+*/
+void init_capture(struct ServerInf* server, int fd) {
+
+    struct Capture* capture = calloc(1, sizeof(struct Capture));
+    struct CaptureHeader header;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t wallUs = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    capture->startUs = get_time_us();
+
+    if (pread(fd, &header, sizeof(struct CaptureHeader), 0) ==
+            sizeof(struct CaptureHeader) &&
+            !memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic))) {
+        capture->startUs -= wallUs - header.startTime;
+    } else if (ftruncate(fd, 0) < 0) {
+        perror("capture");
+    } else {
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.startTime = wallUs;
+        if (write(fd, &header, sizeof(struct CaptureHeader)) < 0) {
+            perror("capture");
+        }
+    }
+
+    capture->fd = fd;
+    init_lock(&capture->lock);
+    sem_init(&capture->ready, 0, 0);
+    sem_init(&capture->drained, 0, 0);
+    server->capture = capture;
+
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, capture_thread, capture);
+    pthread_detach(threadId);
+}
+
+/*
+* Write out every record still held and wait until the writer has finished.
+* The workers must be parked, as their buffers are taken from them.
+*
+* Parameters:
+*     server: the server being captured
+*/
+void finish_capture(struct ServerInf* server) {
+
+    struct Capture* capture = server->capture;
+
+    if (capture == NULL) {
+        return;
+    }
+
+    for (int index = 0; index < server->pool.numWorkers; index++) {
+        flush_capture(&server->pool.workers[index], true);
+    }
+
+    take_lock(&capture->lock);
+    capture->finishing = true;
+    release_lock(&capture->lock);
+    release_lock(&capture->ready);
+    take_lock(&capture->drained);
+}
+
+/*
+* Find the last number given to a captured connection, to be carried over to
+* a new server.
+*
+* Parameters:
+*     server: the server being captured
+*
+* Returns:
+*     the last connection number, or 0 if the server is not capturing.
+*/
+unsigned int last_capture_conn(struct ServerInf* server) {
+
+    if (server->capture == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&server->capture->nextConn, __ATOMIC_RELAXED);
+}
+
+/*
+* Carry on numbering captured connections after the old server's last one,
+* so that the connections it numbered keep their numbers.
+*
+* Parameters:
+*     server: the new server
+*     lastConn: the old server's last connection number
+*/
+void resume_capture(struct ServerInf* server, unsigned int lastConn) {
+
+    if (server->capture != NULL && server->capture->nextConn < lastConn) {
+        server->capture->nextConn = lastConn;
+    }
+}
+
+/*
+* Print how much of the server's traffic has been captured.
+*
+* Parameters:
+*     server: the server to report on
+*/
+void print_capture_stats(struct ServerInf* server) {
+
+    struct Capture* capture = server->capture;
+
+    if (capture == NULL) {
+        return;
+    }
+
+    fprintf(stderr, "@CAPTURE@\n");
+    fprintf(stderr, "capture:RECORDS:%lld:BYTES:%lld:DROPPED_BUFFERS:%lld\n",
+            __atomic_load_n(&capture->records, __ATOMIC_RELAXED),
+            __atomic_load_n(&capture->bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+//Start of every capture file, followed by the records
+#define CAPTURE_MAGIC "CHATCAP1"
+
+//What a capture record holds
+enum CaptureKind {
+    CAPTURE_LINE,
+    CAPTURE_CLOSE
+};
+
+//Written once at the start of a capture file. startTime is the wall clock
+//time capturing began, in microseconds since the epoch
+struct CaptureHeader {
+    char magic[8];
+    int64_t startTime;
+};
+
+//One thing that happened on a connection, followed in the file by length
+//bytes of the line received (without its newline). time is microseconds
+//since capturing began and conn numbers the connection from 1. Records from
+//different workers are not in time order
+struct CaptureRecord {
+    uint64_t time;
+    uint32_t conn;
+    uint16_t length;
+    uint8_t kind;
+} __attribute__((packed));
@@ -1,16 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <stdbool.h>
-#include <semaphore.h>
+#include <stdarg.h>
 #include "sharedfunc.h"
+#include "shmring.h"
 
 //Possible messages from the server
 #define WHO "WHO"
@@ -23,34 +30,372 @@
 #define ENTER "ENTER"
 #define LEAVE "LEAVE"
 #define MSG "MSG"
+#define TELL "TELL"
+#define UNKNOWN_NAME "UNKNOWN_NAME"
+#define SHM "SHM"
+#define FILE_FRAME "FILE"
+#define REFUSED "REFUSED"
+#define SEND "SEND"
+#define PING "PING"
+#define PONG "PONG"
+#define AUTO "AUTO"
 
-//Info required for thread to read from and respond to server
+//Most terms any message from the server has
+#define MAX_TERMS 6
+
+//Most bytes of a file chunk read from the server at once
+#define FILE_BUFFER 65536
+
+//Most lines one read from the server can hold
+#define MAX_LINES (LINEBUF_SIZE / 2)
+
+//ENTER: and LEAVE: messages in one read beyond which they are summarised
+#define PRESENCE_LIMIT 10
+
+//Script directive that pauses before the next line
+#define DELAY "DELAY"
+
+//Microseconds a finished script waits for outstanding responses
+#define DRAIN_TIMEOUT 5000000
+
+//Bytes waiting for the server at which the client stops taking new lines
+#define SEND_QUEUE_LIMIT 65536
+
+//Milliseconds to wait before trying again to write into a full shared ring
+#define RING_RETRY 1
+
+//Where the client is up to in joining the chat. stdin is only read once the
+//client has joined. STATE_RING waits for the server to take up the shared
+//ring before anything is sent through it
+enum ClientState {
+    STATE_AUTH,
+    STATE_NAME,
+    STATE_RING,
+    STATE_JOINED
+};
+
+//Text rendered from one read from the server, written to stdout in one go.
+//When summarise is set, ENTER: and LEAVE: messages are only counted
+struct Output {
+    char* data;
+    int length;
+    int capacity;
+    bool summarise;
+    int entered;
+    int left;
+};
+
+//A chat file run in place of stdin. awaited holds, oldest first, the lines
+//whose responses (MSG: echoes for SAY:, LIST: for LIST:) have not yet
+//arrived. With neither delay nor interval set each response is waited for
+//before the next line is sent
+struct Script {
+    char** lines;
+    int numLines;
+    int next;
+    long long delay;
+    long long interval;
+    long long nextSend;
+    long long drainUntil;
+    long long* sentAt;
+    int* awaited;
+    int firstAwaited;
+    int numAwaited;
+    long long* latencies;
+    int numLatencies;
+    FILE* timings;
+};
+
+//A file chunk being received. Its bytes follow its FILE: header and are
+//written to fd from offset on, until left runs out. notice is shown once
+//they have all arrived if this is the file's last chunk
+struct Download {
+    int fd;
+    off_t offset;
+    int left;
+    char* notice;
+};
+
+//A file being sent to the server. Its SEND: header (length bytes, of which
+//sent have gone) waits until nothing queued or in the shared ring could be
+//overtaken by it, then it and the file's bytes from offset on go out on the
+//socket whenever there is room. header is NULL when no file is being sent
+struct Upload {
+    char* header;
+    int length;
+    int sent;
+    int fd;
+    off_t offset;
+    off_t size;
+};
+
+//Protocol text waiting to go to the server. It is written without blocking
+//whenever the socket (or shared ring) has room, and everything queued between
+//two polls leaves in one write, so a pasted block of SAY: lines costs one
+//system call. Once SEND_QUEUE_LIMIT bytes are waiting the queue is full, and
+//stdin and the script are not read until half of it has gone. The user is
+//told of the pause once (warned), and again when everything has been sent
+struct SendQueue {
+    char* data;
+    int start;
+    int end;
+    int capacity;
+    bool full;
+    bool warned;
+};
+
+//Info required to read from and respond to server
 //This includes name of client and number attached to end of
-//name for WHO queries
+//name for WHO queries. autoName is cleared once the server is found not to
+//choose names, and address is kept to connect again when that happens
 struct SockComms {
     char* name;
     char* auth;
+    char* address;
+    bool autoName;
     int clientNum;
-    sem_t* authLock;
-    FILE* writeSock;
-    FILE* readSock;
+    int fd;
+    struct SendQueue send;
+    struct LineBuf input;
+    enum ClientState state;
+    int namesSent;
+    int whoCount;
+    char* joinedName;
+    bool useRing;
+    bool ringActive;
+    struct ShmRing ring;
+    struct Output output;
+    struct Script* script;
+    struct Download download;
+    struct Upload upload;
 };
 
+/*
+* Append formatted text to the output, growing it as needed.
+*
+* Parameters:
+*     output: the output to append to
+*     format: printf style format of the text
+*/
+void render(struct Output* output, const char* format, ...) {
+
+    va_list args;
+
+    while (true) {
+        int space = output->capacity - output->length;
+        va_start(args, format);
+        int needed = vsnprintf(output->data + output->length, space, format,
+                args);
+        va_end(args);
+
+        if (needed < space) {
+            output->length += needed;
+            return;
+        }
+        output->capacity = (output->capacity + needed) * 2;
+        output->data = realloc(output->data, output->capacity);
+    }
+}
+
+/*
+* Write everything rendered so far to stdout in a single call (more only if
+* the write is partial), then start the output afresh.
+*
+* Parameters:
+*     output: the output to write
+*/
+void flush_output(struct Output* output) {
+
+    int written = 0;
+
+    while (written < output->length) {
+        int result = write(STDOUT_FILENO, output->data + written, 
+                output->length - written);
+        if (result < 0 && errno != EINTR) {
+            break;
+        } else if (result > 0) {
+            written += result;
+        }
+    }
+    output->length = 0;
+}
+
+/*
+* Queue formatted protocol text to be sent to the server, growing the queue
+* as needed. The user is told when the queue fills up.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*     format: printf style format of the text
+*/
+void queue_text(struct SockComms* sockInfo, const char* format, ...) {
+
+    struct SendQueue* queue = &sockInfo->send;
+    va_list args;
+
+    while (true) {
+        int space = queue->capacity - queue->end;
+        va_start(args, format);
+        int needed = vsnprintf(queue->data + queue->end, space, format,
+                args);
+        va_end(args);
+
+        if (needed < space) {
+            queue->end += needed;
+            break;
+        }
+        queue->capacity = (queue->capacity + needed) * 2;
+        queue->data = realloc(queue->data, queue->capacity);
+    }
+
+    if (!queue->full && queue->end - queue->start >= SEND_QUEUE_LIMIT) {
+        queue->full = true;
+        if (!queue->warned && sockInfo->script == NULL) {
+            render(&sockInfo->output, "(sending paused, %d KB waiting for "
+                    "the server)\n", (queue->end - queue->start) / 1024);
+            flush_output(&sockInfo->output);
+        }
+        queue->warned = true;
+    }
+}
+
+/*
+* Send as much of the queue as the server will take without blocking. The
+* socket is written with MSG_DONTWAIT, and the shared ring only up to the
+* room it has. Once no more than half the limit is left new lines are taken
+* again, and once it is empty a user told of the pause is told it is over.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*
+* Returns:
+*     whether bytes are still waiting to be sent.
+*/
+bool flush_queue(struct SockComms* sockInfo) {
+
+    struct SendQueue* queue = &sockInfo->send;
+
+    while (queue->start < queue->end) {
+        int length = queue->end - queue->start;
+        int sent;
+
+        //Nothing may go on the socket between a file's header and its end
+        if (!sockInfo->ringActive && sockInfo->upload.sent > 0) {
+            break;
+        }
+
+        if (sockInfo->ringActive) {
+            int room = ring_space(&sockInfo->ring);
+            sent = length < room ? length : room;
+            if (sent == 0) {
+                break;
+            }
+            ring_write(&sockInfo->ring, queue->data + queue->start, sent);
+        } else {
+            sent = send(sockInfo->fd, queue->data + queue->start, length,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else if (sent < 0) {
+                fprintf(stderr, "Communications error\n");
+                exit(2);
+            }
+        }
+        queue->start += sent;
+    }
+
+    //Keep the unsent bytes at the front so the queue does not creep
+    if (queue->start == queue->end) {
+        queue->start = 0;
+        queue->end = 0;
+    } else if (queue->start > queue->capacity / 2) {
+        memmove(queue->data, queue->data + queue->start,
+                queue->end - queue->start);
+        queue->end -= queue->start;
+        queue->start = 0;
+    }
+
+    if (queue->full && queue->end - queue->start <= SEND_QUEUE_LIMIT / 2) {
+        queue->full = false;
+    }
+    if (queue->warned && queue->start == queue->end) {
+        queue->warned = false;
+        if (sockInfo->script == NULL) {
+            render(&sockInfo->output, "(everything typed has been sent)\n");
+            flush_output(&sockInfo->output);
+        }
+    }
+    return queue->start < queue->end;
+}
+
+/*
+* Wait until everything queued has been sent. Used where later bytes must not
+* overtake the queue (a file's bytes, the ring offer) and before exiting.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*/
+void drain_queue(struct SockComms* sockInfo) {
+
+    struct pollfd writable = {.fd = sockInfo->fd, .events = POLLOUT};
+
+    //The ring has no descriptor to wait on for room
+    while (flush_queue(sockInfo)) {
+        poll(&writable, sockInfo->ringActive ? 0 : 1,
+                sockInfo->ringActive ? RING_RETRY : -1);
+    }
+}
+
+/*
+* Connect to a server's Unix domain socket instead of TCP.
+*
+* Parameters:
+*     path: where in the filesystem the server's socket is
+*     fd: pointer to the socket to populate
+*
+* Returns:
+*     the error code of the function. 2 if coommunication error occured, 0 if
+*     all good.
+*/
+int init_unix_connection(const char* path, int* fd) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(*fd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un))) {
+        return 2;
+    }
+    return 0;
+}
+
 /*
 * Function to initialise the connection to the server. Will create
 * communications error if server is not active.
 *
 * Parameters:
-*     port: string representation of the port number to connect to
-*     files: list of 2 file pointers to populate. files[0] = read, 
-*     file[1] = write
+*     port: string representation of the port number to connect to, or the
+*     path of the server's Unix domain socket
+*     fd: pointer to the socket to populate
 *
 * Returns:
 *     the error code of the function. 2 if coommunication error occured, 0 if
 *     all good.
 */
-int init_connection(const char* port, FILE** files) {
-    
+int init_connection(const char* port, int* fd) {
+
+    if (strchr(port, '/') != NULL) {
+        return init_unix_connection(port, fd);
+    }
+
     //Addressing information and connection hints
     struct addrinfo* ai = NULL;
     struct addrinfo hints;
@@ -59,36 +404,33 @@ int init_connection(const char* port, FILE** files) {
     //Can communicate with IPv4 addresses using TCP
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
-    
+
     //Attempt to connect to specified port on this machine
     if (getaddrinfo("localhost", port, &hints, &ai)) {
         return 2;
     }
-    
+
     //Create socket using IPv4 and TCP
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+
     //Connect to socket
     struct sockaddr* socketAddr = (struct sockaddr*) ai->ai_addr;
-    if (connect(fd, socketAddr, sizeof(struct sockaddr))) { 
+    if (connect(*fd, socketAddr, sizeof(struct sockaddr))) {
         return 2;
     }
-    
-    //Dup fd, one for writing one for reading
-    int fd2 = dup(fd);
-    FILE* writeSock = fdopen(fd, "w");
-    FILE* readSock = fdopen(fd2, "r");
+    freeaddrinfo(ai);
+
+    //Small protocol lines must not wait on Nagle's algorithm
+    int optVal = 1;
+    setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
 
-    files[0] = readSock; 
-    files[1] = writeSock;
-        
     return 0;
 }
 
 /*
 * Function to choose a name for this client. This name is comprised of a base
-* name passed in as command line argument and a trailing digit. Is called in
-* response to the WHO: command from the server
+* name passed in as command line argument and a trailing number. The number
+* goes up every time the server says the name is taken.
 *
 * Parameters:
 *     sockInfo: the information needed to communicate with the server socket
@@ -96,92 +438,544 @@ int init_connection(const char* port, FILE** files) {
 * Returns:
 *     the name selected to represent this client
 */
-char* select_name(struct SockComms sockInfo) {
-    
-    int num = sockInfo.clientNum;
-    char* base = sockInfo.name;
-    
-    //Space for null and newline
-    char* response = malloc(strlen(base) + 1);
+char* select_name(struct SockComms* sockInfo) {
+
+    int num = sockInfo->clientNum;
+    char* base = sockInfo->name;
+
+    //Space for the null and up to 11 digits
+    char* response = malloc(strlen(base) + 12);
 
     if (num != -1) {
-        //Add space for trailing digit
-        response = realloc(response, strlen(base) + 2);
         sprintf(response, "%s%d", base, num);
     } else {
         sprintf(response, "%s", base);
     }
 
     return response;
+}
+
+/*
+* Send a NAME: request for the name this client currently wants, letting the
+* server choose a free name built on it if it is taken. Such a server replies
+* OK:name. A server that cannot choose gets a plain NAME: instead.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*/
+void send_name(struct SockComms* sockInfo) {
+
+    char* name = select_name(sockInfo);
+    char* responseTerms[] = {"NAME", name, AUTO};
+    char* msg = construct_message(responseTerms, sockInfo->autoName ? 3 : 2);
+    queue_text(sockInfo, "%s", msg);
+    sockInfo->namesSent += 1;
+    free(name);
+    free(msg);
+}
+
+/*
+* Send the AUTH: and first NAME: replies straight after connecting, without
+* waiting for the server's prompts, so that joining takes one round trip.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*/
+void start_handshake(struct SockComms* sockInfo) {
+
+    char* responseTerms[] = {"AUTH", sockInfo->auth};
+    char* msg = construct_message(responseTerms, 2);
+    queue_text(sockInfo, "%s", msg);
+    free(msg);
+    send_name(sockInfo);
+}
+
+/*
+* Connect to the server again and ask for names the old way, with NAME_TAKEN:
+* answered by trying the next number. Servers that do not understand AUTO
+* close the connection on a NAME:name:AUTO line. The new socket takes over
+* the old one's descriptor, which the poll loop is waiting on.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with the server socket
+*/
+void retry_without_auto(struct SockComms* sockInfo) {
+
+    int fd;
+
+    if (init_connection(sockInfo->address, &fd) == 2 ||
+            dup2(fd, sockInfo->fd) < 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(2);
+    }
+    close(fd);
+
+    //Nothing queued for the old connection applies to the new one
+    sockInfo->send.start = 0;
+    sockInfo->send.end = 0;
+    init_linebuf(&sockInfo->input);
+    sockInfo->autoName = false;
+    sockInfo->state = STATE_AUTH;
+    sockInfo->namesSent = 0;
+    sockInfo->whoCount = 0;
+    start_handshake(sockInfo);
+}
+
+/*
+* Start sending a file to another chatter, or to everyone with * as the name.
+* The file is announced with SEND:name:filename:size and its bytes follow
+* straight after on the socket, even when lines otherwise go through the
+* shared ring. Both are sent from the poll loop by send_upload, and stdin is
+* not read until the file has gone.
+*
+* Parameters:
+*     sockInfo: information required to communicate with the server socket
+*     name: who to send the file to
+*     path: the file to send
+*/
+void send_file(struct SockComms* sockInfo, char* name, char* path) {
 
+    char* filename = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    //A : would split the SEND: line in the wrong place
+    if (fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) ||
+            *filename == '\0' || strchr(filename, ':')) {
+        fprintf(stderr, "Cannot send %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    char size[32];
+    snprintf(size, sizeof(size), "%lld", (long long) info.st_size);
+    char* sendTerms[] = {SEND, name, filename, size};
+
+    struct Upload* upload = &sockInfo->upload;
+    upload->header = construct_message(sendTerms, 4);
+    upload->length = strlen(upload->header);
+    upload->sent = 0;
+    upload->fd = fd;
+    upload->offset = 0;
+    upload->size = info.st_size;
+}
+
+/*
+* Send as much of the file being uploaded as the socket will take without
+* blocking. The header waits until the send queue is empty and the server
+* has taken everything out of the shared ring, as lines still there would be
+* overtaken by it. The socket is left non-blocking while the file goes out.
+*
+* Parameters:
+*     sockInfo: information required to communicate with the server socket
+*
+* Returns:
+*     whether the upload is waiting for room on the socket.
+*/
+bool send_upload(struct SockComms* sockInfo) {
+
+    struct Upload* upload = &sockInfo->upload;
+    int flags = fcntl(sockInfo->fd, F_GETFL);
+
+    if (upload->sent == 0 && (sockInfo->send.start < sockInfo->send.end ||
+            (sockInfo->ringActive &&
+            ring_space(&sockInfo->ring) < RING_SIZE))) {
+        return false;
+    } else if (upload->sent == 0) {
+        fcntl(sockInfo->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    while (upload->sent < upload->length) {
+        int sent = send(sockInfo->fd, upload->header + upload->sent,
+                upload->length - upload->sent, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        } else if (sent < 0) {
+            fprintf(stderr, "Communications error\n");
+            exit(2);
+        }
+        upload->sent += sent;
+    }
+
+    while (upload->offset < upload->size) {
+        ssize_t sent = sendfile(sockInfo->fd, upload->fd, &upload->offset,
+                upload->size - upload->offset);
+        if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        } else if (sent <= 0) {
+            fprintf(stderr, "Communications error\n");
+            exit(2);
+        }
+    }
+
+    fcntl(sockInfo->fd, F_SETFL, flags & ~O_NONBLOCK);
+    close(upload->fd);
+    free(upload->header);
+    memset(upload, 0, sizeof(struct Upload));
+    return false;
 }
 
 /*
 * Function to process input taken from stdin. If input starts with '*', will
-* take as literal command, otherwise interpreted as a SAY: message.
+* take as literal command, otherwise interpreted as a SAY: message. As a
+* shortcut, "*TELL name text" is sent as TELL:name:text, and "*SEND name path"
+* sends a file.
 *
 * Parameters:
 *     sockInfo: information required to communicate with the server socket
 *     line: line from stdin to process
 */
 void process_input(struct SockComms* sockInfo, char* line) {
-    
-    if (line[0] == '*') {
-        memmove(line, line + 1, strlen(line));
-        line = realloc(line, strlen(line) + 2);
-        sprintf(line, "%s\n", line);
 
-        if (!strcmp("LEAVE:\n", line)) {
+    char* space;
+
+    if (!strncmp(line, "*TELL ", 6) && (space = strchr(line + 6, ' '))) {
+        *space = '\0';
+        char* messageTerms[] = {TELL, line + 6, space + 1};
+        char* msg = construct_message(messageTerms, 3);
+        queue_text(sockInfo, "%s", msg);
+        free(msg);
+
+    } else if (!strncmp(line, "*SEND ", 6) && 
+            (space = strchr(line + 6, ' '))) {
+        *space = '\0';
+        send_file(sockInfo, line + 6, space + 1);
+
+    } else if (line[0] == '*') {
+        if (!strcmp("*LEAVE:", line)) {
+            drain_queue(sockInfo);
             exit(0);
         }
 
-        write_socket(sockInfo->writeSock, line);
+        queue_text(sockInfo, "%s\n", line + 1);
 
     } else {
         char* messageTerms[] = {SAY, line};
         char* msg = construct_message(messageTerms, 2);
-        write_socket(sockInfo->writeSock, msg);
+        queue_text(sockInfo, "%s", msg);
         free(msg);
     }
 }
-    
+
 /*
-* Function to read input from stdin.
+* Process the complete lines read from stdin until the send queue fills up.
+* Any left over wait in the buffer until it has room again.
 *
 * Parameters:
 *     sockInfo: information required to communicate with the server socket
+*     stdinBuf: the buffer holding data already read from stdin
 */
-void read_in(struct SockComms* sockInfo) {
-
-    while (true) {
-        char* line = read_input(stdin, false);
-         
-        if (!strcmp(line, "EOF")) {    
-            break;
-        }
+void process_stdin(struct SockComms* sockInfo, struct LineBuf* stdinBuf) {
 
+    char* line;
+    while (!sockInfo->send.full && sockInfo->upload.header == NULL &&
+            (line = next_line(stdinBuf)) != NULL) {
         process_input(sockInfo, line);
-        memset(line, '\0', strlen(line));
-        free(line);
     }
-    
+}
+
+/*
+* Function to read whatever is available on stdin and process its complete
+* lines. Lines held back from earlier reads go first, and nothing is read
+* while they still fill the send queue. End of file on stdin ends the client,
+* once everything queued has been sent.
+*
+* Parameters:
+*     sockInfo: information required to communicate with the server socket
+*     stdinBuf: the buffer holding data already read from stdin
+*/
+void read_in(struct SockComms* sockInfo, struct LineBuf* stdinBuf) {
+
+    process_stdin(sockInfo, stdinBuf);
+    if (sockInfo->send.full || sockInfo->upload.header != NULL) {
+        return;
+    }
+
+    int numRead = fill_linebuf(stdinBuf, STDIN_FILENO);
+
+    if (numRead < 0 && errno == EINTR) {
+        return;
+    } else if (numRead <= 0) {
+        drain_queue(sockInfo);
+        exit(0);
+    }
+
+    process_stdin(sockInfo, stdinBuf);
+}
+
+/*
+* Load a chat file of protocol lines (SAY:text, KICK:name, LIST:, LEAVE: and
+* the like, plus DELAY:ms pauses) to be run instead of reading stdin.
+*
+* Parameters:
+*     path: the chat file to load
+*     delay: milliseconds between lines, or 0
+*     rate: lines per second to send at, or 0
+*     timingsPath: file to record each response time in, or NULL
+*
+* Returns:
+*     the loaded script, or NULL if a file could not be opened.
+*/
+struct Script* load_script(char* path, int delay, int rate, 
+        char* timingsPath) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct Script* script = calloc(1, sizeof(struct Script));
+    script->lines = unpack_chatfile(fd, &script->numLines);
+    script->delay = (long long) delay * 1000;
+    script->interval = rate > 0 ? 1000000 / rate : 0;
+    script->sentAt = malloc(sizeof(long long) * (script->numLines + 1));
+    script->awaited = malloc(sizeof(int) * (script->numLines + 1));
+    script->latencies = malloc(sizeof(long long) * (script->numLines + 1));
+
+    if (timingsPath != NULL && 
+            (script->timings = fopen(timingsPath, "w")) == NULL) {
+        return NULL;
+    }
+    return script;
+}
+
+/*
+* Match a response from the server against the oldest line of the same
+* command still awaiting one, recording how long it took. Replies such as
+* LIST: are sent ahead of queued chat, so they may overtake the echo of an
+* earlier SAY:.
+*
+* Parameters:
+*     script: the script being run
+*     command: the command the response answers (SAY or LIST)
+*/
+void record_response(struct Script* script, const char* command) {
+
+    int first = script->firstAwaited;
+    int last = first + script->numAwaited;
+    int match = first;
+
+    while (match < last && strncmp(script->lines[script->awaited[match]],
+            command, strlen(command))) {
+        match += 1;
+    }
+    if (match == last) {
+        return;
+    }
+
+    //Close the gap, keeping the lines still awaited oldest first
+    int line = script->awaited[match];
+    memmove(&script->awaited[first + 1], &script->awaited[first],
+            sizeof(int) * (match - first));
+    script->firstAwaited += 1;
+    script->numAwaited -= 1;
+
+    long long latency = get_time_us() - script->sentAt[line];
+    script->latencies[script->numLatencies++] = latency;
+    if (script->timings != NULL) {
+        fprintf(script->timings, "%d,%s,%lld\n", line + 1, command, latency);
+    }
+}
+
+/*
+* Comparison function for sorting response times with qsort.
+*/
+int compare_latencies(const void* first, const void* second) {
+    long long a = *(const long long*) first;
+    long long b = *(const long long*) second;
+    return (a > b) - (a < b);
+}
+
+/*
+* Report the script's response times to stderr, leave the chat and exit.
+*
+* Parameters:
+*     sockInfo: information required to communicate with the server socket
+*/
+void finish_script(struct SockComms* sockInfo) {
+
+    struct Script* script = sockInfo->script;
+    int count = script->numLatencies;
+    long long total = 0;
+
+    qsort(script->latencies, count, sizeof(long long), compare_latencies);
+    for (int index = 0; index < count; index++) {
+        total += script->latencies[index];
+    }
+
+    fprintf(stderr, "script:LINES:%d:RESPONSES:%d:MISSING:%d:AVG_US:%lld:"
+            "P50_US:%lld:P99_US:%lld:MAX_US:%lld\n", script->next, count,
+            script->numAwaited, count ? total / count : 0,
+            count ? script->latencies[count / 2] : 0,
+            count ? script->latencies[count * 99 / 100] : 0,
+            count ? script->latencies[count - 1] : 0);
+
+    if (script->timings != NULL) {
+        fclose(script->timings);
+    }
+    queue_text(sockInfo, "LEAVE:\n");
+    drain_queue(sockInfo);
     exit(0);
 }
 
 /*
-* Thread function that wraps the server_read function.
+* Queue every script line that is due, then work out how long the client may
+* wait before it next has to act. Nothing more is queued while the send queue
+* is full. Once the script is exhausted (or reaches a
+* LEAVE: line) outstanding responses are waited on for up to DRAIN_TIMEOUT
+* before the client leaves.
 *
 * Parameters:
-*     arg: compulsary void* argument. is actually a pointer to an instance of
-*     struct SockComms
+*     sockInfo: information required to communicate with the server socket
 *
 * Returns:
-*     0
+*     the poll timeout in milliseconds, or -1 to wait for the server.
 */
-void* init_read(void* arg) {
-    usleep(100000);
-    read_in((struct SockComms*) arg);
-    return 0;
+int advance_script(struct SockComms* sockInfo) {
+
+    struct Script* script = sockInfo->script;
+    long long now = get_time_us();
+
+    while (script->next < script->numLines && !sockInfo->send.full) {
+        char* line = script->lines[script->next];
+
+        if (script->delay == 0 && script->interval == 0 &&
+                script->numAwaited > 0) {
+            break;
+        } else if (now < script->nextSend) {
+            break;
+        } else if (!strncmp(line, DELAY ":", 6)) {
+            script->nextSend = now + atoll(line + 6) * 1000;
+            script->next += 1;
+            continue;
+        } else if (!strcmp(line, LEAVE ":")) {
+            script->numLines = script->next;
+            break;
+        }
+
+        queue_text(sockInfo, "%s\n", line);
+        if (!strncmp(line, SAY ":", 4) || !strncmp(line, LIST ":", 5)) {
+            script->sentAt[script->next] = now;
+            script->awaited[script->firstAwaited + script->numAwaited] = 
+                    script->next;
+            script->numAwaited += 1;
+        }
+        script->next += 1;
+
+        if (script->interval > 0) {
+            script->nextSend += script->interval;
+        } else {
+            script->nextSend = now + script->delay;
+        }
+
+        if (script->next == script->numLines) {
+            script->drainUntil = now + DRAIN_TIMEOUT;
+        }
+    }
+
+    long long wakeAt;
+    if (script->next == script->numLines) {
+        if (script->drainUntil == 0) {
+            script->drainUntil = now + DRAIN_TIMEOUT;
+        }
+        if (script->numAwaited == 0 || now >= script->drainUntil) {
+            finish_script(sockInfo);
+        }
+        wakeAt = script->drainUntil;
+    } else if (sockInfo->send.full || (script->delay == 0 &&
+            script->interval == 0 && script->numAwaited > 0)) {
+        return -1;
+    } else {
+        wakeAt = script->nextSend;
+    }
+    return (wakeAt - now + 999) / 1000;
+}
+
+/*
+* Finish the file chunk being received, telling the user about the file if it
+* was the last chunk.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with server socket
+*/
+void finish_download(struct SockComms* sockInfo) {
+
+    struct Download* download = &sockInfo->download;
+
+    if (download->fd >= 0) {
+        close(download->fd);
+    }
+    if (download->notice != NULL) {
+        render(&sockInfo->output, "%s", download->notice);
+        free(download->notice);
+        download->notice = NULL;
+    }
+}
+
+/*
+* Write bytes of the file chunk being received to the file.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with server socket
+*     data: the bytes received
+*     length: the number of bytes in data, at most what the chunk has left
+*/
+void write_download(struct SockComms* sockInfo, char* data, int length) {
+
+    struct Download* download = &sockInfo->download;
+
+    if (download->fd >= 0 && 
+            pwrite(download->fd, data, length, download->offset) != length) {
+        close(download->fd);
+        download->fd = -1;
+    }
+    download->offset += length;
+    download->left -= length;
+
+    if (download->left == 0) {
+        finish_download(sockInfo);
+    }
+}
+
+/*
+* Start receiving a chunk of a file from FILE:sender:filename:size:offset:
+* length. Chunks of different files may come in any order, so the file is
+* opened afresh for each chunk and written to the current directory under the
+* name it was sent with.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with server socket
+*     terms: the terms of the FILE: header
+*/
+void start_download(struct SockComms* sockInfo, char** terms) {
+
+    struct Download* download = &sockInfo->download;
+    char* filename = terms[2];
+    long long size = atoll(terms[3]);
+    bool unsafe = strchr(filename, '/') || !strcmp(filename, ".") || 
+            !strcmp(filename, "..");
+
+    download->offset = atoll(terms[4]);
+    download->left = atoi(terms[5]);
+    download->fd = unsafe ? -1 : open(filename, O_WRONLY | O_CREAT | 
+            O_CLOEXEC | (download->offset == 0 ? O_TRUNC : 0), 0644);
+
+    if (download->offset + download->left == size && download->fd >= 0 &&
+            asprintf(&download->notice, "(%s sent you %s, %lld bytes)\n",
+            terms[1], filename, size) < 0) {
+        download->notice = NULL;
+    } else if (download->offset + download->left == size &&
+            download->fd < 0 && asprintf(&download->notice, 
+            "(%s sent you %s, which could not be saved)\n", terms[1],
+            filename) < 0) {
+        download->notice = NULL;
+    }
+
+    if (download->left == 0) {
+        finish_download(sockInfo);
+    }
 }
 
 /*
@@ -192,162 +986,460 @@ void* init_read(void* arg) {
 *
 * Parameters:
 *     sockInfo: the information needed to communicate with server socket
-*     terms: the terms of the message e.g. MSG:person:hi has terms 
+*     terms: the terms of the message e.g. MSG:person:hi has terms
 *     [MSG, person, hi]
 *     numTerms: the number of terms
-*     okExpected: whether the client was expecting an OK response (in response
-*     to an auth or name request)
 */
-void process_print_messages(struct SockComms* sockInfo, char** terms, 
-        int numTerms, bool* okExpected) {
-    
-    if (numTerms == 1 && strcmp(terms[0], OK) && (*okExpected)) {
+void process_print_messages(struct SockComms* sockInfo, char** terms,
+        int numTerms) {
+
+    struct Output* output = &sockInfo->output;
+
+    if (sockInfo->state == STATE_AUTH) {
+        //Anything but AUTH: or OK: before authenticating means it failed
         fprintf(stderr, "Authentication error\n");
         exit(4);
-    
+
     } else if (numTerms == 1 && !strcmp(terms[0], KICK)) {
+        flush_output(output);
         fprintf(stderr, "Kicked\n");
         exit(3);
     } else if (numTerms == 2 && !strcmp(terms[0], LIST)) {
-        fprintf(stdout, "(current chatters: %s)\n", terms[1]);
-            
+        if (sockInfo->script != NULL) {
+            record_response(sockInfo->script, LIST);
+        }
+        render(output, "(current chatters: %s)\n", terms[1]);
+
     } else if (numTerms == 3 && !strcmp(terms[0], MSG)) {
-        fprintf(stdout, "%s: %s\n", terms[1], terms[2]);
-                        
-    } else if (numTerms == 2 && !strcmp(terms[0], ENTER) && !strcmp(terms[1],
-            select_name(*sockInfo))) {
-        release_lock(sockInfo->authLock);
-        fprintf(stdout, "(%s has entered the chat)\n", terms[1]);
-                        
+        if (sockInfo->script != NULL && 
+                !strcmp(terms[1], sockInfo->joinedName)) {
+            record_response(sockInfo->script, SAY);
+        }
+        render(output, "%s: %s\n", terms[1], terms[2]);
+
+    } else if (numTerms == 3 && !strcmp(terms[0], TELL)) {
+        render(output, "(%s to you) %s\n", terms[1], terms[2]);
+
+    } else if (numTerms == 2 && !strcmp(terms[0], UNKNOWN_NAME)) {
+        render(output, "(no chatter named %s)\n", terms[1]);
+
+    } else if (numTerms == 6 && !strcmp(terms[0], FILE_FRAME)) {
+        start_download(sockInfo, terms);
+
+    } else if (numTerms == 2 && !strcmp(terms[0], REFUSED)) {
+        render(output, "(could not send %s)\n", terms[1]);
+
     } else if (numTerms == 2 && !strcmp(terms[0], ENTER)) {
-        fprintf(stdout, "(%s has entered the chat)\n", terms[1]);
-    
+        if (output->summarise) {
+            output->entered += 1;
+        } else {
+            render(output, "(%s has entered the chat)\n", terms[1]);
+        }
+
     } else if (numTerms == 2 && !strcmp(terms[0], LEAVE)) {
-        fprintf(stdout, "(%s has left the chat)\n", terms[1]);
+        if (output->summarise) {
+            output->left += 1;
+        } else {
+            render(output, "(%s has left the chat)\n", terms[1]);
+        }
     }
 }
 
 /*
-* Function to take in a message from server and process it, reacting and 
-* responding as necessary
+* Create a shared ring and pass it to the server over the Unix socket. The
+* client sends nothing else until the server confirms it has taken the ring
+* up, so no command can overtake one still in the socket.
 *
 * Parameters:
-*     message: the message recieved from the server
-*     sockInfo: the information needed to communicate with with server socket
-*     okExpected: whether the response OK: is expected from the server. If OK
-*     is expected and not received, client will disconnect.
-*
+*     sockInfo: the information needed to communicate with server socket
 *
+* Returns:
+*     whether the ring was offered. If not the socket is used as normal.
 */
-void process_message(char* message, struct SockComms* sockInfo, 
-        bool* okExpected, int* okCount) { 
-    
-    char** terms = malloc(sizeof(char**));
-    int numTerms = unpack_query(terms, message);  
-   
-    if (!strcmp("EOF", message) && !(*okExpected)) {
+bool offer_ring(struct SockComms* sockInfo) {
+
+    if (create_ring(&sockInfo->ring) < 0) {
+        return false;
+    }
+
+    int fds[] = {sockInfo->ring.memfd, sockInfo->ring.eventfd};
+    drain_queue(sockInfo);
+    if (send_with_fds(sockInfo->fd, RING_OFFER, fds, 2) < 0) {
         fprintf(stderr, "Communications error\n");
         exit(2);
+    }
+    return true;
+}
 
-    } else if (numTerms == 1 && !strcmp(terms[0], WHO)) {
-        char* name = select_name(*sockInfo);
-        char* responseTerms[] = {"NAME", name};
-        char* msg = construct_message(responseTerms, 2);
-        write_socket(sockInfo->writeSock, msg);
-        free(name);
-        free(msg);
+/*
+* Mark the client as having joined the chat, from which point it reads stdin
+* or runs its script.
+*
+* Parameters:
+*     sockInfo: the information needed to communicate with server socket
+*/
+void join_chat(struct SockComms* sockInfo) {
+
+    sockInfo->state = STATE_JOINED;
+    if (sockInfo->script != NULL) {
+        sockInfo->script->nextSend = get_time_us();
+    }
+}
+
+/*
+* Function to take in a message from server and process it, reacting and
+* responding as necessary. AUTH: and WHO: prompts that the pipelined replies
+* from start_handshake have already answered are ignored.
+*
+* Parameters:
+*     message: the message recieved from the server
+*     sockInfo: the information needed to communicate with with server socket
+*/
+void process_message(char* message, struct SockComms* sockInfo) {
+
+    char* terms[MAX_TERMS];
+    int numTerms = split_query(terms, MAX_TERMS, message);
+
+    if (numTerms == 1 && !strcmp(terms[0], WHO)) {
+        //Each WHO: asks for one name, which may already be on its way
+        sockInfo->whoCount += 1;
+        if (sockInfo->whoCount > sockInfo->namesSent) {
+            send_name(sockInfo);
+        }
 
     } else if (numTerms == 1 && !strcmp(terms[0], NAME_TAKEN)) {
+        //A server that chooses names never says this to NAME:name:AUTO
+        sockInfo->autoName = false;
         sockInfo->clientNum += 1;
+        send_name(sockInfo);
 
     } else if (numTerms == 1 && !strcmp(terms[0], AUTH)) {
-        char* responseTerms[] = {"AUTH", sockInfo->auth};
-        *okExpected = true;
-        char* msg = construct_message(responseTerms, 2);
-        write_socket(sockInfo->writeSock, msg);
-        free(msg);
-    
-    } else if (numTerms == 1 && !strcmp(terms[0], OK)) {
-        *okExpected = false;
-        *okCount += 1;
+        //Already answered by start_handshake
+
+    } else if (numTerms == 1 && !strcmp(terms[0], PING)) {
+        //The server checking the connection is still alive
+        queue_text(sockInfo, "%s:\n", PONG);
+
+    } else if ((numTerms == 1 || numTerms == 2) && !strcmp(terms[0], OK)) {
+        if (sockInfo->state == STATE_AUTH) {
+            sockInfo->state = STATE_NAME;
+        } else {
+            //OK:name carries the name the server chose
+            sockInfo->joinedName = numTerms == 2 ? strdup(terms[1]) :
+                    select_name(sockInfo);
+            if (sockInfo->useRing && offer_ring(sockInfo)) {
+                sockInfo->state = STATE_RING;
+            } else {
+                join_chat(sockInfo);
+            }
+        }
+
+    } else if (numTerms == 1 && !strcmp(terms[0], SHM) && 
+            sockInfo->state == STATE_RING) {
+        //Everything from here on goes through the ring
+        sockInfo->ringActive = true;
+        join_chat(sockInfo);
+
     } else {
-        process_print_messages(sockInfo, terms, numTerms, okExpected);
+        process_print_messages(sockInfo, terms, numTerms);
     }
 }
 
 /*
-* Function to read messages sent from the server before sending them on for 
-* processing.
+* Render a single summary line for the ENTER: and LEAVE: messages counted
+* while summarising.
+*
+* Parameters:
+*     output: the output the messages were counted in
+*/
+void render_summary(struct Output* output) {
+
+    if (output->entered > 0 && output->left > 0) {
+        render(output, "(%d chatters entered and %d left the chat)\n",
+                output->entered, output->left);
+    } else if (output->entered > 0) {
+        render(output, "(%d chatters entered the chat)\n", output->entered);
+    } else if (output->left > 0) {
+        render(output, "(%d chatters left the chat)\n", output->left);
+    }
+    output->entered = 0;
+    output->left = 0;
+}
+
+/*
+* Write what the last read from the server produced to stdout, unless the
+* client is running a script.
+*
+* Parameters:
+*     sockInfo: the information required to communicate with server socket
+*/
+void show_output(struct SockComms* sockInfo) {
+
+    render_summary(&sockInfo->output);
+    if (sockInfo->script != NULL) {
+        //Headless, nothing is shown
+        sockInfo->output.length = 0;
+    } else {
+        flush_output(&sockInfo->output);
+    }
+}
+
+/*
+* Read the next part of the file chunk being received straight from the
+* server into the file.
+*
+* Parameters:
+*     sockInfo: the information required to communicate with server socket
+*/
+void receive_download(struct SockComms* sockInfo) {
+
+    char buffer[FILE_BUFFER];
+    int length = sockInfo->download.left < FILE_BUFFER ? 
+            sockInfo->download.left : FILE_BUFFER;
+    int numRead = read(sockInfo->fd, buffer, length);
+
+    if (numRead < 0 && errno == EINTR) {
+        return;
+    } else if (numRead <= 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(2);
+    }
+
+    write_download(sockInfo, buffer, numRead);
+}
+
+/*
+* Function to read whatever the server has sent and process every complete
+* message in it. Everything the read produces is rendered into one buffer and
+* written to stdout in a single call. If the read holds a flood of ENTER: and
+* LEAVE: messages they are collapsed into one summary line. The bytes of a
+* file chunk are not lines, and go to the file instead.
 *
 * Parameters:
 *     sockInfo: the informatino required to communicate with server socket
 */
 void server_read(struct SockComms* sockInfo) {
-    
-    //If client receives auth message, it then expects an OK back
-    //If no OK shows up it must have failed auth
-    bool okExpected = false;
-    int okCount = 0;
- 
+
+    struct Download* download = &sockInfo->download;
+    struct LineBuf* input = &sockInfo->input;
+
+    if (download->left > 0) {
+        receive_download(sockInfo);
+        show_output(sockInfo);
+        return;
+    }
+
+    int numRead = fill_linebuf(input, sockInfo->fd);
+
+    if (numRead < 0 && errno == EINTR) {
+        return;
+    } else if (numRead <= 0 && sockInfo->state == STATE_AUTH) {
+        fprintf(stderr, "Authentication error\n");
+        exit(4);
+    } else if (numRead <= 0 && sockInfo->state == STATE_NAME &&
+            sockInfo->autoName) {
+        retry_without_auto(sockInfo);
+        return;
+    } else if (numRead <= 0) {
+        fprintf(stderr, "Communications error\n");
+        exit(2);
+    }
+
+    //Lines stay valid until the next fill_linebuf
+    char* lines[MAX_LINES];
+    bool more = true;
+
+    while (more && download->left == 0) {
+        int numLines = 0;
+        int presence = 0;
+        more = false;
+
+        while (numLines < MAX_LINES && 
+                (lines[numLines] = next_line(input)) != NULL) {
+            char* line = lines[numLines++];
+            if (!strncmp(line, "ENTER:", 6) || !strncmp(line, "LEAVE:", 6)) {
+                presence += 1;
+            } else if (!strncmp(line, FILE_FRAME ":", 5)) {
+                //Its bytes come next, there may be more lines after them
+                more = true;
+                break;
+            }
+        }
+
+        sockInfo->output.summarise = presence > PRESENCE_LIMIT;
+
+        for (int index = 0; index < numLines; index++) {
+            process_message(lines[index], sockInfo);
+        }
+
+        //Bytes of a chunk that arrived along with its header
+        int length = input->end - input->start;
+        if (length > download->left) {
+            length = download->left;
+        }
+        if (length > 0) {
+            write_download(sockInfo, input->data + input->start, length);
+            input->start += length;
+        }
+    }
+
+    show_output(sockInfo);
+}
+
+/*
+* Wait on the server socket and, once the client has joined, stdin, handling
+* whichever is ready. A scripted client never reads stdin and instead wakes
+* whenever its next script line is due. Whatever was queued is sent before
+* each wait, then any file being sent, and the socket is also waited on for
+* room while some is left. stdin is not read while the send queue is full or
+* a file is going out. Never returns, the client exits from the handlers.
+*
+* Parameters:
+*     sockInfo: the information required to communicate with server socket
+*/
+void run_client(struct SockComms* sockInfo) {
+
+    struct LineBuf stdinBuf;
+    init_linebuf(&stdinBuf);
+
+    struct pollfd fds[2];
+    fds[0].fd = sockInfo->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+
     while (true) {
-        
-        char* line = read_input(sockInfo->readSock, false);
-        process_message(line, sockInfo, &okExpected, &okCount);
-    
-        memset(line, '\0', strlen(line));
-        free(line);
+        bool joined = sockInfo->state == STATE_JOINED;
+        if (joined && sockInfo->script == NULL) {
+            //Lines held back while the queue was full
+            process_stdin(sockInfo, &stdinBuf);
+        }
+        int timeout = joined && sockInfo->script != NULL ? 
+                advance_script(sockInfo) : -1;
+
+        bool waiting = flush_queue(sockInfo);
+        bool uploading = sockInfo->upload.header != NULL;
+        bool blocked = uploading && send_upload(sockInfo);
+        if (uploading && sockInfo->upload.header == NULL) {
+            //Lines typed after the file can go now
+            continue;
+        }
+        int numFds = joined && sockInfo->script == NULL &&
+                !sockInfo->send.full && !uploading ? 2 : 1;
+        fds[0].events = (waiting && !sockInfo->ringActive) || blocked ?
+                POLLIN | POLLOUT : POLLIN;
+
+        //A held back file header may be waiting for the ring to empty,
+        //which has no descriptor to wait on
+        if (((waiting && sockInfo->ringActive) || (uploading && !blocked)) &&
+                (timeout < 0 || timeout > RING_RETRY)) {
+            timeout = RING_RETRY;
+        }
+
+        if (poll(fds, numFds, timeout) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & ~POLLOUT) {
+            server_read(sockInfo);
+        }
+        if (numFds == 2 && fds[1].revents) {
+            read_in(sockInfo, &stdinBuf);
+        }
     }
+}
 
+/*
+* Print the client's usage message and exit.
+*/
+void usage_error() {
+    fprintf(stderr, "Usage: client [-f chatfile [-d delayms | -R rate] "
+            "[-o timingsfile]] [-M] name authfile port|socketpath\n");
+    fflush(stderr);
+    exit(1);
 }
 
 /*
-* Attempts to open authfile, does some basic error checking on command line 
-* args. Then attempts to establish a conection to the server before 
+* Attempts to open authfile, does some basic error checking on command line
+* args. Then attempts to establish a conection to the server before
 * continously taking input from server and stdin.
 */
 int main(int argc, char** argv) {
-    
+
     int fd;
+    int opt;
+    char* scriptPath = NULL;
+    char* timingsPath = NULL;
+    int delay = 0;
+    int rate = 0;
+    bool useRing = false;
 
-    if (argc != 4 || (fd = open(argv[2], O_RDONLY)) == -1) {
-        fprintf(stderr, "Usage: client name authfile port\n");
-        fflush(stderr);
-        exit(1);
+    while ((opt = getopt(argc, argv, "f:d:R:o:M")) != -1) {
+        if (opt == 'M') {
+            useRing = true;
+        } else if (opt == 'f') {
+            scriptPath = optarg;
+        } else if (opt == 'o') {
+            timingsPath = optarg;
+        } else if (opt == 'd' && (delay = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 'R' && (rate = atoi(optarg)) > 0) {
+            continue;
+        } else {
+            usage_error();
+        }
+    }
+
+    //Pacing and timings only make sense for a script
+    if ((delay > 0 && rate > 0) || 
+            (scriptPath == NULL && (delay || rate || timingsPath))) {
+        usage_error();
     }
-    
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    //The shared ring is passed over a Unix socket
+    if (argc != 4 || (useRing && strchr(argv[3], '/') == NULL) || 
+            (fd = open(argv[2], O_RDONLY)) == -1) {
+        usage_error();
+    }
+
+    struct Script* script = NULL;
+    if (scriptPath != NULL && 
+            (script = load_script(scriptPath, delay, rate, timingsPath)) == 
+            NULL) {
+        usage_error();
+    }
+
     //Get authentication string
-    FILE* authFile = fdopen(fd, "r");    
+    FILE* authFile = fdopen(fd, "r");
     char* auth = read_input(authFile, true);
+    fclose(authFile);
 
-    FILE* files[2];
+    int sockfd;
 
-    if (init_connection(argv[3], files) == 2) {
+    if (init_connection(argv[3], &sockfd) == 2) {
         fprintf(stderr, "Communications error\n");
         fflush(stderr);
         exit(2);
-    } 
-
-    //Create thread to take input from server
-    struct SockComms* sockComms = malloc(sizeof(struct SockComms*));
-    sockComms->name = malloc(strlen(argv[1]) + 1);
-    strcpy(sockComms->name, argv[1]);
-    sockComms->auth = malloc(strlen(auth) + 1);
-    strcpy(sockComms->auth, auth);
-    sockComms->clientNum = -1;
-    
-    sem_t authLock;
-    init_lock(&authLock);
-    sockComms->authLock = &authLock;
-    
-    sockComms->readSock = files[0];
-    sockComms->writeSock = files[1];     
+    }
 
-    fclose(authFile);
-    
-    pthread_t threadId;
-    pthread_create(&threadId, NULL, init_read, (void*) sockComms);
+    struct SockComms sockComms;
+    memset(&sockComms, 0, sizeof(struct SockComms));
+    sockComms.name = argv[1];
+    sockComms.auth = auth;
+    sockComms.address = argv[3];
+    sockComms.autoName = true;
+    sockComms.clientNum = -1;
+    sockComms.fd = sockfd;
+    sockComms.state = STATE_AUTH;
+    sockComms.script = script;
+    sockComms.useRing = useRing;
+    init_linebuf(&sockComms.input);
 
-    server_read(sockComms);
+    start_handshake(&sockComms);
+    run_client(&sockComms);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,817 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server.h"
+
+//Frames exchanged between servers on a peer link
+#define PEER "PEER"
+#define JOIN "JOIN"
+#define PART "PART"
+#define SAID "SAID"
+#define PING "PING"
+#define PONG "PONG"
+#define PONG_LINE "PONG:\n"
+
+//Messages to send to client, as in server.c
+#define ENTER "ENTER"
+#define LEAVE "LEAVE"
+#define MSG "MSG"
+
+//Most terms any frame has
+#define MAX_FRAME_TERMS 6
+
+//Messages this much older than the newest seen from the same server are
+//taken to be repeats
+#define SEEN_WINDOW 64
+
+//Milliseconds between attempts to dial a peer that is down
+#define REDIAL_DELAY 1000
+
+//Initial number of buckets in the remote name index, doubled as it grows
+#define REMOTE_INDEX_SIZE 64
+
+//Share of its worker's time a link is given, as it speaks for a whole server
+#define LINK_WEIGHT 16
+
+//The messages seen from one server. Bit n of seen is set once message
+//highest minus n has arrived
+struct OriginWindow {
+    char origin[NODE_ID_SIZE];
+    unsigned long highest;
+    unsigned long long seen;
+    struct OriginWindow* next;
+};
+
+/*
+* Queue a frame for one peer link. The terms are joined straight into the
+* link's output, so a link can be sent the whole room without building it
+* anywhere else first. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server the link belongs to
+*     link: the link to send the frame on
+*     terms: the terms of the frame
+*     numTerms: the number of terms
+*/
+void queue_frame(struct ServerInf* server, struct ClientInf* link,
+        char** terms, int numTerms) {
+
+    for (int index = 0; index < numTerms; index++) {
+        if (index > 0) {
+            append_output(server, link, ":", 1);
+        }
+        append_output(server, link, terms[index], strlen(terms[index]));
+    }
+    append_output(server, link, "\n", 1);
+    mark_dirty(server, link);
+    server->federation.framesOut += 1;
+}
+
+/*
+* Queue a frame for every peer link but the one it came in on. Frames queued
+* while a batch is processed leave together, one write per link, when the
+* batch is flushed. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server whose links to send on
+*     except: the link the frame came in on, or NULL if it started here
+*     terms: the terms of the frame
+*     numTerms: the number of terms
+*/
+void send_frame(struct ServerInf* server, struct ClientInf* except,
+        char** terms, int numTerms) {
+
+    for (struct ClientInf* link = server->federation.links; link != NULL;
+            link = link->next) {
+        if (link != except) {
+            queue_frame(server, link, terms, numTerms);
+        }
+    }
+}
+
+/*
+* Check whether a message from another server has been seen before, and
+* remember it if not. A message that comes round a loop of links, or by two
+* routes at once, is only taken the first time.
+*
+* Parameters:
+*     federation: the federation the message came through
+*     origin: the server the message was said on
+*     sequence: the message's number on that server, counted from 1
+*
+* Returns:
+*     whether the message has been seen before and should be dropped.
+*/
+bool already_seen(struct Federation* federation, char* origin,
+        unsigned long sequence) {
+
+    struct OriginWindow* window = federation->windows;
+    while (window != NULL && strcmp(window->origin, origin)) {
+        window = window->next;
+    }
+
+    if (window == NULL) {
+        window = calloc(1, sizeof(struct OriginWindow));
+        snprintf(window->origin, NODE_ID_SIZE, "%s", origin);
+        window->next = federation->windows;
+        federation->windows = window;
+    }
+
+    if (sequence > window->highest) {
+        unsigned long shift = sequence - window->highest;
+        window->seen = shift >= SEEN_WINDOW ? 0 : window->seen << shift;
+        window->seen |= 1;
+        window->highest = sequence;
+        return false;
+    }
+
+    unsigned long age = window->highest - sequence;
+    if (age >= SEEN_WINDOW || (window->seen >> age) & 1) {
+        return true;
+    }
+    window->seen |= 1ULL << age;
+    return false;
+}
+
+/*
+* Double the number of buckets in the remote name index and rehash every
+* remote chatter into the new buckets.
+*
+* Parameters:
+*     federation: the federation whose index to grow
+*/
+void grow_remote_index(struct Federation* federation) {
+
+    int newSize = federation->indexSize * 2;
+    struct RemoteUser** buckets = calloc(newSize, sizeof(struct RemoteUser*));
+
+    for (int index = 0; index < federation->indexSize; index++) {
+        struct RemoteUser* current = federation->remoteIndex[index];
+
+        while (current != NULL) {
+            struct RemoteUser* next = current->hashNext;
+            unsigned int bucket = hash_name(current->name) % newSize;
+            current->hashNext = buckets[bucket];
+            buckets[bucket] = current;
+            current = next;
+        }
+    }
+
+    free(federation->remoteIndex);
+    federation->remoteIndex = buckets;
+    federation->indexSize = newSize;
+}
+
+/*
+* Look up a chatter on another server by name. Must be called with the roster
+* lock held.
+*
+* Parameters:
+*     federation: the federation to search
+*     origin: the server the chatter is on, or NULL for any server
+*     name: the chatter's name
+*
+* Returns:
+*     the chatter, or NULL if there is no such chatter.
+*/
+struct RemoteUser* find_remote(struct Federation* federation, char* origin,
+        char* name) {
+
+    struct RemoteUser* current =
+            federation->remoteIndex[hash_name(name) % federation->indexSize];
+
+    while (current != NULL && (strcmp(current->name, name) ||
+            (origin != NULL && strcmp(current->origin, origin)))) {
+        current = current->hashNext;
+    }
+    return current;
+}
+
+/*
+* Add a chatter on another server to the room and tell everyone here that
+* they have entered. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server learning of the chatter
+*     origin: the server the chatter is on
+*     name: the chatter's name
+*     via: the link the chatter was announced on
+*/
+void add_remote(struct ServerInf* server, char* origin, char* name,
+        struct ClientInf* via) {
+
+    struct Federation* federation = &server->federation;
+    struct RemoteUser* remote = calloc(1, sizeof(struct RemoteUser));
+    remote->name = strdup(name);
+    remote->origin = strdup(origin);
+    remote->via = via;
+
+    //Name order, as LIST: merges these with the roster
+    struct RemoteUser** link = &federation->remotes;
+    struct RemoteUser* previous = NULL;
+    while (*link != NULL && !are_ordered(name, (*link)->name)) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+    remote->next = *link;
+    remote->prev = previous;
+    if (*link != NULL) {
+        (*link)->prev = remote;
+    }
+    *link = remote;
+
+    if (federation->numRemotes >= federation->indexSize) {
+        grow_remote_index(federation);
+    }
+    unsigned int bucket = hash_name(name) % federation->indexSize;
+    remote->hashNext = federation->remoteIndex[bucket];
+    federation->remoteIndex[bucket] = remote;
+    federation->numRemotes += 1;
+
+    char* msgTerms[] = {ENTER, name};
+    broadcast_message(server, arena_message(&via->worker->arena, msgTerms, 2));
+    fprintf(stdout, "(%s has entered the chat)\n", name);
+}
+
+/*
+* Take a chatter on another server out of the room and tell everyone here
+* that they have left. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server the chatter is known to
+*     remote: the chatter who has left
+*     arena: where to build the LEAVE: message
+*/
+void remove_remote(struct ServerInf* server, struct RemoteUser* remote,
+        struct Arena* arena) {
+
+    struct Federation* federation = &server->federation;
+
+    if (remote->prev == NULL) {
+        federation->remotes = remote->next;
+    } else {
+        remote->prev->next = remote->next;
+    }
+    if (remote->next != NULL) {
+        remote->next->prev = remote->prev;
+    }
+
+    struct RemoteUser** link = &federation->remoteIndex[
+            hash_name(remote->name) % federation->indexSize];
+    while (*link != remote) {
+        link = &(*link)->hashNext;
+    }
+    *link = remote->hashNext;
+    federation->numRemotes -= 1;
+
+    char* msgTerms[] = {LEAVE, remote->name};
+    broadcast_message(server, arena_message(arena, msgTerms, 2));
+    fprintf(stdout, "(%s has left the chat)\n", remote->name);
+
+    free(remote->name);
+    free(remote->origin);
+    free(remote);
+}
+
+/*
+* Send a new link everyone this server knows to be in the room: its own
+* roster and the chatters it has heard of from its other links.
+*
+* Parameters:
+*     server: the server the link belongs to
+*     link: the new link
+*/
+void sync_roster(struct ServerInf* server, struct ClientInf* link) {
+
+    struct Federation* federation = &server->federation;
+
+    for (struct ClientInf* client = server->head; client != NULL;
+            client = client->next) {
+        char* terms[] = {JOIN, federation->nodeId, client->name};
+        queue_frame(server, link, terms, 3);
+    }
+
+    for (struct RemoteUser* remote = federation->remotes; remote != NULL;
+            remote = remote->next) {
+        if (remote->via != link) {
+            char* terms[] = {JOIN, remote->origin, remote->name};
+            queue_frame(server, link, terms, 3);
+        }
+    }
+}
+
+/*
+* Find the link to a server.
+*
+* Parameters:
+*     federation: the federation to search
+*     nodeId: the id of the server
+*
+* Returns:
+*     the link, or NULL if there is none.
+*/
+struct ClientInf* find_link(struct Federation* federation, char* nodeId) {
+
+    for (struct ClientInf* link = federation->links; link != NULL;
+            link = link->next) {
+        if (!strcmp(link->name, nodeId)) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+/*
+* Find the dialer that dialed a link.
+*
+* Parameters:
+*     federation: the federation the link is in
+*     link: the link
+*
+* Returns:
+*     the dialer, or NULL if the other end dialed the link.
+*/
+struct PeerDialer* find_dialer(struct Federation* federation,
+        struct ClientInf* link) {
+
+    for (int index = 0; index < federation->numDialers; index++) {
+        if (federation->dialers[index].fd == link->fd) {
+            return &federation->dialers[index];
+        }
+    }
+    return NULL;
+}
+
+/*
+* Tell the dialer of a link that has gone that it may dial again. Must be
+* called with the roster lock held.
+*
+* Parameters:
+*     federation: the federation the link was in
+*     link: the link that has gone
+*/
+void release_dialer(struct Federation* federation, struct ClientInf* link) {
+
+    struct PeerDialer* dialer = find_dialer(federation, link);
+    if (dialer != NULL) {
+        dialer->fd = -1;
+        release_lock(&dialer->closed);
+    }
+}
+
+/*
+* Replace a link with a second one to the same server. Chatters announced on
+* the old link are now reached through the new one, so nobody leaves, and
+* the old link is closed by its worker. Must be called with the roster lock
+* held.
+*
+* Parameters:
+*     server: the server the links belong to
+*     old: the link being replaced
+*     link: the link replacing it
+*/
+void retire_link(struct ServerInf* server, struct ClientInf* old,
+        struct ClientInf* link) {
+
+    struct Federation* federation = &server->federation;
+
+    delete_client(&federation->links, old);
+    federation->numLinks -= 1;
+    for (struct RemoteUser* remote = federation->remotes; remote != NULL;
+            remote = remote->next) {
+        if (remote->via == old) {
+            remote->via = link;
+        }
+    }
+
+    old->state = CONN_GONE;
+    release_dialer(federation, old);
+    disconnect_client(server, old);
+}
+
+/*
+* Make a connection that has said which server it is into a peer link, and
+* send it the room. A link to this server is refused. Two servers that dial
+* each other end up with two links, so of a second link to the same server
+* both ends keep the one dialed by the lower id and drop the other. A refused
+* link that the other end dialed is still told this server's id, so that its
+* dialer knows it is already linked here. Must be called with the roster lock
+* held.
+*
+* Parameters:
+*     server: the server the link belongs to
+*     link: the connection
+*     nodeId: the id of the server at the other end
+*     reply: whether to tell the other end this server's id, as it dialed
+*
+* Returns:
+*     false if the link was refused and should be closed, true otherwise.
+*/
+bool add_link(struct ServerInf* server, struct ClientInf* link, char* nodeId,
+        bool reply) {
+
+    struct Federation* federation = &server->federation;
+    char* terms[] = {PEER, federation->nodeId};
+
+    if (strlen(nodeId) >= NODE_ID_SIZE || !strcmp(nodeId, federation->nodeId)) {
+        return false;
+    }
+
+    struct PeerDialer* dialer = find_dialer(federation, link);
+    if (dialer != NULL) {
+        strcpy(dialer->peerId, nodeId);
+    }
+
+    struct ClientInf* old = find_link(federation, nodeId);
+    if (old != NULL) {
+        char* dialedBy = reply ? nodeId : federation->nodeId;
+        char* oldDialedBy = find_dialer(federation, old) == NULL ? nodeId :
+                federation->nodeId;
+
+        if (strcmp(dialedBy, oldDialedBy) >= 0) {
+            if (reply) {
+                queue_frame(server, link, terms, 2);
+            }
+            return false;
+        }
+        retire_link(server, old, link);
+    }
+
+    set_name(link, nodeId, strlen(nodeId));
+    link->state = CONN_PEER;
+    link->weight = LINK_WEIGHT;
+    link->prev = NULL;
+    link->next = federation->links;
+    if (federation->links != NULL) {
+        federation->links->prev = link;
+    }
+    federation->links = link;
+    federation->numLinks += 1;
+
+    if (reply) {
+        queue_frame(server, link, terms, 2);
+    }
+    sync_roster(server, link);
+    return true;
+}
+
+/*
+* Called for a PEER: line from a connection that has authenticated, which is
+* another server dialing in rather than a chatter choosing a name.
+*
+* Parameters:
+*     server: the server dialed
+*     link: the connection
+*     nodeId: the id of the server that dialed
+*
+* Returns:
+*     false if the link was refused and should be closed, true otherwise.
+*/
+bool join_federation(struct ServerInf* server, struct ClientInf* link,
+        char* nodeId) {
+
+    lock_clients(server);
+    bool linked = add_link(server, link, nodeId, true);
+    flush_messages(server);
+    unlock_clients(server);
+    return linked;
+}
+
+/*
+* Take a peer link that is going away out of the federation. Everyone who
+* was announced on it leaves the room, here and on the other links. The
+* link's dialer, if this server dialed it, is told to dial again, as are
+* dialers that were waiting on this link to the same peer. Must be called
+* with the roster lock held.
+*
+* Parameters:
+*     server: the server the link belongs to
+*     link: the link going away
+*/
+void drop_link(struct ServerInf* server, struct ClientInf* link) {
+
+    struct Federation* federation = &server->federation;
+
+    //A dialed link that never got an answer was never added
+    if (link->name != NULL) {
+        delete_client(&federation->links, link);
+        federation->numLinks -= 1;
+
+        struct RemoteUser* remote = federation->remotes;
+        while (remote != NULL) {
+            struct RemoteUser* next = remote->next;
+            if (remote->via == link) {
+                char* terms[] = {PART, remote->origin, remote->name};
+                send_frame(server, NULL, terms, 3);
+                remove_remote(server, remote, &link->worker->arena);
+            }
+            remote = next;
+        }
+
+        for (int index = 0; index < federation->numDialers; index++) {
+            struct PeerDialer* dialer = &federation->dialers[index];
+            if (dialer->idle && !strcmp(dialer->peerId, link->name)) {
+                dialer->idle = false;
+                release_lock(&dialer->closed);
+            }
+        }
+    }
+
+    release_dialer(federation, link);
+}
+
+/*
+* Given a frame from a peer link, apply it here and pass it on to every other
+* link. Entering and leaving only change anything once, and messages carry
+* their server's id and number, so a frame that comes round again is dropped
+* instead of passed on and links may form loops. A server that loses a link
+* sends PART: for everyone it heard of on it, though they may still be
+* reachable another way. So a chatter only leaves when the link they were
+* announced on says so, and a server that still reaches them announces them
+* back to the sender. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server the frame was received by
+*     link: the link the frame was received on
+*     line: the frame
+*
+* Returns:
+*     whether the link should now be torn down.
+*/
+bool process_frame(struct ServerInf* server, struct ClientInf* link,
+        char* line) {
+
+    struct Federation* federation = &server->federation;
+    char* terms[MAX_FRAME_TERMS];
+    int numTerms = split_query(terms, MAX_FRAME_TERMS, line);
+
+    //The prompts of the other side's handshake come before its PEER:
+    if (link->name == NULL) {
+        return numTerms == 2 && !strcmp(PEER, terms[0]) &&
+                !add_link(server, link, terms[1], false);
+    }
+
+    //Heartbeats only show the link is alive, and are not passed on
+    if (numTerms == 1 && !strcmp(PING, terms[0])) {
+        queue_message(server, link, PONG_LINE);
+        return false;
+    } else if (numTerms == 1 && !strcmp(PONG, terms[0])) {
+        return false;
+    }
+
+    federation->framesIn += 1;
+    struct RemoteUser* remote;
+
+    if (numTerms == 3 && !strcmp(JOIN, terms[0]) &&
+            strcmp(terms[1], federation->nodeId) &&
+            find_remote(federation, terms[1], terms[2]) == NULL) {
+        add_remote(server, terms[1], terms[2], link);
+
+    } else if (numTerms == 3 && !strcmp(PART, terms[0]) &&
+            !strcmp(terms[1], federation->nodeId)) {
+        //The sender has lost its route to a chatter here. Announce them to
+        //it again if they are still in the room
+        if (find_client(server, terms[2]) != NULL) {
+            terms[0] = JOIN;
+            queue_frame(server, link, terms, 3);
+        }
+        federation->dropped += 1;
+        return false;
+
+    } else if (numTerms == 3 && !strcmp(PART, terms[0]) &&
+            (remote = find_remote(federation, terms[1], terms[2])) != NULL) {
+        if (remote->via != link) {
+            //Still reached by another route, so the sender has only lost
+            //its own. Announce the chatter back to it over this one
+            terms[0] = JOIN;
+            queue_frame(server, link, terms, 3);
+            federation->dropped += 1;
+            return false;
+        }
+        remove_remote(server, remote, &link->worker->arena);
+
+    } else if (numTerms == 5 && !strcmp(SAID, terms[0]) &&
+            strcmp(terms[1], federation->nodeId) &&
+            !already_seen(federation, terms[1], strtoul(terms[2], NULL, 10))) {
+        char* msgTerms[] = {MSG, terms[3], terms[4]};
+        broadcast_said(server, NULL, terms[3], terms[4],
+                arena_message(&link->worker->arena, msgTerms, 3));
+        fprintf(stdout, "%s: %s\n", terms[3], terms[4]);
+
+    } else {
+        federation->dropped += 1;
+        return false;
+    }
+
+    send_frame(server, link, terms, numTerms);
+    return false;
+}
+
+/*
+* Tell every peer link that a chatter has joined this server. Must be called
+* with the roster lock held.
+*
+* Parameters:
+*     server: the server joined
+*     name: the chatter's name
+*/
+void relay_join(struct ServerInf* server, char* name) {
+
+    char* terms[] = {JOIN, server->federation.nodeId, name};
+    send_frame(server, NULL, terms, 3);
+}
+
+/*
+* Tell every peer link that a chatter has left this server. Must be called
+* with the roster lock held.
+*
+* Parameters:
+*     server: the server left
+*     name: the chatter's name
+*/
+void relay_part(struct ServerInf* server, char* name) {
+
+    char* terms[] = {PART, server->federation.nodeId, name};
+    send_frame(server, NULL, terms, 3);
+}
+
+/*
+* Pass a chat message said on this server to every peer link, numbered so
+* that other servers can tell repeats apart. Must be called with the roster
+* lock held.
+*
+* Parameters:
+*     server: the server the message was said on
+*     name: the name of the chatter who said it
+*     text: what was said
+*/
+void relay_said(struct ServerInf* server, char* name, char* text) {
+
+    struct Federation* federation = &server->federation;
+
+    if (federation->links == NULL) {
+        return;
+    }
+
+    char sequence[24];
+    snprintf(sequence, sizeof(sequence), "%lu", ++federation->sequence);
+    char* terms[] = {SAID, federation->nodeId, sequence, name, text};
+    send_frame(server, NULL, terms, 5);
+}
+
+/*
+* Connect to a peer server.
+*
+* Parameters:
+*     address: the peer's host and port, as host:port
+*
+* Returns:
+*     the connected socket, or -1 if the peer could not be reached.
+*/
+int dial_peer(char* address) {
+
+    char* colon = strrchr(address, ':');
+    char* host = strndup(address, colon - address);
+    struct addrinfo hints;
+    struct addrinfo* ai = NULL;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int fd = -1;
+    if (getaddrinfo(host, colon + 1, &hints, &ai) == 0) {
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(ai);
+    }
+    free(host);
+
+    if (fd >= 0) {
+        int optVal = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+    }
+    return fd;
+}
+
+/*
+* Thread function for a dialer. Keeps a link open to one peer, dialing it
+* again a moment after the link drops or the peer cannot be reached. The
+* link authenticates like a chatter, then says which server it is with PEER:
+* instead of choosing a name, and is served by the workers from then on.
+* While the peer has another link to this server, such as one it dialed
+* itself, the dialer waits for that link to drop instead of dialing.
+*
+* Parameters:
+*     arg: compulsary void* arg to thread function. Actually the dialer this
+*     thread runs as.
+*
+* Returns:
+*     compulsary void* return value. Never returns.
+*/
+void* dialer_thread(void* arg) {
+
+    struct PeerDialer* dialer = (struct PeerDialer*) arg;
+    struct ServerInf* server = dialer->server;
+    char hello[LINEBUF_SIZE];
+
+    TRACE_THREAD("dialer");
+    int length = snprintf(hello, sizeof(hello), "AUTH:%s\n%s:%s\n",
+            server->auth, PEER, server->federation.nodeId);
+
+    while (true) {
+        int fd = dial_peer(dialer->address);
+
+        if (fd < 0 || send(fd, hello, length, MSG_NOSIGNAL) != length) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            usleep(REDIAL_DELAY * 1000);
+            continue;
+        }
+
+        struct ClientInf* link = new_client(server, fd);
+        link->state = CONN_PEER;
+        lock_clients(server);
+        dialer->fd = fd;
+        unlock_clients(server);
+        submit_client(server, link);
+
+        do {
+            take_lock(&dialer->closed);
+            lock_clients(server);
+            dialer->idle = find_link(&server->federation, dialer->peerId) !=
+                    NULL;
+            unlock_clients(server);
+        } while (dialer->idle);
+        usleep(REDIAL_DELAY * 1000);
+    }
+
+    return (void*) 0;
+}
+
+/*
+* Choose this server's id in the federation and start dialing every peer
+* given with -P. The id is random, so a restarted server is a new node and
+* its messages are never mistaken for repeats of its old ones.
+*
+* Parameters:
+*     server: the server joining the federation
+*/
+void init_federation(struct ServerInf* server) {
+
+    struct Federation* federation = &server->federation;
+    struct ServerConfig* config = server->config;
+    unsigned long long id;
+
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        id = (unsigned long long) get_time_us() ^
+                ((unsigned long long) getpid() << 32);
+    }
+    snprintf(federation->nodeId, NODE_ID_SIZE, "%016llx", id);
+
+    federation->indexSize = REMOTE_INDEX_SIZE;
+    federation->remoteIndex = calloc(REMOTE_INDEX_SIZE,
+            sizeof(struct RemoteUser*));
+    federation->dialers = calloc(config->numPeers, sizeof(struct PeerDialer));
+    federation->numDialers = config->numPeers;
+
+    for (int index = 0; index < config->numPeers; index++) {
+        struct PeerDialer* dialer = &federation->dialers[index];
+        dialer->address = config->peers[index];
+        dialer->fd = -1;
+        dialer->server = server;
+        sem_init(&dialer->closed, 0, 0);
+        pthread_create(&dialer->threadId, NULL, dialer_thread, dialer);
+        pthread_detach(dialer->threadId);
+    }
+}
+
+/*
+* Print this server's place in the federation: its id, its links, how many
+* chatters it knows of on other servers and how many frames it has passed.
+*
+* Parameters:
+*     server: the server to report on
+*/
+void print_federation_stats(struct ServerInf* server) {
+
+    struct Federation* federation = &server->federation;
+
+    fprintf(stderr, "@FEDERATION@\n");
+    fprintf(stderr, "federation:NODE:%s:LINKS:%d:REMOTE_USERS:%d:"
+            "FRAMES_IN:%lld:FRAMES_OUT:%lld:DROPPED:%lld\n",
+            federation->nodeId, federation->numLinks, federation->numRemotes,
+            federation->framesIn, federation->framesOut, federation->dropped);
+}
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server.h"
+
+//Most items of each kind one client may filter on
+#define MAX_FILTERS 64
+
+//Names of the filter kinds in FILTER: commands, in enum FilterKind order
+const char* filterNames[NUM_FILTER_KINDS] = {"ALLOW", "DENY", "PREFIX",
+        "KEYWORD"};
+
+//A state of the keyword matcher. Children are chained through sibling, and
+//dict is the nearest state along the failure links that has outputs
+struct MatchNode {
+    unsigned char byte;
+    int depth;
+    int child;
+    int sibling;
+    int fail;
+    int dict;
+    int output;
+};
+
+//A subscriber's prefix or keyword ending at a state, chained through next
+struct MatchOutput {
+    struct ClientFilter* filter;
+    enum FilterKind kind;
+    int next;
+};
+
+//A subscriber allowing or denying a sender, chained through next in its
+//bucket of the sender index
+struct SenderRule {
+    char* name;
+    struct ClientFilter* filter;
+    bool deny;
+    int next;
+};
+
+/*
+* Find the child of a matcher state reached on the given byte.
+*
+* Parameters:
+*     nodes: the matcher's states
+*     node: the state to look under
+*     byte: the next byte of text
+*
+* Returns:
+*     the child state, or -1 if there is none.
+*/
+int find_child(struct MatchNode* nodes, int node, unsigned char byte) {
+
+    for (int child = nodes[node].child; child != -1;
+            child = nodes[child].sibling) {
+        if (nodes[child].byte == byte) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+/*
+* Add a subscriber's prefix or keyword to the matcher's trie.
+*
+* Parameters:
+*     filters: the filter set being compiled
+*     filter: the subscriber the pattern belongs to
+*     kind: FILTER_PREFIX or FILTER_KEYWORD
+*     pattern: the text to match
+*/
+void insert_pattern(struct FilterSet* filters, struct ClientFilter* filter,
+        enum FilterKind kind, char* pattern) {
+
+    struct MatchNode* nodes = filters->nodes;
+    int node = 0;
+
+    for (unsigned char* next = (unsigned char*) pattern; *next; next++) {
+        int child = find_child(nodes, node, *next);
+
+        if (child == -1) {
+            child = filters->numNodes++;
+            nodes[child].byte = *next;
+            nodes[child].depth = nodes[node].depth + 1;
+            nodes[child].child = -1;
+            nodes[child].sibling = nodes[node].child;
+            nodes[child].output = -1;
+            nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    struct MatchOutput* output = &filters->outputs[filters->numOutputs];
+    output->filter = filter;
+    output->kind = kind;
+    output->next = nodes[node].output;
+    nodes[node].output = filters->numOutputs++;
+}
+
+/*
+* Work out the failure and dictionary links of every matcher state, breadth
+* first so that each state's links are known before its children's.
+*
+* Parameters:
+*     filters: the filter set being compiled
+*/
+void link_states(struct FilterSet* filters) {
+
+    struct MatchNode* nodes = filters->nodes;
+    int* queue = malloc(sizeof(int) * filters->numNodes);
+    int first = 0;
+    int last = 0;
+
+    nodes[0].fail = 0;
+    nodes[0].dict = -1;
+    queue[last++] = 0;
+
+    while (first < last) {
+        int node = queue[first++];
+
+        for (int child = nodes[node].child; child != -1;
+                child = nodes[child].sibling) {
+            int fail = 0;
+
+            if (node != 0) {
+                fail = nodes[node].fail;
+                while (fail != 0 &&
+                        find_child(nodes, fail, nodes[child].byte) == -1) {
+                    fail = nodes[fail].fail;
+                }
+                int next = find_child(nodes, fail, nodes[child].byte);
+                fail = next != -1 ? next : 0;
+            }
+
+            nodes[child].fail = fail;
+            nodes[child].dict = nodes[fail].output != -1 ? fail :
+                    nodes[fail].dict;
+            queue[last++] = child;
+        }
+    }
+
+    free(queue);
+}
+
+/*
+* Rebuild the shared matcher from every subscriber's filters: one
+* Aho-Corasick automaton over all prefixes and keywords, and one hash index
+* of all allowed and denied senders.
+*
+* Parameters:
+*     server: the server whose filters have changed
+*/
+void compile_filters(struct ServerInf* server) {
+
+    struct FilterSet* filters = &server->filters;
+    int numPatterns = 0;
+    int numChars = 0;
+    int numRules = 0;
+
+    for (struct ClientFilter* filter = filters->head; filter != NULL;
+            filter = filter->next) {
+        numRules += filter->counts[FILTER_ALLOW] + filter->counts[FILTER_DENY];
+        for (int kind = FILTER_PREFIX; kind <= FILTER_KEYWORD; kind++) {
+            numPatterns += filter->counts[kind];
+            for (int index = 0; index < filter->counts[kind]; index++) {
+                numChars += strlen(filter->items[kind][index]);
+            }
+        }
+    }
+
+    free(filters->nodes);
+    free(filters->outputs);
+    free(filters->rules);
+    free(filters->buckets);
+
+    filters->nodes = malloc(sizeof(struct MatchNode) * (numChars + 1));
+    filters->outputs = malloc(sizeof(struct MatchOutput) * (numPatterns + 1));
+    filters->numNodes = 1;
+    filters->numOutputs = 0;
+    memset(filters->nodes, 0, sizeof(struct MatchNode));
+    filters->nodes[0].child = -1;
+    filters->nodes[0].output = -1;
+
+    filters->numBuckets = 16;
+    while (filters->numBuckets < numRules * 2) {
+        filters->numBuckets *= 2;
+    }
+    filters->buckets = malloc(sizeof(int) * filters->numBuckets);
+    memset(filters->buckets, -1, sizeof(int) * filters->numBuckets);
+    filters->rules = malloc(sizeof(struct SenderRule) * (numRules + 1));
+    int numAdded = 0;
+
+    for (struct ClientFilter* filter = filters->head; filter != NULL;
+            filter = filter->next) {
+        for (int kind = FILTER_ALLOW; kind < NUM_FILTER_KINDS; kind++) {
+            for (int index = 0; index < filter->counts[kind]; index++) {
+                char* item = filter->items[kind][index];
+
+                if (kind == FILTER_PREFIX || kind == FILTER_KEYWORD) {
+                    insert_pattern(filters, filter, kind, item);
+                    continue;
+                }
+
+                unsigned int bucket = hash_name(item) &
+                        (filters->numBuckets - 1);
+                struct SenderRule* rule = &filters->rules[numAdded];
+                rule->name = item;
+                rule->filter = filter;
+                rule->deny = kind == FILTER_DENY;
+                rule->next = filters->buckets[bucket];
+                filters->buckets[bucket] = numAdded++;
+            }
+        }
+    }
+
+    link_states(filters);
+    filters->stale = false;
+}
+
+/*
+* Mark the subscribers that the given sender or text matches, so that
+* wants_message can then decide for each one in constant time. The work done
+* depends on the length of the text and the number of matches, not on how
+* many clients have filters.
+*
+* Parameters:
+*     server: the server the message is being sent on
+*     sender: the name of the client that sent the message
+*     text: the text of the message
+*/
+void mark_subscribers(struct ServerInf* server, char* sender, char* text) {
+
+    struct FilterSet* filters = &server->filters;
+
+    if (filters->head == NULL) {
+        return;
+    } else if (filters->stale) {
+        compile_filters(server);
+    }
+
+    //Zero is never a current epoch, so fresh filters start unmarked
+    filters->epoch += 1;
+    if (filters->epoch == 0) {
+        filters->epoch = 1;
+    }
+    unsigned int epoch = filters->epoch;
+
+    unsigned int bucket = hash_name(sender) & (filters->numBuckets - 1);
+    for (int index = filters->buckets[bucket]; index != -1;
+            index = filters->rules[index].next) {
+        struct SenderRule* rule = &filters->rules[index];
+        if (!strcmp(rule->name, sender)) {
+            if (rule->deny) {
+                rule->filter->denyMark = epoch;
+            } else {
+                rule->filter->allowMark = epoch;
+            }
+        }
+    }
+
+    if (filters->numOutputs == 0) {
+        return;
+    }
+
+    struct MatchNode* nodes = filters->nodes;
+    int state = 0;
+
+    for (int position = 0; text[position] != '\0'; position++) {
+        unsigned char byte = text[position];
+        int next;
+
+        while ((next = find_child(nodes, state, byte)) == -1 && state != 0) {
+            state = nodes[state].fail;
+        }
+        state = next != -1 ? next : 0;
+
+        int node = nodes[state].output != -1 ? state : nodes[state].dict;
+        for (; node > 0; node = nodes[node].dict) {
+            for (int index = nodes[node].output; index != -1;
+                    index = filters->outputs[index].next) {
+                struct MatchOutput* output = &filters->outputs[index];
+
+                //A prefix only counts if it started at the first byte
+                if (output->kind == FILTER_KEYWORD ||
+                        nodes[node].depth == position + 1) {
+                    output->filter->contentMark = epoch;
+                }
+            }
+        }
+    }
+}
+
+/*
+* Decide whether a client wants the message last passed to mark_subscribers.
+* Denied senders are always dropped, and if the client has allowed senders or
+* content filters the message must match at least one of each.
+*
+* Parameters:
+*     server: the server the message is being sent on
+*     client: the client that may receive the message
+*
+* Returns:
+*     whether the message should be sent to the client.
+*/
+bool wants_message(struct ServerInf* server, struct ClientInf* client) {
+
+    struct ClientFilter* filter = client->filter;
+    unsigned int epoch = server->filters.epoch;
+
+    if (filter == NULL) {
+        return true;
+    } else if (filter->denyMark == epoch) {
+        return false;
+    } else if (filter->counts[FILTER_ALLOW] && filter->allowMark != epoch) {
+        return false;
+    } else if ((filter->counts[FILTER_PREFIX] ||
+            filter->counts[FILTER_KEYWORD]) && filter->contentMark != epoch) {
+        return false;
+    }
+    return true;
+}
+
+/*
+* Register a filter for a client, as given in a FILTER:kind:text command.
+* Must be called with the clients lock held.
+*
+* Parameters:
+*     server: the server the client is on
+*     client: the client registering the filter
+*     kindName: ALLOW, DENY, PREFIX or KEYWORD
+*     text: the sender name or text to filter on
+*
+* Returns:
+*     whether the filter was added.
+*/
+bool add_filter(struct ServerInf* server, struct ClientInf* client,
+        char* kindName, char* text) {
+
+    int kind = 0;
+    while (kind < NUM_FILTER_KINDS && strcmp(kindName, filterNames[kind])) {
+        kind += 1;
+    }
+
+    if (kind == NUM_FILTER_KINDS || *text == '\0') {
+        return false;
+    }
+
+    struct ClientFilter* filter = client->filter;
+
+    if (filter == NULL) {
+        filter = calloc(1, sizeof(struct ClientFilter));
+        filter->next = server->filters.head;
+        server->filters.head = filter;
+        client->filter = filter;
+    } else if (filter->counts[kind] == MAX_FILTERS) {
+        return false;
+    }
+
+    filter->items[kind] = realloc(filter->items[kind],
+            sizeof(char*) * (filter->counts[kind] + 1));
+    filter->items[kind][filter->counts[kind]++] = strdup(text);
+    server->filters.stale = true;
+    return true;
+}
+
+/*
+* Remove all of a client's filters, so that it receives every message again.
+* Must be called with the clients lock held.
+*
+* Parameters:
+*     server: the server the client is on
+*     client: the client whose filters are removed
+*/
+void clear_filters(struct ServerInf* server, struct ClientInf* client) {
+
+    struct ClientFilter* filter = client->filter;
+
+    if (filter == NULL) {
+        return;
+    }
+
+    struct ClientFilter** link = &server->filters.head;
+    while (*link != filter) {
+        link = &(*link)->next;
+    }
+    *link = filter->next;
+
+    for (int kind = 0; kind < NUM_FILTER_KINDS; kind++) {
+        for (int index = 0; index < filter->counts[kind]; index++) {
+            free(filter->items[kind][index]);
+        }
+        free(filter->items[kind]);
+    }
+    free(filter);
+
+    client->filter = NULL;
+    server->filters.stale = true;
+}
@@ -0,0 +1,852 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+//Identifies a handoff from a compatible server
+#define HANDOFF_MAGIC 0x43484f33
+
+//Most file descriptors passed in one message, below the kernel's SCM_MAX_FD
+#define FDS_PER_MESSAGE 250
+
+//Record kind for a connection still in the accept queue
+#define HANDOFF_PENDING -1
+
+//Everything about the old server that is not per connection. The listening
+//sockets come attached to it. captureConns is the last number given to a
+//connection in its capture
+struct HandoffHeader {
+    int magic;
+    int numListeners;
+    int numRecords;
+    int numFds;
+    size_t dataLength;
+    int serverStats[NUM_SVR_STATS];
+    long long batches;
+    long long batchedLines;
+    unsigned int captureConns;
+};
+
+//One connection in the snapshot, followed in the data by its name, whatever
+//partial line it had sent, the output it had not yet been able to take
+//(midLine set if it had been sent part of its first line) and
+//its filters as kind:text lines. Its socket, then the memfd and eventfd of
+//its ring if it has one, are passed in the same order as the records, and
+//numFds counts only these. A file it was sending follows, as its recipient
+//and (unless it was refused) its spool, with uploadLeft bytes still to come.
+//Then come the numFiles files queued to be sent to it
+struct HandoffRecord {
+    int kind;
+    int numFds;
+    unsigned int connId;
+    int clientStats[NUM_CLI_STATS];
+    int nameLength;
+    int inputLength;
+    int outputLength;
+    int filterLength;
+    bool discarding;
+    bool midLine;
+    bool uploading;
+    bool uploadSpooled;
+    long uploadLeft;
+    int recipientLength;
+    int numFiles;
+};
+
+//A spool in the snapshot, followed in the data by the sender and the
+//filename. Its file is passed after the connection's other descriptors. A
+//file whose chunk had started going out also carries the chunk's FILE:
+//header, of which the bytes before start have been sent
+struct HandoffFile {
+    int size;
+    int offset;
+    int chunkEnd;
+    int start;
+    int end;
+    int senderLength;
+    int filenameLength;
+    bool inProgress;
+};
+
+//What a new server takes over from the old one
+struct Snapshot {
+    struct HandoffHeader header;
+    char* data;
+    int* fds;
+    long long started;
+};
+
+//Snapshot data while it is being built
+struct SnapshotData {
+    char* data;
+    size_t length;
+    size_t capacity;
+    int* fds;
+    int numFds;
+    int fdCapacity;
+    int numRecords;
+};
+
+/*
+* Write all of a buffer to a socket, however many writes it takes.
+*
+* Parameters:
+*     fd: the socket to write to
+*     data: the bytes to write
+*     length: the number of bytes to write
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int write_all(int fd, const void* data, size_t length) {
+
+    const char* next = data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, next, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written <= 0) {
+            return -1;
+        }
+        next += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/*
+* Read exactly length bytes from a socket.
+*
+* Parameters:
+*     fd: the socket to read from
+*     data: where to put the bytes
+*     length: the number of bytes to read
+*
+* Returns:
+*     0 on success, -1 on failure or early end of file.
+*/
+int read_all(int fd, void* data, size_t length) {
+
+    char* next = data;
+
+    while (length > 0) {
+        ssize_t numRead = read(fd, next, length);
+        if (numRead < 0 && errno == EINTR) {
+            continue;
+        } else if (numRead <= 0) {
+            return -1;
+        }
+        next += numRead;
+        length -= numRead;
+    }
+    return 0;
+}
+
+/*
+* Send a fixed size block with up to FDS_PER_MESSAGE descriptors attached.
+*
+* Parameters:
+*     sock: the Unix socket to send on
+*     data: the block to send
+*     length: the size of the block
+*     fds: the descriptors to pass
+*     numFds: the number of descriptors to pass
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int send_block(int sock, const void* data, size_t length, int* fds,
+        int numFds) {
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void*) data, .iov_len = length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (numFds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+    }
+
+    ssize_t sent = sendmsg(sock, &msg, 0);
+    if (sent < 0) {
+        return -1;
+    }
+    return write_all(sock, (const char*) data + sent, length - sent);
+}
+
+/*
+* Receive a block sent by send_block along with its descriptors.
+*
+* Parameters:
+*     sock: the Unix socket to receive on
+*     data: where to put the block
+*     length: the size of the block
+*     fds: filled with the descriptors received
+*     maxFds: the most descriptors expected
+*
+* Returns:
+*     the number of descriptors received, or -1 on failure.
+*/
+int receive_block(int sock, void* data, size_t length, int* fds,
+        int maxFds) {
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = data, .iov_len = length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t numRead = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (numRead <= 0) {
+        return -1;
+    }
+
+    int numFds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* passed = (int*) CMSG_DATA(cmsg);
+        for (int index = 0; index < count; index++) {
+            if (numFds < maxFds) {
+                fds[numFds++] = passed[index];
+            } else {
+                close(passed[index]);
+            }
+        }
+    }
+
+    if (read_all(sock, (char*) data + numRead, length - numRead) < 0) {
+        return -1;
+    }
+    return numFds;
+}
+
+/*
+* Append bytes to the snapshot data, growing it by doubling.
+*
+* Parameters:
+*     snapshot: the snapshot being built
+*     bytes: the bytes to append
+*     length: the number of bytes
+*/
+void append_data(struct SnapshotData* snapshot, const void* bytes,
+        size_t length) {
+
+    if (snapshot->length + length > snapshot->capacity) {
+        while (snapshot->length + length > snapshot->capacity) {
+            snapshot->capacity = snapshot->capacity * 2 + 4096;
+        }
+        snapshot->data = realloc(snapshot->data, snapshot->capacity);
+    }
+    memcpy(snapshot->data + snapshot->length, bytes, length);
+    snapshot->length += length;
+}
+
+/*
+* Append a descriptor to be passed with the snapshot.
+*
+* Parameters:
+*     snapshot: the snapshot being built
+*     fd: the descriptor to pass
+*/
+void append_fd(struct SnapshotData* snapshot, int fd) {
+
+    if (snapshot->numFds == snapshot->fdCapacity) {
+        snapshot->fdCapacity = snapshot->fdCapacity * 2 + 64;
+        snapshot->fds = realloc(snapshot->fds,
+                sizeof(int) * snapshot->fdCapacity);
+    }
+    snapshot->fds[snapshot->numFds++] = fd;
+}
+
+/*
+* Add a spool to the snapshot, with where the block sending it had got to.
+*
+* Parameters:
+*     snapshot: the snapshot being built
+*     spool: the spool to add
+*     block: the output block sending it, or NULL for a file still arriving
+*     inProgress: whether the block's chunk has started going out
+*/
+void snapshot_spool(struct SnapshotData* snapshot, struct Spool* spool,
+        struct OutBlock* block, bool inProgress) {
+
+    struct HandoffFile file;
+    memset(&file, 0, sizeof(struct HandoffFile));
+    file.size = spool->size;
+    file.senderLength = strlen(spool->sender);
+    file.filenameLength = strlen(spool->filename);
+    file.inProgress = inProgress;
+    if (block != NULL) {
+        file.offset = block->offset;
+        file.chunkEnd = block->chunkEnd;
+    }
+    if (inProgress) {
+        file.start = block->start;
+        file.end = block->end;
+    }
+
+    append_data(snapshot, &file, sizeof(struct HandoffFile));
+    if (inProgress) {
+        append_data(snapshot, block->data, file.end);
+    }
+    append_data(snapshot, spool->sender, file.senderLength);
+    append_data(snapshot, spool->filename, file.filenameLength);
+    append_fd(snapshot, spool->fd);
+}
+
+/*
+* Add a connection to the snapshot: its name, statistics, partial input,
+* pending output and descriptors, and any file it is sending or being sent.
+* Spool files are passed on as they are, so a file part way through carries
+* on from where it was.
+*
+* Parameters:
+*     snapshot: the snapshot being built
+*     client: the connection to add
+*/
+void snapshot_client(struct SnapshotData* snapshot,
+        struct ClientInf* client) {
+
+    struct HandoffRecord record;
+    memset(&record, 0, sizeof(struct HandoffRecord));
+    record.kind = client->state;
+    record.numFds = client->ring != NULL ? 3 : 1;
+    record.connId = client->connId;
+    memcpy(record.clientStats, client->clientStats,
+            sizeof(int) * NUM_CLI_STATS);
+    record.nameLength = client->name != NULL ? strlen(client->name) : 0;
+    record.midLine = client->midLine;
+    if (client->input != NULL) {
+        record.inputLength = client->input->end - client->input->start;
+        record.discarding = client->input->discarding;
+    }
+    for (struct OutBlock* block = client->outHead; block != NULL;
+            block = block->next) {
+        if (block->spool == NULL) {
+            record.outputLength += block->end - block->start;
+        } else {
+            record.numFiles += 1;
+        }
+    }
+    if (client->upload != NULL) {
+        record.uploading = true;
+        record.uploadSpooled = client->upload->spool != NULL;
+        record.uploadLeft = client->upload->left;
+        record.recipientLength = strlen(client->upload->recipient);
+    }
+
+    //Filters are written out after the record, then the length filled in
+    size_t recordOffset = snapshot->length;
+    append_data(snapshot, &record, sizeof(struct HandoffRecord));
+    append_data(snapshot, client->name, record.nameLength);
+    if (client->input != NULL) {
+        append_data(snapshot, client->input->data + client->input->start,
+                record.inputLength);
+    }
+    for (struct OutBlock* block = client->outHead; block != NULL;
+            block = block->next) {
+        if (block->spool == NULL) {
+            append_data(snapshot, block->data + block->start,
+                    block->end - block->start);
+        }
+    }
+
+    size_t filterStart = snapshot->length;
+    for (int kind = 0; client->filter != NULL && kind < NUM_FILTER_KINDS;
+            kind++) {
+        for (int index = 0; index < client->filter->counts[kind]; index++) {
+            char* item = client->filter->items[kind][index];
+            append_data(snapshot, filterNames[kind],
+                    strlen(filterNames[kind]));
+            append_data(snapshot, ":", 1);
+            append_data(snapshot, item, strlen(item));
+            append_data(snapshot, "\n", 1);
+        }
+    }
+    record.filterLength = snapshot->length - filterStart;
+    memcpy(snapshot->data + recordOffset, &record,
+            sizeof(struct HandoffRecord));
+
+    append_fd(snapshot, client->fd);
+    if (client->ring != NULL) {
+        append_fd(snapshot, client->ring->memfd);
+        append_fd(snapshot, client->ring->eventfd);
+    }
+
+    if (client->upload != NULL) {
+        append_data(snapshot, client->upload->recipient,
+                record.recipientLength);
+        if (client->upload->spool != NULL) {
+            snapshot_spool(snapshot, client->upload->spool, NULL, false);
+        }
+    }
+
+    //Only the head block can have started sending its chunk
+    for (struct OutBlock* block = client->outHead; block != NULL;
+            block = block->next) {
+        if (block->spool != NULL) {
+            snapshot_spool(snapshot, block->spool, block,
+                    block == client->outHead && block->start > 0);
+        }
+    }
+    snapshot->numRecords += 1;
+}
+
+/*
+* Build the snapshot of every live connection. Joined clients are taken in
+* roster order, then those still in their handshake, then connections no
+* worker has taken up yet. Clients already on their way out are left behind.
+* Must only be called once every worker is parked.
+*
+* Parameters:
+*     server: the server to snapshot
+*     snapshot: filled in with the snapshot
+*/
+void build_snapshot(struct ServerInf* server,
+        struct SnapshotData* snapshot) {
+
+    memset(snapshot, 0, sizeof(struct SnapshotData));
+
+    for (struct ClientInf* client = server->head; client != NULL;
+            client = client->next) {
+        snapshot_client(snapshot, client);
+    }
+
+    //Every connection a worker has taken up has a timer in its wheel
+    for (int index = 0; index < server->pool.numWorkers; index++) {
+        struct TimerWheel* wheel = &server->pool.workers[index].wheel;
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+                for (struct Timer* timer = wheel->slots[level][slot];
+                        timer != NULL; timer = timer->next) {
+                    struct ClientInf* client = timer_client(timer);
+                    if (client->state == CONN_AUTH || 
+                            client->state == CONN_NAME) {
+                        snapshot_client(snapshot, client);
+                    }
+                }
+            }
+        }
+    }
+
+    //The acceptors are parked too, so every queued connection is published
+    struct ConnQueue* queue = &server->pool.queue;
+    for (unsigned long position = queue->dequeuePos;
+            position != queue->enqueuePos; position++) {
+        struct PendingConn* pending =
+                &queue->slots[position & queue->mask].conn;
+
+        if (pending->client != NULL) {
+            //Restored by this server but never taken up, pass it on as is
+            //unless it has since been kicked
+            if (pending->client->state != CONN_GONE && 
+                    pending->client->state != CONN_PEER) {
+                snapshot_client(snapshot, pending->client);
+            }
+            continue;
+        }
+
+        struct HandoffRecord record;
+        memset(&record, 0, sizeof(struct HandoffRecord));
+        record.kind = HANDOFF_PENDING;
+        record.numFds = 1;
+        append_data(snapshot, &record, sizeof(struct HandoffRecord));
+        append_fd(snapshot, pending->fd);
+        snapshot->numRecords += 1;
+    }
+}
+
+/*
+* Send the snapshot and every descriptor to the server taking over.
+*
+* Parameters:
+*     server: the server being handed off
+*     listeners: the listening sockets to hand over
+*     sock: the connection to the new server
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int send_snapshot(struct ServerInf* server,
+        struct Listeners* listeners, int sock) {
+
+    struct SnapshotData snapshot;
+    build_snapshot(server, &snapshot);
+
+    struct HandoffHeader header;
+    memset(&header, 0, sizeof(struct HandoffHeader));
+    header.magic = HANDOFF_MAGIC;
+    header.numRecords = snapshot.numRecords;
+    header.numFds = snapshot.numFds;
+    header.dataLength = snapshot.length;
+    memcpy(header.serverStats, server->serverStats,
+            sizeof(int) * NUM_SVR_STATS);
+    header.batches = server->batches;
+    header.batchedLines = server->batchedLines;
+    header.captureConns = last_capture_conn(server);
+
+    int listenFds[] = {listeners->serverfd, listeners->unixfd};
+    header.numListeners = listeners->unixfd >= 0 ? 2 : 1;
+
+    int result = send_block(sock, &header, sizeof(struct HandoffHeader),
+            listenFds, header.numListeners);
+    if (result == 0) {
+        result = write_all(sock, snapshot.data, snapshot.length);
+    }
+
+    for (int sent = 0; result == 0 && sent < snapshot.numFds;
+            sent += FDS_PER_MESSAGE) {
+        int count = snapshot.numFds - sent < FDS_PER_MESSAGE ?
+                snapshot.numFds - sent : FDS_PER_MESSAGE;
+        result = send_block(sock, &count, sizeof(int), snapshot.fds + sent,
+                count);
+    }
+
+    //Wait for the new server to say it has everything
+    char ack;
+    if (result == 0 && read_all(sock, &ack, 1) < 0) {
+        result = -1;
+    }
+
+    free(snapshot.data);
+    free(snapshot.fds);
+    return result;
+}
+
+/*
+* Hand the whole server over to a new process that has connected to the
+* handoff socket, if it runs as the same user as this one. Workers are
+* parked at a safe point, then the listening sockets, every connection and a
+* snapshot of the roster are passed across and this process exits without
+* closing anything the new server now owns. If the handoff fails this server
+* carries on as before.
+*
+* Parameters:
+*     server: the server being handed off
+*     listeners: the listening sockets
+*/
+void hand_off(struct ServerInf* server, struct Listeners* listeners) {
+
+    int sock = accept(listeners->handoffFd, NULL, NULL);
+    if (sock < 0) {
+        return;
+    }
+
+    //Whoever connects is given every connection, so only this user may
+    struct ucred cred;
+    socklen_t credLength = sizeof(struct ucred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credLength) < 0 ||
+            cred.uid != geteuid()) {
+        close(sock);
+        fprintf(stderr, "Handoff refused\n");
+        return;
+    }
+
+    park_workers(&server->pool);
+    lock_clients(server);
+    fflush(stdout);
+
+    int result = send_snapshot(server, listeners, sock);
+
+    if (result == 0) {
+        finish_capture(server);
+        fprintf(stderr, "Handed off to new server\n");
+        fflush(stderr);
+        _exit(0);
+    }
+
+    unlock_clients(server);
+    resume_workers(&server->pool);
+    close(sock);
+    fprintf(stderr, "Handoff failed\n");
+}
+
+/*
+* Take over from a server listening on the handoff socket, if there is one.
+*
+* Parameters:
+*     path: the handoff socket's path
+*     listeners: filled in with the inherited listening sockets
+*
+* Returns:
+*     the old server's snapshot, or NULL if there was no server to take over
+*     from and this one should start afresh.
+*/
+struct Snapshot* take_over(const char* path, struct Listeners* listeners) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(struct sockaddr_un))) {
+        close(sock);
+        return NULL;
+    }
+
+    struct Snapshot* snapshot = calloc(1, sizeof(struct Snapshot));
+    snapshot->started = get_time_us();
+    struct HandoffHeader* header = &snapshot->header;
+    int listenFds[2];
+
+    int numListeners = receive_block(sock, header,
+            sizeof(struct HandoffHeader), listenFds, 2);
+    if (numListeners < 1 || header->magic != HANDOFF_MAGIC ||
+            numListeners != header->numListeners) {
+        close(sock);
+        free(snapshot);
+        return NULL;
+    }
+
+    snapshot->data = malloc(header->dataLength + 1);
+    snapshot->fds = malloc(sizeof(int) * (header->numFds + 1));
+    int received = 0;
+    bool ok = read_all(sock, snapshot->data, header->dataLength) == 0;
+
+    while (ok && received < header->numFds) {
+        int count;
+        int numFds = receive_block(sock, &count, sizeof(int),
+                snapshot->fds + received, header->numFds - received);
+        ok = numFds > 0 && numFds == count;
+        received += numFds > 0 ? numFds : 0;
+    }
+
+    if (!ok || write_all(sock, "", 1) < 0) {
+        //The old server carries on, so only our copies are closed
+        for (int index = 0; index < received; index++) {
+            close(snapshot->fds[index]);
+        }
+        for (int index = 0; index < numListeners; index++) {
+            close(listenFds[index]);
+        }
+        close(sock);
+        free(snapshot->data);
+        free(snapshot->fds);
+        free(snapshot);
+        return NULL;
+    }
+
+    close(sock);
+    listeners->serverfd = listenFds[0];
+    listeners->unixfd = numListeners == 2 ? listenFds[1] : -1;
+    return snapshot;
+}
+
+/*
+* Re-register the filters a client had on the old server.
+*
+* Parameters:
+*     server: the new server
+*     client: the restored client
+*     lines: the client's filters as kind:text lines
+*     length: the number of bytes of filter lines
+*/
+void restore_filters(struct ServerInf* server, struct ClientInf* client,
+        char* lines, int length) {
+
+    char* end = lines + length;
+
+    while (lines < end) {
+        char* newline = memchr(lines, '\n', end - lines);
+        char* colon = memchr(lines, ':', newline - lines);
+        *newline = '\0';
+        if (colon != NULL) {
+            *colon = '\0';
+            add_filter(server, client, lines, colon + 1);
+        }
+        lines = newline + 1;
+    }
+}
+
+/*
+* Read a spool back from the snapshot.
+*
+* Parameters:
+*     next: where the spool starts in the snapshot, moved on past it
+*     fds: the spool's descriptor, moved on past it
+*     file: filled in with the spool's record
+*
+* Returns:
+*     the spool, holding one reference for the caller.
+*/
+struct Spool* restore_spool(char** next, int** fds, struct HandoffFile* file) {
+
+    memcpy(file, *next, sizeof(struct HandoffFile));
+    char* sender = *next + sizeof(struct HandoffFile) + file->end;
+    char* filename = sender + file->senderLength;
+    *next = filename + file->filenameLength;
+
+    sender = strndup(sender, file->senderLength);
+    filename = strndup(filename, file->filenameLength);
+    struct Spool* spool = new_spool(*(*fds)++, sender, filename, file->size);
+    free(sender);
+    free(filename);
+    return spool;
+}
+
+/*
+* Rebuild the old server's state from its snapshot and hand every connection
+* to the worker pool. The roster arrives already in order so it is linked up
+* directly. Connections that were mid-handshake get a fresh deadline, and
+* ones that were still queued start their handshake from scratch. Files
+* carry on from where they were, a chunk already part way out going ahead of
+* the rest of the output. The roster
+* is rebuilt under the clients lock, and the connections only queued for the
+* workers once it is released, as queueing may have to wait on them.
+*
+* Parameters:
+*     server: the new server, with its pool already running
+*     snapshot: the snapshot taken over, which is freed
+*/
+void restore_snapshot(struct ServerInf* server, struct Snapshot* snapshot) {
+
+    struct HandoffHeader* header = &snapshot->header;
+    char* next = snapshot->data;
+    int* fds = snapshot->fds;
+    struct ClientInf* tail = NULL;
+    struct PendingConn* restored = 
+            calloc(header->numRecords + 1, sizeof(struct PendingConn));
+
+    lock_clients(server);
+    memcpy(server->serverStats, header->serverStats,
+            sizeof(int) * NUM_SVR_STATS);
+    server->batches = header->batches;
+    server->batchedLines = header->batchedLines;
+    resume_capture(server, header->captureConns);
+
+    for (int index = 0; index < header->numRecords; index++) {
+        struct HandoffRecord record;
+        memcpy(&record, next, sizeof(struct HandoffRecord));
+        next += sizeof(struct HandoffRecord);
+
+        if (record.kind == HANDOFF_PENDING) {
+            restored[index].fd = *fds++;
+            continue;
+        }
+
+        struct ClientInf* client = new_client(server, *fds++);
+        memcpy(client->clientStats, record.clientStats,
+                sizeof(int) * NUM_CLI_STATS);
+        client->state = record.kind;
+        client->connId = record.connId;
+
+        if (record.nameLength > 0) {
+            set_name(client, next, record.nameLength);
+            next += record.nameLength;
+        }
+
+        if (record.inputLength > 0 || record.discarding) {
+            struct LineBuf* input = take_input(server, client);
+            memcpy(input->data, next, record.inputLength);
+            input->end = record.inputLength;
+            input->discarding = record.discarding;
+            next += record.inputLength;
+        }
+        char* output = next;
+        char* filters = output + record.outputLength;
+        next = filters + record.filterLength;
+
+        if (record.numFds == 3) {
+            client->ring = malloc(sizeof(struct ShmRing));
+            if (attach_ring(client->ring, fds[0], fds[1]) < 0) {
+                free(client->ring);
+                client->ring = NULL;
+            }
+            fds += 2;
+        }
+
+        struct HandoffFile file;
+        struct Spool* spool = NULL;
+        if (record.uploading) {
+            char* recipient = strndup(next, record.recipientLength);
+            next += record.recipientLength;
+            if (record.uploadSpooled) {
+                spool = restore_spool(&next, &fds, &file);
+            }
+            resume_upload(client, recipient, record.uploadLeft, spool);
+            free(recipient);
+        }
+
+        //Only the first file can have had its chunk started
+        int files = 0;
+        if (record.numFiles > 0 &&
+                ((struct HandoffFile*) next)->inProgress) {
+            char* chunk = next + sizeof(struct HandoffFile);
+            spool = restore_spool(&next, &fds, &file);
+            resume_chunk(server, client, spool, file.offset, file.chunkEnd,
+                    chunk, file.start, file.end);
+            release_spool(spool);
+            files = 1;
+        }
+
+        append_output(server, client, output, record.outputLength);
+        client->midLine = record.midLine;
+        restore_filters(server, client, filters, record.filterLength);
+
+        for (; files < record.numFiles; files++) {
+            spool = restore_spool(&next, &fds, &file);
+            resume_file(server, client, spool, file.offset);
+            release_spool(spool);
+        }
+
+        if (client->state == CONN_JOINED) {
+            if (tail == NULL) {
+                server->head = client;
+            } else {
+                tail->next = client;
+            }
+            client->prev = tail;
+            tail = client;
+            index_client(server, client);
+            client->weight = client_weight(server->config, client->name);
+        }
+        restored[index].client = client;
+    }
+    unlock_clients(server);
+
+    for (int index = 0; index < header->numRecords; index++) {
+        if (restored[index].client != NULL) {
+            submit_client(server, restored[index].client);
+        } else if (reserve_slot(&server->pool)) {
+            submit_connections(server, &restored[index].fd, 1);
+        }
+    }
+    free(restored);
+
+    fprintf(stderr, "Took over %d connections in %lld us\n",
+            header->numRecords, get_time_us() - snapshot->started);
+    fflush(stderr);
+
+    free(snapshot->data);
+    free(snapshot->fds);
+    free(snapshot);
+}
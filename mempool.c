@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include "mempool.h"
+#include "sharedfunc.h"
+
+//Everything handed out is aligned to this many bytes
+#define ALIGNMENT 16
+
+//An allocation too large for what is left of the arena's block
+struct ArenaSpill {
+    struct ArenaSpill* next;
+    char data[] __attribute__((aligned(ALIGNMENT)));
+};
+
+/*
+* Initialise an arena with a block of the given size. The block is allocated
+* once here and reused after every reset.
+*
+* Parameters:
+*     arena: the arena to initialise
+*     size: the number of bytes in the arena's block
+*/
+void init_arena(struct Arena* arena, size_t size) {
+    arena->block = malloc(size);
+    arena->size = size;
+    arena->used = 0;
+    arena->overflow = NULL;
+}
+
+/*
+* Hand out memory from an arena. It must not be freed, it is reclaimed by the
+* next reset_arena.
+*
+* Parameters:
+*     arena: the arena to allocate from
+*     bytes: the number of bytes needed
+*
+* Returns:
+*     the allocated memory.
+*/
+void* arena_alloc(struct Arena* arena, size_t bytes) {
+
+    size_t rounded = (bytes + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+
+    if (arena->size - arena->used >= rounded) {
+        void* result = arena->block + arena->used;
+        arena->used += rounded;
+        return result;
+    }
+
+    struct ArenaSpill* spill = malloc(sizeof(struct ArenaSpill) + bytes);
+    spill->next = arena->overflow;
+    arena->overflow = spill;
+    return spill->data;
+}
+
+/*
+* Reclaim everything handed out by an arena since it was last reset.
+*
+* Parameters:
+*     arena: the arena to reset
+*/
+void reset_arena(struct Arena* arena) {
+    
+    while (arena->overflow != NULL) {
+        struct ArenaSpill* next = arena->overflow->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->used = 0;
+}
+
+/*
+* Arena counterpart to construct_message. Joins terms into a colon delimited,
+* newline terminated message allocated from the arena.
+*
+* Parameters:
+*     arena: the arena to allocate the message from
+*     terms: the terms to construct into a message
+*     numTerms: the number of terms in terms
+*
+* Returns:
+*     the constructed message
+*/
+char* arena_message(struct Arena* arena, char** terms, int numTerms) {
+
+    size_t length = numTerms + 1;
+    for (int index = 0; index < numTerms; index++) {
+        length += strlen(terms[index]);
+    }
+
+    char* message = arena_alloc(arena, length);
+    char* end = message;
+
+    for (int index = 0; index < numTerms; index++) {
+        if (index > 0) {
+            *end++ = ':';
+        }
+        size_t termLength = strlen(terms[index]);
+        memcpy(end, terms[index], termLength);
+        end += termLength;
+    }
+    *end++ = '\n';
+    *end = '\0';
+
+    return message;
+}
+
+/*
+* Initialise an empty slab. Memory is only allocated once objects are asked
+* for.
+*
+* Parameters:
+*     slab: the slab to initialise
+*     objSize: the size of each object handed out
+*     perChunk: how many objects to carve out of each allocation
+*/
+void init_slab(struct Slab* slab, size_t objSize, int perChunk) {
+    
+    //Free objects hold the free list link in their first bytes
+    if (objSize < sizeof(void*)) {
+        objSize = sizeof(void*);
+    }
+    slab->objSize = (objSize + ALIGNMENT - 1) & ~((size_t) ALIGNMENT - 1);
+    slab->perChunk = perChunk;
+    slab->freeList = NULL;
+    slab->inUse = 0;
+    slab->allocated = 0;
+    init_lock(&slab->lock);
+}
+
+/*
+* Take an object from a slab, growing it by another chunk if none are free.
+* Safe to call from any thread.
+*
+* Parameters:
+*     slab: the slab to take the object from
+*
+* Returns:
+*     the object, with unspecified contents.
+*/
+void* slab_alloc(struct Slab* slab) {
+
+    take_lock(&slab->lock);
+
+    if (slab->freeList == NULL) {
+        char* chunk = malloc(slab->objSize * slab->perChunk);
+        for (int index = slab->perChunk - 1; index >= 0; index--) {
+            void** obj = (void**) (chunk + index * slab->objSize);
+            *obj = slab->freeList;
+            slab->freeList = obj;
+        }
+        slab->allocated += slab->perChunk;
+    }
+
+    void** obj = slab->freeList;
+    slab->freeList = *obj;
+    slab->inUse += 1;
+
+    release_lock(&slab->lock);
+    return obj;
+}
+
+/*
+* Give an object back to the slab it came from.
+*
+* Parameters:
+*     slab: the slab the object was taken from
+*     obj: the object to give back
+*/
+void slab_free(struct Slab* slab, void* obj) {
+
+    take_lock(&slab->lock);
+    *(void**) obj = slab->freeList;
+    slab->freeList = obj;
+    slab->inUse -= 1;
+    release_lock(&slab->lock);
+}
+
+/*
+* Report how much of a slab is in use and how much memory it holds.
+*
+* Parameters:
+*     slab: the slab to report on
+*     inUse: set to the number of objects handed out
+*
+* Returns:
+*     the bytes allocated for the slab's chunks.
+*/
+size_t slab_usage(struct Slab* slab, int* inUse) {
+
+    take_lock(&slab->lock);
+    *inUse = slab->inUse;
+    size_t bytes = slab->objSize * slab->allocated;
+    release_lock(&slab->lock);
+    return bytes;
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <semaphore.h>
+
+//Memory handed out for one message and thrown away in one go afterwards.
+//Requests that do not fit in the block spill into overflow, which is freed
+//on reset
+struct Arena {
+    char* block;
+    size_t size;
+    size_t used;
+    struct ArenaSpill* overflow;
+};
+
+//Pool of fixed size objects carved out of larger chunks that are never given
+//back, so a steady number of clients means a steady amount of memory
+struct Slab {
+    size_t objSize;
+    int perChunk;
+    void* freeList;
+    int inUse;
+    int allocated;
+    sem_t lock;
+};
+
+void init_arena(struct Arena* arena, size_t size);
+void* arena_alloc(struct Arena* arena, size_t bytes);
+void reset_arena(struct Arena* arena);
+char* arena_message(struct Arena* arena, char** terms, int numTerms);
+void init_slab(struct Slab* slab, size_t objSize, int perChunk);
+void* slab_alloc(struct Slab* slab);
+void slab_free(struct Slab* slab, void* obj);
+size_t slab_usage(struct Slab* slab, int* inUse);
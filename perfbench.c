@@ -0,0 +1,934 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include "sharedfunc.h"
+
+//Authentication string the benchmarked servers are started with
+#define PERF_AUTH "perf"
+
+//Most connections any workload uses
+#define MAX_CONNS 1024
+
+//Most events taken from epoll at once
+#define MAX_EVENTS 64
+
+//Microseconds any workload may take before it is abandoned
+#define WORKLOAD_TIMEOUT 30000000
+
+//Sizes of the workloads
+#define STORM_CLIENTS 500
+#define FANOUT_RECEIVERS 100
+#define FANOUT_SENDERS 4
+#define FANOUT_MESSAGES 1000
+#define FANOUT_RATE 1000
+#define LIST_IDLE 300
+#define LIST_REQUESTERS 8
+#define LIST_REQUESTS 2000
+#define KICK_CYCLES 300
+
+//Default number of runs of each workload, the median of which is reported
+#define DEFAULT_RUNS 7
+
+//Default percentages a throughput and a latency may be worse than the
+//baseline's by. Latencies of a few tens of microseconds swing more
+#define DEFAULT_THRESHOLD 25
+#define DEFAULT_LATENCY_THRESHOLD 50
+
+//Metrics reported for each workload, in the order they are written
+#define NUM_METRICS 3
+
+//Names of the workloads as they appear in the results, in run order
+const char* workloadNames[] = {"join_storm", "say_fanout", "list_heavy",
+        "kick_churn"};
+#define NUM_WORKLOADS 4
+
+//Names of the metrics. Throughput is better higher, latencies lower
+const char* metricNames[NUM_METRICS] = {"throughput", "p50_us", "p99_us"};
+
+//A benchmark connection. joined counts the OK: replies seen, the second of
+//which means the client is in the chat. sentAt is when the request being
+//timed went out
+struct PerfConn {
+    int fd;
+    int oks;
+    bool joined;
+    bool closed;
+    long long sentAt;
+    int remaining;
+    struct LineBuf input;
+};
+
+//A workload in progress. on_line is called for every line a connection
+//receives. latencies collects a sample for every timed operation
+struct Bench {
+    char port[16];
+    int epollfd;
+    struct PerfConn conns[MAX_CONNS];
+    int numConns;
+    long long* latencies;
+    int numLatencies;
+    int capacity;
+    long long done;
+    void (*on_line)(struct Bench* bench, struct PerfConn* conn, char* line);
+};
+
+//What one run of a workload measured
+struct Result {
+    double metrics[NUM_METRICS];
+};
+
+//What one server measured over every run of a workload: the median of each
+//metric, and the lowest and highest value any run gave
+struct Summary {
+    struct Result median;
+    struct Result low;
+    struct Result high;
+};
+
+/*
+* Start a server to benchmark on an ephemeral port, with its chat log thrown
+* away.
+*
+* Parameters:
+*     serverPath: the server binary
+*     authPath: a file holding the authentication string
+*     port: filled in with the port the server is listening on
+*
+* Returns:
+*     the server's process id, or -1 if it could not be started.
+*/
+pid_t start_server(const char* serverPath, const char* authPath, char* port) {
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        execl(serverPath, serverPath, "-m", "4096", authPath, "0",
+                (char*) NULL);
+        _exit(2);
+    }
+    close(fds[1]);
+
+    //The server prints its port on the first line of stderr
+    FILE* err = fdopen(fds[0], "r");
+    if (pid < 0 || fgets(port, 16, err) == NULL || atoi(port) <= 0) {
+        fclose(err);
+        return -1;
+    }
+    port[strcspn(port, "\n")] = '\0';
+
+    //Anything else it says is read and dropped so it never blocks
+    if (fork() == 0) {
+        char line[256];
+        while (fgets(line, sizeof(line), err) != NULL) {
+        }
+        _exit(0);
+    }
+    fclose(err);
+    return pid;
+}
+
+/*
+* Stop a benchmarked server and wait for it to exit.
+*
+* Parameters:
+*     pid: the server's process id
+*/
+void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+* Open a connection to the benchmarked server and add it to the workload.
+*
+* Parameters:
+*     bench: the workload in progress
+*
+* Returns:
+*     the new connection, or NULL if the server could not be reached.
+*/
+struct PerfConn* open_conn(struct Bench* bench) {
+
+    struct addrinfo* ai = NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (bench->numConns == MAX_CONNS ||
+            getaddrinfo("localhost", bench->port, &hints, &ai)) {
+        return NULL;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        freeaddrinfo(ai);
+        close(fd);
+        return NULL;
+    }
+    freeaddrinfo(ai);
+
+    int optVal = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+
+    int index = bench->numConns++;
+    struct PerfConn* conn = &bench->conns[index];
+    memset(conn, 0, sizeof(struct PerfConn));
+    conn->fd = fd;
+    init_linebuf(&conn->input);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = index};
+    epoll_ctl(bench->epollfd, EPOLL_CTL_ADD, fd, &event);
+    return conn;
+}
+
+/*
+* Send a line to the server in full.
+*
+* Parameters:
+*     conn: the connection to send on
+*     line: the line, with its newline
+*/
+void send_line(struct PerfConn* conn, const char* line) {
+
+    size_t length = strlen(line);
+    for (size_t sent = 0; sent < length && !conn->closed;) {
+        ssize_t result = send(conn->fd, line + sent, length - sent,
+                MSG_NOSIGNAL);
+        if (result < 0 && errno != EINTR) {
+            conn->closed = true;
+        } else if (result > 0) {
+            sent += result;
+        }
+    }
+}
+
+/*
+* Send AUTH: and NAME: together, as a pipelining client does.
+*
+* Parameters:
+*     conn: the connection to join on
+*     name: the name to join as
+*/
+void send_join(struct PerfConn* conn, const char* name) {
+
+    char line[128];
+    snprintf(line, sizeof(line), "AUTH:%s\nNAME:%s\n", PERF_AUTH, name);
+    conn->sentAt = get_time_us();
+    send_line(conn, line);
+}
+
+/*
+* Remember how long a timed operation took.
+*
+* Parameters:
+*     bench: the workload in progress
+*     latency: the operation's latency in microseconds
+*/
+void add_latency(struct Bench* bench, long long latency) {
+
+    if (bench->numLatencies == bench->capacity) {
+        bench->capacity = bench->capacity * 2 + 1024;
+        bench->latencies = realloc(bench->latencies,
+                sizeof(long long) * bench->capacity);
+    }
+    bench->latencies[bench->numLatencies++] = latency;
+}
+
+/*
+* Note a line that is part of joining: the second OK: means the client is in
+* the chat.
+*
+* Parameters:
+*     conn: the connection the line came in on
+*     line: the line
+*
+* Returns:
+*     whether the client has just joined.
+*/
+bool note_join(struct PerfConn* conn, char* line) {
+
+    if (!conn->joined && !strcmp(line, "OK:") && ++conn->oks == 2) {
+        conn->joined = true;
+        return true;
+    }
+    return false;
+}
+
+/*
+* Read from every connection that is ready and hand each complete line to
+* the workload. A connection the server closes is marked closed.
+*
+* Parameters:
+*     bench: the workload in progress
+*     timeout: milliseconds to wait, as for epoll_wait
+*/
+void pump(struct Bench* bench, int timeout) {
+
+    struct epoll_event events[MAX_EVENTS];
+    int numEvents = epoll_wait(bench->epollfd, events, MAX_EVENTS, timeout);
+
+    for (int index = 0; index < numEvents; index++) {
+        struct PerfConn* conn = &bench->conns[events[index].data.u32];
+        int numRead = fill_linebuf(&conn->input, conn->fd);
+
+        if (numRead <= 0 && errno != EINTR && errno != EAGAIN) {
+            epoll_ctl(bench->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            conn->closed = true;
+            bench->on_line(bench, conn, NULL);
+            continue;
+        }
+
+        char* line;
+        while ((line = next_line(&conn->input)) != NULL) {
+            bench->on_line(bench, conn, line);
+        }
+    }
+}
+
+/*
+* Pump until the workload has finished enough operations, or has run out of
+* time.
+*
+* Parameters:
+*     bench: the workload in progress
+*     target: the number of operations to wait for
+*     start: when the workload started
+*
+* Returns:
+*     whether the target was reached.
+*/
+bool pump_until(struct Bench* bench, long long target, long long start) {
+
+    while (bench->done < target) {
+        if (get_time_us() - start > WORKLOAD_TIMEOUT) {
+            return false;
+        }
+        pump(bench, 100);
+    }
+    return true;
+}
+
+/*
+* Line handler that only counts clients joining. Used for setting up idle
+* clients and for the join storm.
+*
+* Parameters:
+*     bench: the workload in progress
+*     conn: the connection the line came in on, NULL line if it closed
+*     line: the line
+*/
+void on_join_line(struct Bench* bench, struct PerfConn* conn, char* line) {
+
+    if (line != NULL && note_join(conn, line)) {
+        add_latency(bench, get_time_us() - conn->sentAt);
+        bench->done += 1;
+    }
+}
+
+/*
+* Join a number of clients and wait until they are all in the chat.
+*
+* Parameters:
+*     bench: the workload in progress
+*     count: the number of clients
+*     prefix: the start of their names
+*
+* Returns:
+*     whether every client joined.
+*/
+bool join_clients(struct Bench* bench, int count, const char* prefix) {
+
+    char name[64];
+    long long start = get_time_us();
+    bench->on_line = on_join_line;
+    bench->done = 0;
+
+    for (int index = 0; index < count; index++) {
+        struct PerfConn* conn = open_conn(bench);
+        if (conn == NULL) {
+            return false;
+        }
+        snprintf(name, sizeof(name), "%s%d", prefix, index);
+        send_join(conn, name);
+        if (index % 32 == 0) {
+            pump(bench, 0);
+        }
+    }
+
+    bool joined = pump_until(bench, count, start);
+    bench->numLatencies = 0;
+    bench->done = 0;
+    return joined;
+}
+
+/*
+* Join storm: many clients connect and join at once, each pipelining its
+* AUTH: and NAME:. Measures joins per second and the time from sending AUTH:
+* to being in the chat.
+*
+* Parameters:
+*     bench: a fresh workload
+*
+* Returns:
+*     the elapsed time in microseconds, or -1 if the workload failed.
+*/
+long long run_join_storm(struct Bench* bench) {
+
+    char name[64];
+    long long start = get_time_us();
+    bench->on_line = on_join_line;
+
+    for (int index = 0; index < STORM_CLIENTS; index++) {
+        struct PerfConn* conn = open_conn(bench);
+        if (conn == NULL) {
+            return -1;
+        }
+        snprintf(name, sizeof(name), "storm%d", index);
+        send_join(conn, name);
+        if (index % 32 == 0) {
+            pump(bench, 0);
+        }
+    }
+
+    if (!pump_until(bench, STORM_CLIENTS, start)) {
+        return -1;
+    }
+    return get_time_us() - start;
+}
+
+/*
+* Line handler for the fanout: every MSG: carries the time it was said, so
+* each delivery is one latency sample.
+*
+* Parameters:
+*     bench: the workload in progress
+*     conn: the connection the line came in on, NULL line if it closed
+*     line: the line
+*/
+void on_fanout_line(struct Bench* bench, struct PerfConn* conn, char* line) {
+
+    char* said;
+    if (line != NULL && !strncmp(line, "MSG:", 4) &&
+            (said = strrchr(line, ':')) != NULL && said[1] == 't') {
+        add_latency(bench, get_time_us() - atoll(said + 2));
+        bench->done += 1;
+    }
+}
+
+/*
+* Steady SAY fanout: a few senders say messages at a fixed rate to a room of
+* receivers, and every message reaches every client. Measures deliveries per
+* second and the time from a SAY: going out to each MSG: arriving.
+*
+* Parameters:
+*     bench: a fresh workload
+*
+* Returns:
+*     the elapsed time in microseconds, or -1 if the workload failed.
+*/
+long long run_say_fanout(struct Bench* bench) {
+
+    if (!join_clients(bench, FANOUT_RECEIVERS, "fan")) {
+        return -1;
+    }
+
+    //ENTER: lines from the joins arrive first and are not counted
+    bench->on_line = on_fanout_line;
+    pump(bench, 100);
+
+    char line[64];
+    long long start = get_time_us();
+    long long interval = 1000000 / FANOUT_RATE;
+
+    for (int index = 0; index < FANOUT_MESSAGES; index++) {
+        long long due = start + index * interval;
+        while (get_time_us() < due) {
+            pump(bench, 0);
+        }
+        snprintf(line, sizeof(line), "SAY:t%lld\n", get_time_us());
+        send_line(&bench->conns[index % FANOUT_SENDERS], line);
+    }
+
+    if (!pump_until(bench, (long long) FANOUT_MESSAGES * FANOUT_RECEIVERS,
+            start)) {
+        return -1;
+    }
+    return get_time_us() - start;
+}
+
+/*
+* Line handler for the LIST: workload: a reply is timed and the requester
+* asks again straight away until it has made its share of requests.
+*
+* Parameters:
+*     bench: the workload in progress
+*     conn: the connection the line came in on, NULL line if it closed
+*     line: the line
+*/
+void on_list_line(struct Bench* bench, struct PerfConn* conn, char* line) {
+
+    if (line == NULL || strncmp(line, "LIST:", 5) || conn->sentAt == 0) {
+        return;
+    }
+
+    long long now = get_time_us();
+    add_latency(bench, now - conn->sentAt);
+    bench->done += 1;
+
+    if (--conn->remaining > 0) {
+        conn->sentAt = get_time_us();
+        send_line(conn, "LIST:\n");
+    } else {
+        conn->sentAt = 0;
+    }
+}
+
+/*
+* LIST-heavy: a room of idle clients, and a few clients asking for the list
+* of names over and over, each waiting for its reply before asking again.
+* Measures replies per second and the time each request took.
+*
+* Parameters:
+*     bench: a fresh workload
+*
+* Returns:
+*     the elapsed time in microseconds, or -1 if the workload failed.
+*/
+long long run_list_heavy(struct Bench* bench) {
+
+    if (!join_clients(bench, LIST_IDLE, "idle")) {
+        return -1;
+    }
+
+    bench->on_line = on_list_line;
+    pump(bench, 100);
+
+    long long start = get_time_us();
+    for (int index = 0; index < LIST_REQUESTERS; index++) {
+        struct PerfConn* conn = &bench->conns[index];
+        conn->remaining = LIST_REQUESTS / LIST_REQUESTERS;
+        conn->sentAt = get_time_us();
+        send_line(conn, "LIST:\n");
+    }
+
+    if (!pump_until(bench, LIST_REQUESTS, start)) {
+        return -1;
+    }
+    return get_time_us() - start;
+}
+
+/*
+* Line handler for kick churn: the victim's connection closing ends the
+* timed kick.
+*
+* Parameters:
+*     bench: the workload in progress
+*     conn: the connection the line came in on, NULL line if it closed
+*     line: the line
+*/
+void on_kick_line(struct Bench* bench, struct PerfConn* conn, char* line) {
+
+    if (line == NULL && conn->sentAt != 0) {
+        add_latency(bench, get_time_us() - conn->sentAt);
+        bench->done += 1;
+    } else if (line != NULL) {
+        note_join(conn, line);
+    }
+}
+
+/*
+* Kick churn: a victim joins, is kicked and is disconnected, over and over.
+* Measures join and kick cycles per second and the time from KICK: going out
+* to the victim's connection closing.
+*
+* Parameters:
+*     bench: a fresh workload
+*
+* Returns:
+*     the elapsed time in microseconds, or -1 if the workload failed.
+*/
+long long run_kick_churn(struct Bench* bench) {
+
+    if (!join_clients(bench, 1, "kicker")) {
+        return -1;
+    }
+
+    struct PerfConn* kicker = &bench->conns[0];
+    bench->on_line = on_kick_line;
+    char line[64];
+    long long start = get_time_us();
+
+    for (int cycle = 0; cycle < KICK_CYCLES; cycle++) {
+        //Slots are reused, as each victim is gone before the next joins
+        bench->numConns = 1;
+        struct PerfConn* victim = open_conn(bench);
+        if (victim == NULL) {
+            return -1;
+        }
+
+        snprintf(line, sizeof(line), "victim%d", cycle);
+        send_join(victim, line);
+        victim->sentAt = 0;
+        while (!victim->joined && !victim->closed) {
+            if (get_time_us() - start > WORKLOAD_TIMEOUT) {
+                return -1;
+            }
+            pump(bench, 100);
+        }
+
+        snprintf(line, sizeof(line), "KICK:victim%d\n", cycle);
+        victim->sentAt = get_time_us();
+        send_line(kicker, line);
+        if (!pump_until(bench, cycle + 1, start)) {
+            return -1;
+        }
+        close(victim->fd);
+    }
+    return get_time_us() - start;
+}
+
+/*
+* Order two latencies, for qsort.
+*
+* Parameters:
+*     first: the first latency
+*     second: the second latency
+*
+* Returns:
+*     less than, equal to or greater than zero as first is less than, equal
+*     to or greater than second.
+*/
+int compare_latencies(const void* first, const void* second) {
+
+    long long a = *(const long long*) first;
+    long long b = *(const long long*) second;
+    return a < b ? -1 : a > b;
+}
+
+/*
+* Run one workload against a fresh server.
+*
+* Parameters:
+*     workload: the index of the workload in workloadNames
+*     serverPath: the server binary
+*     authPath: a file holding the authentication string
+*     result: filled in with what the workload measured
+*
+* Returns:
+*     0 if the workload ran, -1 if it failed.
+*/
+int run_workload(int workload, const char* serverPath, const char* authPath,
+        struct Result* result) {
+
+    struct Bench* bench = calloc(1, sizeof(struct Bench));
+    pid_t pid = start_server(serverPath, authPath, bench->port);
+    if (pid < 0) {
+        free(bench);
+        return -1;
+    }
+    bench->epollfd = epoll_create1(EPOLL_CLOEXEC);
+
+    long long elapsed = -1;
+    long long operations = 0;
+    if (workload == 0) {
+        elapsed = run_join_storm(bench);
+        operations = STORM_CLIENTS;
+    } else if (workload == 1) {
+        elapsed = run_say_fanout(bench);
+        operations = (long long) FANOUT_MESSAGES * FANOUT_RECEIVERS;
+    } else if (workload == 2) {
+        elapsed = run_list_heavy(bench);
+        operations = LIST_REQUESTS;
+    } else if (workload == 3) {
+        elapsed = run_kick_churn(bench);
+        operations = KICK_CYCLES;
+    }
+
+    if (elapsed > 0 && bench->numLatencies > 0) {
+        qsort(bench->latencies, bench->numLatencies, sizeof(long long),
+                compare_latencies);
+        result->metrics[0] = operations * 1000000.0 / elapsed;
+        result->metrics[1] = bench->latencies[(bench->numLatencies - 1) / 2];
+        result->metrics[2] =
+                bench->latencies[(bench->numLatencies - 1) * 99 / 100];
+    }
+
+    for (int index = 0; index < bench->numConns; index++) {
+        close(bench->conns[index].fd);
+    }
+    close(bench->epollfd);
+    stop_server(pid);
+    free(bench->latencies);
+    free(bench);
+    return elapsed > 0 ? 0 : -1;
+}
+
+/*
+* Order two doubles, for qsort.
+*
+* Parameters:
+*     first: the first value
+*     second: the second value
+*
+* Returns:
+*     less than, equal to or greater than zero as first is less than, equal
+*     to or greater than second.
+*/
+int compare_values(const void* first, const void* second) {
+
+    double a = *(const double*) first;
+    double b = *(const double*) second;
+    return a < b ? -1 : a > b;
+}
+
+/*
+* Write the results as JSON, one object of metrics per workload.
+*
+* Parameters:
+*     path: where to write the results
+*     results: the summary of every workload
+*
+* Returns:
+*     0 if the results were written, -1 otherwise.
+*/
+int write_results(const char* path, struct Summary* results) {
+
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    fprintf(out, "{\n");
+    for (int workload = 0; workload < NUM_WORKLOADS; workload++) {
+        fprintf(out, "  \"%s\": {", workloadNames[workload]);
+        for (int metric = 0; metric < NUM_METRICS; metric++) {
+            fprintf(out, "%s\"%s\": %.1f", metric ? ", " : "",
+                    metricNames[metric],
+                    results[workload].median.metrics[metric]);
+        }
+        fprintf(out, "}%s\n", workload < NUM_WORKLOADS - 1 ? "," : "");
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+    return 0;
+}
+
+/*
+* Compare the results against those of the baseline server, measured in the
+* same session, and print every metric alongside its baseline. Throughput
+* regresses when it falls, latencies when they rise. A metric only regresses
+* when its median is worse by more than the threshold and every run was
+* worse than every baseline run, so a noisy run on either side cannot fail
+* the check. Worse medians whose runs overlap are shown as noise.
+*
+* Parameters:
+*     results: the summary of every workload
+*     baseline: the baseline server's summary of every workload
+*     threshold: the percentage throughput may be worse by
+*     latencyThreshold: the percentage a latency may be worse by
+*
+* Returns:
+*     the number of metrics that regressed.
+*/
+int compare_baseline(struct Summary* results, struct Summary* baseline,
+        double threshold, double latencyThreshold) {
+
+    int regressions = 0;
+    for (int workload = 0; workload < NUM_WORKLOADS; workload++) {
+        for (int metric = 0; metric < NUM_METRICS; metric++) {
+            struct Summary* ours = &results[workload];
+            struct Summary* theirs = &baseline[workload];
+            double current = ours->median.metrics[metric];
+            double base = theirs->median.metrics[metric];
+
+            if (base <= 0) {
+                printf("%-11s %-10s %12.1f  (no baseline)\n",
+                        workloadNames[workload], metricNames[metric], current);
+                continue;
+            }
+
+            //Positive is better, for either kind of metric
+            double change = (current - base) / base * 100;
+            bool apart = ours->high.metrics[metric] <
+                    theirs->low.metrics[metric];
+            if (metric > 0) {
+                change = -change;
+                apart = ours->low.metrics[metric] >
+                        theirs->high.metrics[metric];
+            }
+            bool worse = change < -(metric > 0 ? latencyThreshold :
+                    threshold);
+            regressions += worse && apart;
+
+            printf("%-11s %-10s %12.1f  baseline %12.1f  %+6.1f%%%s\n",
+                    workloadNames[workload], metricNames[metric], current,
+                    base, change, !worse ? "" : apart ? "  REGRESSED" :
+                    "  (noise)");
+        }
+    }
+    return regressions;
+}
+
+/*
+* Take the median, lowest and highest value of each metric over a workload's
+* runs.
+*
+* Parameters:
+*     samples: what each run measured
+*     runs: the number of runs
+*     summary: filled in with the summary of every metric
+*/
+void summarise_runs(struct Result* samples, int runs,
+        struct Summary* summary) {
+
+    for (int metric = 0; metric < NUM_METRICS; metric++) {
+        double values[runs];
+        for (int run = 0; run < runs; run++) {
+            values[run] = samples[run].metrics[metric];
+        }
+        qsort(values, runs, sizeof(double), compare_values);
+        summary->median.metrics[metric] = values[runs / 2];
+        summary->low.metrics[metric] = values[0];
+        summary->high.metrics[metric] = values[runs - 1];
+    }
+}
+
+/*
+* Print the usage message and exit.
+*/
+void usage_error() {
+    fprintf(stderr, "Usage: perfbench [-r runs] [-b baselineserver] "
+            "[-t threshold] [-T latencythreshold] [-o results] "
+            "serverpath\n");
+    fflush(stderr);
+    exit(1);
+}
+
+/*
+* Benchmark a server binary with a fixed set of workloads, each run several
+* times against a fresh server, and write the median results. With a
+* baseline server binary, that server is benchmarked in the same session,
+* each run alongside the same run of the server being checked, so both see
+* the same machine and the same load on it. Exits with 3 if any metric
+* is worse than the baseline server's by more than its threshold percentage
+* in every run.
+*/
+int main(int argc, char** argv) {
+
+    int opt;
+    int runs = DEFAULT_RUNS;
+    double threshold = DEFAULT_THRESHOLD;
+    double latencyThreshold = DEFAULT_LATENCY_THRESHOLD;
+    char* baselinePath = NULL;
+    char* resultsPath = "perf-results.json";
+
+    while ((opt = getopt(argc, argv, "r:b:t:T:o:")) != -1) {
+        if (opt == 'r' && (runs = atoi(optarg)) > 0) {
+            continue;
+        } else if (opt == 't' && (threshold = atof(optarg)) > 0) {
+            continue;
+        } else if (opt == 'T' && (latencyThreshold = atof(optarg)) > 0) {
+            continue;
+        } else if (opt == 'b') {
+            baselinePath = optarg;
+        } else if (opt == 'o') {
+            resultsPath = optarg;
+        } else {
+            usage_error();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 2 || access(argv[1], X_OK) < 0 ||
+            (baselinePath != NULL && access(baselinePath, X_OK) < 0)) {
+        usage_error();
+    }
+
+    char authPath[] = "/tmp/perfauthXXXXXX";
+    int authFd = mkstemp(authPath);
+    if (authFd < 0 ||
+            write(authFd, PERF_AUTH "\n", strlen(PERF_AUTH) + 1) < 0) {
+        fprintf(stderr, "Cannot write auth file\n");
+        return 2;
+    }
+    close(authFd);
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    //The server being checked first, then the baseline server if any
+    char* servers[] = {argv[1], baselinePath};
+    int numServers = baselinePath == NULL ? 1 : 2;
+    struct Summary results[2][NUM_WORKLOADS];
+    struct Result* samples = malloc(sizeof(struct Result) * runs * 2);
+    memset(results, 0, sizeof(results));
+
+    for (int workload = 0; workload < NUM_WORKLOADS; workload++) {
+        for (int run = 0; run < runs; run++) {
+            for (int turn = 0; turn < numServers; turn++) {
+                //Each goes first every other run, so neither always runs
+                //straight after the other has torn down its connections
+                int server = run % 2 ? numServers - 1 - turn : turn;
+                if (run_workload(workload, servers[server], authPath,
+                        &samples[server * runs + run]) < 0) {
+                    fprintf(stderr, "Workload %s failed on %s\n",
+                            workloadNames[workload], servers[server]);
+                    unlink(authPath);
+                    return 2;
+                }
+            }
+        }
+        for (int server = 0; server < numServers; server++) {
+            summarise_runs(&samples[server * runs], runs,
+                    &results[server][workload]);
+        }
+    }
+    unlink(authPath);
+    free(samples);
+
+    if (write_results(resultsPath, results[0]) < 0) {
+        fprintf(stderr, "Cannot write %s\n", resultsPath);
+        return 2;
+    }
+    printf("Results written to %s\n", resultsPath);
+
+    if (baselinePath == NULL) {
+        return 0;
+    }
+
+    int regressions = compare_baseline(results[0], results[1], threshold,
+            latencyThreshold);
+    if (regressions > 0) {
+        printf("%d metrics regressed by more than %.0f%% (latencies %.0f%%) "
+                "in every run\n", regressions, threshold, latencyThreshold);
+        return 3;
+    }
+    return 0;
+}
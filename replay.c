@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include "sharedfunc.h"
+#include "capture.h"
+
+//Lines that are not replayed: a file's bytes and a shared ring's
+//descriptors are not in the capture
+#define SEND "SEND:"
+#define SHM "SHM:"
+
+//The captured authentication line, which has its string left out
+#define AUTH "AUTH:"
+
+//Most events taken from epoll at once
+#define MAX_EVENTS 64
+
+//Bytes read from the server at once, all of which are thrown away
+#define READ_BUFFER 65536
+
+//Lines sent flat out between checks for anything the server has sent
+#define DRAIN_EVERY 64
+
+//Microseconds replay waits for the server to go quiet once every line is
+//sent, and the most it waits in all
+#define QUIET_TIME 500000
+#define DRAIN_TIMEOUT 5000000
+
+//One record of the capture, as loaded. index keeps records that happened in
+//the same microsecond in the order they were captured
+struct Replayed {
+    struct CaptureRecord record;
+    char* line;
+    int index;
+};
+
+//A captured connection being driven again. fd is -1 until its first line and
+//again once it has closed
+struct ReplayConn {
+    int fd;
+    bool closed;
+};
+
+//Everything replay needs while it runs
+struct Replay {
+    struct Replayed* records;
+    int numRecords;
+    struct ReplayConn* conns;
+    int numConns;
+    char* auth;
+    char* port;
+    double speed;
+    int epollfd;
+    long long start;
+    int opened;
+    long long lines;
+    long long skipped;
+    int errors;
+    long long bytesIn;
+    long long totalLate;
+    long long maxLate;
+};
+
+/*
+* Order two records by when they happened, keeping records from the same
+* microsecond in the order they were captured.
+*
+* Parameters:
+*     first: the first record
+*     second: the second record
+*
+* Returns:
+*     less than, equal to or greater than zero as first comes before, with or
+*     after second.
+*/
+int compare_records(const void* first, const void* second) {
+
+    const struct Replayed* a = (const struct Replayed*) first;
+    const struct Replayed* b = (const struct Replayed*) second;
+
+    if (a->record.time != b->record.time) {
+        return a->record.time < b->record.time ? -1 : 1;
+    }
+    return a->index - b->index;
+}
+
+/*
+* Load a capture file and put its records in time order. Records from
+* different workers are written in batches, so the file itself is not.
+*
+* Parameters:
+*     replay: where to load the records into
+*     path: the capture file
+*
+* Returns:
+*     0 if the capture was loaded, -1 if it could not be read or is not a
+*     capture.
+*/
+int load_capture(struct Replay* replay, const char* path) {
+
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) < 0 ||
+            info.st_size < (off_t) sizeof(struct CaptureHeader)) {
+        return -1;
+    }
+
+    char* data = malloc(info.st_size);
+    off_t loaded = 0;
+    while (loaded < info.st_size) {
+        ssize_t numRead = read(fd, data + loaded, info.st_size - loaded);
+        if (numRead <= 0) {
+            return -1;
+        }
+        loaded += numRead;
+    }
+    close(fd);
+
+    if (memcmp(data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+        return -1;
+    }
+
+    int capacity = 1024;
+    replay->records = malloc(sizeof(struct Replayed) * capacity);
+    off_t position = sizeof(struct CaptureHeader);
+
+    //A capture cut short by the server dying ends part way through a record
+    while (position + (off_t) sizeof(struct CaptureRecord) <= info.st_size) {
+        struct Replayed* replayed;
+        if (replay->numRecords == capacity) {
+            capacity *= 2;
+            replay->records = realloc(replay->records,
+                    sizeof(struct Replayed) * capacity);
+        }
+        replayed = &replay->records[replay->numRecords];
+        memcpy(&replayed->record, data + position,
+                sizeof(struct CaptureRecord));
+        position += sizeof(struct CaptureRecord);
+
+        if (position + replayed->record.length > info.st_size) {
+            break;
+        }
+        replayed->line = strndup(data + position, replayed->record.length);
+        replayed->index = replay->numRecords++;
+        position += replayed->record.length;
+
+        if ((int) replayed->record.conn >= replay->numConns) {
+            replay->numConns = replayed->record.conn + 1;
+        }
+    }
+    free(data);
+
+    qsort(replay->records, replay->numRecords, sizeof(struct Replayed),
+            compare_records);
+
+    replay->conns = malloc(sizeof(struct ReplayConn) * replay->numConns);
+    for (int index = 0; index < replay->numConns; index++) {
+        replay->conns[index].fd = -1;
+        replay->conns[index].closed = false;
+    }
+    return 0;
+}
+
+/*
+* Open a connection to the server being replayed against.
+*
+* Parameters:
+*     port: the server's port, or the path of its Unix domain socket
+*
+* Returns:
+*     the connected socket, or -1 if the server could not be reached.
+*/
+int open_connection(const char* port) {
+
+    int fd;
+
+    if (strchr(port, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, port, sizeof(addr.sun_path) - 1);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fd, (struct sockaddr*) &addr,
+                sizeof(struct sockaddr_un)) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo* ai = NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+
+    //Small protocol lines must not wait on Nagle's algorithm
+    if (fd >= 0) {
+        int optVal = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(int));
+    }
+    return fd;
+}
+
+/*
+* Read and throw away whatever the server has sent on the connections that
+* are ready, closing those the server has closed.
+*
+* Parameters:
+*     replay: the replay in progress
+*     timeout: milliseconds to wait for the server, as for epoll_wait
+*
+* Returns:
+*     the number of connections the server had sent something on.
+*/
+int drain_connections(struct Replay* replay, int timeout) {
+
+    struct epoll_event events[MAX_EVENTS];
+    char buffer[READ_BUFFER];
+    int numEvents = epoll_wait(replay->epollfd, events, MAX_EVENTS, timeout);
+
+    for (int index = 0; index < numEvents; index++) {
+        struct ReplayConn* conn = &replay->conns[events[index].data.u32];
+        ssize_t numRead = recv(conn->fd, buffer, READ_BUFFER, MSG_DONTWAIT);
+
+        if (numRead > 0) {
+            replay->bytesIn += numRead;
+        } else if (numRead == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close(conn->fd);
+            conn->fd = -1;
+            conn->closed = true;
+        }
+    }
+    return numEvents < 0 ? 0 : numEvents;
+}
+
+/*
+* Wait until a record is due, reading from the server all the while.
+*
+* Parameters:
+*     replay: the replay in progress
+*     due: when the record is due, from get_time_us
+*/
+void wait_until(struct Replay* replay, long long due) {
+
+    long long now;
+
+    while ((now = get_time_us()) < due) {
+        if (due - now >= 1000) {
+            drain_connections(replay, (due - now) / 1000);
+        } else {
+            struct timespec pause = {.tv_sec = 0,
+                    .tv_nsec = (due - now) * 1000};
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/*
+* Send a captured line again on its connection, opening the connection if
+* this is its first line. The authentication string is filled back in.
+*
+* Parameters:
+*     replay: the replay in progress
+*     replayed: the record of the line
+*/
+void replay_line(struct Replay* replay, struct Replayed* replayed) {
+
+    struct ReplayConn* conn = &replay->conns[replayed->record.conn];
+    char* line = replayed->line;
+
+    if (conn->closed || !strncmp(line, SEND, strlen(SEND)) ||
+            !strncmp(line, SHM, strlen(SHM))) {
+        replay->skipped += 1;
+        return;
+    }
+
+    if (conn->fd < 0) {
+        conn->fd = open_connection(replay->port);
+        if (conn->fd < 0) {
+            replay->errors += 1;
+            conn->closed = true;
+            return;
+        }
+        struct epoll_event event = {.events = EPOLLIN,
+                .data.u32 = replayed->record.conn};
+        epoll_ctl(replay->epollfd, EPOLL_CTL_ADD, conn->fd, &event);
+        replay->opened += 1;
+    }
+
+    char* message;
+    int length = !strcmp(line, AUTH) ?
+            asprintf(&message, "%s%s\n", AUTH, replay->auth) :
+            asprintf(&message, "%s\n", line);
+
+    for (int sent = 0; length > 0 && sent < length;) {
+        ssize_t result = send(conn->fd, message + sent, length - sent,
+                MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0) {
+            //Kicked or dropped by the server, its later lines are skipped
+            replay->errors += 1;
+            close(conn->fd);
+            conn->fd = -1;
+            conn->closed = true;
+            break;
+        }
+        sent += result;
+    }
+    free(message);
+    replay->lines += 1;
+}
+
+/*
+* Drive every captured connection again in the order, and at the pace, the
+* lines were captured, then wait for the server to finish answering.
+*
+* Parameters:
+*     replay: the loaded capture and where to replay it
+*/
+void run_replay(struct Replay* replay) {
+
+    replay->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    replay->start = get_time_us();
+
+    for (int index = 0; index < replay->numRecords; index++) {
+        struct Replayed* replayed = &replay->records[index];
+
+        if (replay->speed > 0) {
+            long long due = replay->start +
+                    (long long) (replayed->record.time / replay->speed);
+            wait_until(replay, due);
+            long long late = get_time_us() - due;
+            replay->totalLate += late;
+            if (late > replay->maxLate) {
+                replay->maxLate = late;
+            }
+        } else if (index % DRAIN_EVERY == 0) {
+            drain_connections(replay, 0);
+        }
+
+        if (replayed->record.kind == CAPTURE_LINE) {
+            replay_line(replay, replayed);
+        } else {
+            //Closing with replies unread would reset the connection and could
+            //lose its last lines, so only the sending side is shut here. The
+            //socket is closed once the server's end of file is read
+            struct ReplayConn* conn = &replay->conns[replayed->record.conn];
+            if (conn->fd >= 0) {
+                shutdown(conn->fd, SHUT_WR);
+            }
+            conn->closed = true;
+        }
+    }
+
+    long long sent = get_time_us();
+    long long quiet = sent;
+    while (get_time_us() - quiet < QUIET_TIME &&
+            get_time_us() - sent < DRAIN_TIMEOUT) {
+        if (drain_connections(replay, QUIET_TIME / 1000) > 0) {
+            quiet = get_time_us();
+        }
+    }
+
+    fprintf(stderr, "replay:CONNS:%d:LINES:%lld:SKIPPED:%lld:ERRORS:%d:"
+            "BYTES_IN:%lld:ELAPSED_MS:%lld:LATE_AVG_US:%lld:LATE_MAX_US:%lld\n",
+            replay->opened, replay->lines, replay->skipped, replay->errors,
+            replay->bytesIn, (sent - replay->start) / 1000,
+            replay->numRecords ? replay->totalLate / replay->numRecords : 0,
+            replay->maxLate);
+}
+
+/*
+* Print the usage message and exit.
+*/
+void usage_error() {
+    fprintf(stderr, "Usage: replay [-s speed | -m] capturefile authfile "
+            "port|socketpath\n");
+    fflush(stderr);
+    exit(1);
+}
+
+/*
+* Replay a capture taken with server -c against a fresh server, at the speed
+* it was captured (or some multiple of it, or as fast as possible), with one
+* connection for every connection captured.
+*/
+int main(int argc, char** argv) {
+
+    int fd;
+    int opt;
+    struct Replay replay;
+    memset(&replay, 0, sizeof(struct Replay));
+    replay.speed = 1.0;
+
+    while ((opt = getopt(argc, argv, "s:m")) != -1) {
+        if (opt == 'm') {
+            replay.speed = 0;
+        } else if (opt == 's' && (replay.speed = atof(optarg)) > 0) {
+            continue;
+        } else {
+            usage_error();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc != 4 || (fd = open(argv[2], O_RDONLY)) == -1) {
+        usage_error();
+    }
+
+    FILE* authFile = fdopen(fd, "r");
+    replay.auth = read_input(authFile, true);
+    fclose(authFile);
+    replay.port = argv[3];
+
+    if (load_capture(&replay, argv[1]) < 0) {
+        fprintf(stderr, "Cannot read capture %s\n", argv[1]);
+        return 1;
+    }
+
+    //One descriptor for every captured connection
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    run_replay(&replay);
+    return 0;
+}
@@ -3,16 +3,21 @@
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
-#include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <semaphore.h>
-#include "sharedfunc.h"
+#include "server.h"
 
 //Messages to send to client
 #define WHO "WHO:\n"
@@ -24,6 +29,17 @@
 #define AUTH "AUTH:\n"
 #define OK "OK:\n"
 
+//Handshake replies coalesced into one write so a pipelining client gets
+//everything it needs in a single round trip
+#define OK_WHO "OK:\nWHO:\n"
+#define TELL "TELL"
+#define UNKNOWN_NAME "UNKNOWN_NAME"
+#define NAME_TAKEN_WHO "NAME_TAKEN:\nWHO:\n"
+#define PONG "PONG:\n"
+
+//Reply to NAME:base:AUTO, carrying the name the server chose
+#define NAMED "OK"
+
 //Messages to receive from client
 #define NAME "NAME"
 #define CAUTH "AUTH"
@@ -31,33 +47,64 @@
 #define CKICK "KICK"
 #define CLEAVE "LEAVE"
 #define LIST "LIST"
+#define CTELL "TELL"
+#define CSHM "SHM"
+#define CFILTER "FILTER"
+#define CLEAR "CLEAR"
+#define CSEND "SEND"
+#define CPEER "PEER"
+#define CPING "PING"
+#define CAUTO "AUTO"
 
 //Communciations error return code
 #define COMMSERR 2
 
-//Number of chat statistics for client and server
-#define NUM_CLI_STATS 3
-#define NUM_SVR_STATS 6
-#define CLIENT_DELAY 100000
-
-//Info needed to communicate with client
-struct ClientInf {
-    char* name;
-    FILE* writeSock;
-    FILE* readSock;
-    int* clientStats;
-    pthread_t threadId;
-    struct ClientInf* next;
-};
-
-//Parameters needed for child thread 
-//to communicate with the client
-struct ThreadInf {
-    struct ClientInf** head;
-    int fd;
-    char* auth;
-    int* serverStats;
-    sem_t* clientsLock;
+//Default settings, see usage_error for the matching command line options
+#define DEFAULT_HANDSHAKE_TIMEOUT 10000
+#define DEFAULT_WORKERS 4
+#define DEFAULT_QUEUE_SIZE 128
+#define DEFAULT_MAX_CLIENTS 1024
+#define DEFAULT_STACK_SIZE 64
+#define DEFAULT_BATCH_LIMIT 64
+#define DEFAULT_ACCEPTORS 1
+#define DEFAULT_WEIGHT 1
+#define MAX_WEIGHT 1000
+#define DEFAULT_PING_INTERVAL 30000
+
+//Dirty clients needed before a flush is shared out between fanout threads
+#define FANOUT_THRESHOLD 256
+
+//Most terms any command from a client has
+#define MAX_TERMS 4
+
+//Number of clients or buffers carved out of each slab chunk
+#define SLAB_CHUNK 64
+
+//Most output that may wait for a client that is not reading before it is
+//dropped
+#define MAX_PENDING_OUTPUT (1024 * 1024)
+
+//The same for a link to another server, which carries the whole room
+#define MAX_LINK_OUTPUT (16 * 1024 * 1024)
+
+//Most output blocks handed to a single writev
+#define MAX_IOV 64
+
+//Initial number of buckets in the name index, doubled as the roster grows
+#define INDEX_SIZE 64
+
+//Buckets in the index of name hints, and the most base names remembered
+//before the hints are forgotten and built up again
+#define HINT_INDEX_SIZE 256
+#define NAME_HINT_LIMIT 4096
+
+//The number to try first when building a name on base for a client that
+//lets the server choose, so that each client asking for the same base does
+//not probe every name handed out before it
+struct NameHint {
+    struct NameHint* next;
+    unsigned int suffix;
+    char base[];
 };
 
 /*
@@ -72,11 +119,13 @@ struct ThreadInf {
 *     accept connections in the future
 *     portNum: a pointer to the unsigned integer representation of the port
 *     number that the server has connected to.
+*     backlog: the most connections that may wait to be accepted
 *
 * Returns:
 *     The error code of this function. 0 is all good, 2 is communications error
 */
-int init_comms(const char* port, int* serverfd, unsigned int* portNum) {
+int init_comms(const char* port, int* serverfd, unsigned int* portNum,
+        int backlog) {
 
     struct addrinfo* ai = 0;
     struct addrinfo hints;
@@ -113,7 +162,7 @@ int init_comms(const char* port, int* serverfd, unsigned int* portNum) {
     socklen_t length = sizeof(struct sockaddr_in);
     getsockname(fd, (struct sockaddr*) &addr, &length);
     
-    if (listen(fd, SOMAXCONN) < 0) {
+    if (listen(fd, backlog) < 0) {
         return COMMSERR;
     }
     
@@ -124,521 +173,1547 @@ int init_comms(const char* port, int* serverfd, unsigned int* portNum) {
 }
 
 /*
-* Given two strings, determines if they appear in lexographical order as given 
-* in the parameter list. Taken from my assignment 1 solution where it was 
-* called compare_words. 
+* Listen on a Unix domain socket at the given path as well, for clients on
+* the same host. Anything already at the path is replaced.
+*
+* Parameters:
+*     path: where in the filesystem to create the socket
+*     unixfd: a pointer to the file descriptor to accept connections on
+*     backlog: the most connections that may wait to be accepted
+*     restricted: whether only this server's user may connect
+*
+* Returns:
+*     The error code of this function. 0 is all good, 2 is communications error
+*/
+int init_unix_comms(const char* path, int* unixfd, int backlog,
+        bool restricted) {
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return COMMSERR;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    //Created without group or other access from the start, so there is no
+    //moment at which another user could connect
+    mode_t mask = restricted ? umask(0077) : 0;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    int bound = fd < 0 ? -1 : bind(fd, (struct sockaddr*) &addr,
+            sizeof(struct sockaddr_un));
+    if (restricted) {
+        umask(mask);
+    }
+    if (bound < 0 || listen(fd, backlog) < 0) {
+        return COMMSERR;
+    }
+
+    *unixfd = fd;
+    return 0;
+}
+
+/*
+* Given two strings, determines if they appear in lexographical order as given 
+* in the parameter list. Taken from my assignment 1 solution where it was 
+* called compare_words. 
+*
+* Parameters:
+*     word1: the first word to compare
+*     word2: the second word to compare
+*
+* Returns:
+*     True if word1 is first lexographically or if words are equal. False
+*     otherwise.
+*/
+bool are_ordered(char* word1, char* word2) {
+    
+    int length1 = strlen(word1);
+    int length2 = strlen(word2);
+
+    int shortestLength = length1;
+    bool result = true;
+
+    if (length2 < shortestLength) {
+        shortestLength = length2;
+        result = false;
+    }
+
+    for (int index = 0; index < shortestLength; index++) {
+        if (word1[index] < word2[index]) {
+            result = true;
+            break;
+        } else if (word1[index] > word2[index]) {
+            result = false;
+            break;
+        }
+    }
+    return result;
+}
+
+/*
+* Create the record for a connection that has just been accepted. It stays
+* out of the roster until it has authenticated and negotiated a name. The
+* record comes from the server's client slab, and the socket is made
+* non-blocking so that no single client can hold up the worker serving it.
+*
+* Parameters:
+*     server: the server the connection was accepted on
+*     fd: the socket the connection was accepted on
+*
+* Returns:
+*     the new connection, waiting to be authenticated
+*/
+struct ClientInf* new_client(struct ServerInf* server, int fd) {
+
+    struct ClientInf* client = slab_alloc(&server->clientSlab);
+    memset(client, 0, sizeof(struct ClientInf));
+    client->fd = fd;
+    client->state = CONN_AUTH;
+    client->weight = DEFAULT_WEIGHT;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return client;
+}
+
+/*
+* Give a client its name, kept inside the client record unless it is too long
+* to fit.
+*
+* Parameters:
+*     client: the client being named
+*     name: the name, which need not be terminated
+*     length: the number of bytes in name
+*/
+void set_name(struct ClientInf* client, char* name, size_t length) {
+
+    client->name = length < SHORT_NAME ? client->shortName :
+            malloc(length + 1);
+    memcpy(client->name, name, length);
+    client->name[length] = '\0';
+}
+
+/*
+* Give every output block a client still holds back to the output slab,
+* along with any files they were sending.
+*
+* Parameters:
+*     server: the server whose slab the blocks came from
+*     client: the client whose output is thrown away
+*/
+void discard_output(struct ServerInf* server, struct ClientInf* client) {
+
+    while (client->outHead != NULL) {
+        struct OutBlock* next = client->outHead->next;
+        if (client->outHead->spool != NULL) {
+            release_spool(client->outHead->spool);
+        }
+        slab_free(&server->outputSlab, client->outHead);
+        client->outHead = next;
+    }
+    client->outTail = NULL;
+    client->ctrlTail = NULL;
+    client->midLine = false;
+    client->outPending = 0;
+}
+
+/*
+* Read the weight from a -W setting of the form name:weight.
+*
+* Parameters:
+*     setting: the argument given to -W
+*
+* Returns:
+*     the weight, or 0 if the setting has no colon or its weight is not a
+*     whole number from 1 to MAX_WEIGHT.
+*/
+int parse_weight(const char* setting) {
+
+    char* colon = strrchr(setting, ':');
+    if (colon == NULL) {
+        return 0;
+    }
+
+    //Out of range values come back clamped, and so are still too large
+    char* end;
+    long weight = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || weight < 1 ||
+            weight > MAX_WEIGHT) {
+        return 0;
+    }
+    return (int) weight;
+}
+
+/*
+* Find the share of its worker's time a client is given, as set with -W for
+* the name it has chosen.
+*
+* Parameters:
+*     config: the server's settings
+*     name: the client's name
+*
+* Returns:
+*     the client's weight.
+*/
+int client_weight(struct ServerConfig* config, const char* name) {
+
+    size_t length = strlen(name);
+
+    for (int index = 0; index < config->numWeights; index++) {
+        char* setting = config->weights[index];
+        char* colon = strrchr(setting, ':');
+        if (colon - setting == length && !strncmp(setting, name, length)) {
+            return parse_weight(setting);
+        }
+    }
+    return DEFAULT_WEIGHT;
+}
+
+/*
+* Free the resources associated with a particular client after it has been
+* disconnected. This also closes the client's socket.
+*
+* Parameters:
+*     server: the server whose slabs the client came from
+*     client: the client whose resources the function will free
+*/
+void free_client(struct ServerInf* server, struct ClientInf* client) {
+    
+    if (client->name != client->shortName) {
+        free(client->name);
+    }
+    discard_output(server, client);
+    if (client->input != NULL) {
+        slab_free(&server->inputSlab, client->input);
+    }
+    if (client->upload != NULL) {
+        end_upload(client);
+    }
+    close(client->fd);
+    if (client->ring != NULL) {
+        detach_ring(client->ring);
+        free(client->ring);
+    }
+
+    slab_free(&server->clientSlab, client);
+}
+
+/*
+* Get the buffer a client's input is read into, taking one from the input
+* slab if it has none.
+*
+* Parameters:
+*     server: the server whose slab the buffer comes from
+*     client: the client about to be read from
+*
+* Returns:
+*     the client's input buffer.
+*/
+struct LineBuf* take_input(struct ServerInf* server, struct ClientInf* client) {
+
+    if (client->input == NULL) {
+        client->input = slab_alloc(&server->inputSlab);
+        init_linebuf(client->input);
+    }
+    return client->input;
+}
+
+/*
+* Give a client's input buffer back to the slab once every line in it has
+* been processed. A buffer holding part of a line is kept.
+*
+* Parameters:
+*     server: the server whose slab the buffer came from
+*     client: the client that has just been read from
+*/
+void release_input(struct ServerInf* server, struct ClientInf* client) {
+
+    struct LineBuf* input = client->input;
+
+    if (input != NULL && input->start == input->end && !input->discarding) {
+        slab_free(&server->inputSlab, input);
+        client->input = NULL;
+    }
+}
+
+/*
+* Drop a client that cannot be written to, either because its socket has
+* failed or because it has stopped reading. Its output is thrown away and its
+* socket shut down, which its worker sees as end of file and tears the
+* connection down as usual.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to drop
+*/
+void drop_output(struct ServerInf* server, struct ClientInf* client) {
+
+    discard_output(server, client);
+    client->broken = true;
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+/*
+* Check that a client can take more pending output, dropping it if it has
+* stopped reading and too much is already waiting.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the bytes to
+*     length: the number of bytes about to be added
+*
+* Returns:
+*     whether the bytes should be added.
+*/
+bool reserve_output(struct ServerInf* server, struct ClientInf* client,
+        size_t length) {
+
+    int limit = client->state == CONN_PEER ? MAX_LINK_OUTPUT :
+            MAX_PENDING_OUTPUT;
+
+    if (client->broken) {
+        return false;
+    } else if (client->outPending + length > limit) {
+        drop_output(server, client);
+        return false;
+    }
+
+    client->outPending += length;
+    return true;
+}
+
+/*
+* Take an empty block from the output slab and link it into a client's
+* pending output.
+*
+* Parameters:
+*     server: the server whose slab the block comes from
+*     client: the client the block is for
+*     after: the block to follow, or NULL to go first
+*
+* Returns:
+*     the new block.
+*/
+struct OutBlock* insert_block(struct ServerInf* server,
+        struct ClientInf* client, struct OutBlock* after) {
+
+    struct OutBlock* block = slab_alloc(&server->outputSlab);
+    block->spool = NULL;
+    block->start = 0;
+    block->end = 0;
+
+    if (after == NULL) {
+        block->next = client->outHead;
+        client->outHead = block;
+    } else {
+        block->next = after->next;
+        after->next = block;
+    }
+    if (block->next == NULL) {
+        client->outTail = block;
+    }
+    return block;
+}
+
+/*
+* Copy as much of some bytes as fits into the free space of a block.
+*
+* Parameters:
+*     block: the block to fill
+*     data: the bytes to copy, moved past those copied
+*     length: the number of bytes in data, less those copied
+*/
+void fill_block(struct OutBlock* block, const char** data, size_t* length) {
+
+    size_t chunk = sizeof(block->data) - block->end;
+    if (chunk > *length) {
+        chunk = *length;
+    }
+    memcpy(block->data + block->end, *data, chunk);
+    block->end += chunk;
+    *data += chunk;
+    *length -= chunk;
+}
+
+/*
+* Add bytes to the end of a client's pending output, taking more blocks from
+* the output slab as needed. Nothing is written until flush_output.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the bytes to
+*     data: the bytes to send
+*     length: the number of bytes in data
+*/
+void append_output(struct ServerInf* server, struct ClientInf* client,
+        const char* data, size_t length) {
+
+    if (!reserve_output(server, client, length)) {
+        return;
+    }
+
+    while (length > 0) {
+        struct OutBlock* tail = client->outTail;
+
+        //Text never goes into a block that is sending a file, nor into the
+        //last block of control output, which more control output may follow
+        if (tail == NULL || tail->spool != NULL || tail == client->ctrlTail ||
+                tail->end == sizeof(tail->data)) {
+            tail = insert_block(server, client, tail);
+        }
+        fill_block(tail, &data, &length);
+    }
+}
+
+/*
+* Find where control output goes in a client's pending output: ahead of all
+* of it, unless a line or a file chunk is part way out. That has to be
+* finished first, so a block holding the rest of a partly sent line is split
+* after its newline.
+*
+* Parameters:
+*     server: the server whose slab a split block comes from
+*     client: the client to send control output to
+*
+* Returns:
+*     the block control output follows, or NULL if it goes first.
+*/
+struct OutBlock* find_control_point(struct ServerInf* server,
+        struct ClientInf* client) {
+
+    struct OutBlock* head = client->outHead;
+
+    if (head == NULL || (!client->midLine &&
+            (head->spool == NULL || head->start == 0))) {
+        return NULL;
+    }
+
+    for (struct OutBlock* block = head; block != NULL; block = block->next) {
+        if (block->spool != NULL) {
+            return block;
+        }
+
+        char* newline = memchr(block->data + block->start, '\n',
+                block->end - block->start);
+        if (newline == NULL) {
+            continue;
+        }
+
+        int split = newline + 1 - block->data;
+        if (split < block->end) {
+            struct OutBlock* rest = insert_block(server, client, block);
+            rest->end = block->end - split;
+            memcpy(rest->data, block->data + split, rest->end);
+            block->end = split;
+        }
+        return block;
+    }
+    return client->outTail;
+}
+
+/*
+* Add bytes to a client's pending output ahead of any chat waiting for it,
+* after control output already queued. A line or file chunk already part way
+* out is finished first. Nothing is written until flush_output.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the bytes to
+*     data: the bytes to send
+*     length: the number of bytes in data
+*/
+void append_control(struct ServerInf* server, struct ClientInf* client,
+        const char* data, size_t length) {
+
+    if (!reserve_output(server, client, length)) {
+        return;
+    }
+
+    if (client->ctrlTail == NULL) {
+        client->ctrlTail = insert_block(server, client,
+                find_control_point(server, client));
+    }
+
+    while (length > 0) {
+        struct OutBlock* tail = client->ctrlTail;
+        if (tail->end == sizeof(tail->data)) {
+            tail = insert_block(server, client, tail);
+            client->ctrlTail = tail;
+        }
+        fill_block(tail, &data, &length);
+    }
+}
+
+/*
+* Write as much of a client's pending output as its socket will take without
+* blocking, giving each block back to the slab once it has been sent. Files
+* go out a chunk at a time, with at most one chunk per call so that neither
+* the roster lock nor the client's other output waits behind a whole file. If
+* some is left over the client's worker watches for the socket becoming
+* writable and calls this again. Once a client has joined this must be called
+* with the roster lock held.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client whose output to send
+*/
+void flush_output(struct ServerInf* server, struct ClientInf* client) {
+
+    struct iovec iov[MAX_IOV];
+    bool chunkSent = false;
+
+    TRACE_EVENT(TRACE_FLUSH, TRACE_BEGIN, client->fd);
+    while (client->outHead != NULL) {
+        struct OutBlock* head = client->outHead;
+
+        //A file chunk whose header has gone, its bytes come straight from
+        //the spool
+        if (head->spool != NULL && head->start == head->end) {
+            int result = chunkSent ? 0 : send_chunk(server, client);
+            if (result < 0) {
+                drop_output(server, client);
+            } else if (result > 0) {
+                chunkSent = true;
+                client->midLine = false;
+                continue;
+            }
+            break;
+        }
+
+        int count = 0;
+        size_t total = 0;
+
+        //Nothing may follow a file chunk's header but the chunk itself
+        for (struct OutBlock* block = head; block != NULL &&
+                count < MAX_IOV; block = block->next) {
+            iov[count].iov_base = block->data + block->start;
+            iov[count].iov_len = block->end - block->start;
+            total += iov[count++].iov_len;
+            if (block->spool != NULL) {
+                break;
+            }
+        }
+
+        ssize_t written = writev(client->fd, iov, count);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (written < 0) {
+            drop_output(server, client);
+            break;
+        }
+
+        size_t sent = written;
+        client->outPending -= written;
+        while (written > 0) {
+            struct OutBlock* block = client->outHead;
+            int left = block->end - block->start;
+
+            if (written < left) {
+                block->start += written;
+                client->midLine = block->data[block->start - 1] != '\n';
+                break;
+            }
+            written -= left;
+            client->midLine = block->data[block->end - 1] != '\n';
+            if (block->spool != NULL) {
+                //Header sent, the block stays until the chunk has gone too
+                block->start = block->end;
+                break;
+            }
+            if (block == client->ctrlTail) {
+                client->ctrlTail = NULL;
+            }
+            client->outHead = block->next;
+            slab_free(&server->outputSlab, block);
+        }
+        if (client->outHead == NULL) {
+            client->outTail = NULL;
+        } else if (sent < total) {
+            //The socket is full, the rest waits for EPOLLOUT
+            break;
+        }
+    }
+
+    bool pending = client->outHead != NULL;
+    if (pending != client->writeWait) {
+        watch_output(client, pending);
+    }
+    TRACE_EVENT(TRACE_FLUSH, TRACE_END, client->fd);
+}
+
+/*
+* Send a reply to a client that has not joined yet, straight away. Only the
+* connection's own worker writes to it until it joins, so no lock is needed.
+*
+* Parameters:
+*     server: the server the client is connecting to
+*     client: the client to reply to
+*     message: the reply to send
+*/
+void send_reply(struct ServerInf* server, struct ClientInf* client,
+        char* message) {
+
+    append_control(server, client, message, strlen(message));
+    flush_output(server, client);
+}
+
+/*
+* Remove a client from the linked list structure we have defined to store the
+* client list. The list is linked both ways, so this takes constant time
+* however many clients there are.
+*
+* Parameters:
+*     head: a reference to the head of the list
+*     client: the client to remove from the list. The client itself is not
+*     freed, its worker does that when the connection is torn down
+*/
+void delete_client(struct ClientInf** head, struct ClientInf* client) {
+
+    if (client->prev == NULL) {
+        *head = client->next;
+    } else {
+        client->prev->next = client->next;
+    }
+
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+
+    client->next = NULL;
+    client->prev = NULL;
+}
+
+/*
+* Given a client that has chosen a name, insert the client into linked list 
+* structure in lexographical order of names.
+*
+* Parameters:
+*     head: a reference to the first element in the structure
+*     newClient: the client to insert into the list
+*     name: the name the client has chosen
+*
+* Returns:
+*     The client that has been added to the list.
+*/
+struct ClientInf* insert_client(struct ClientInf** head, 
+        struct ClientInf* newClient, char* name) {
+     
+    set_name(newClient, name, strlen(name));
+    newClient->state = CONN_JOINED;
+
+    //Pointer to head and previous nodes
+    struct ClientInf* currentNode = *head;
+    struct ClientInf* previousNode = NULL;
+    newClient->next = NULL;
+    newClient->prev = NULL;
+
+    if (currentNode == NULL) {
+        *head = newClient;
+        return newClient;
+    }
+
+    while (true) {
+        
+        //If new name comes before current node alphabetically
+        if (are_ordered(newClient->name, currentNode->name)) {
+            newClient->next = currentNode;
+            newClient->prev = previousNode;
+            currentNode->prev = newClient;
+            
+            //Is no previous client, must be head node
+            if (previousNode == NULL) {
+                *head = newClient;
+            } else {
+                previousNode->next = newClient;
+            }
+            break;
+        } else {
+            //Update current node
+            previousNode = currentNode;
+            currentNode = currentNode->next;
+
+            if (currentNode == NULL) {
+                previousNode->next = newClient;
+                newClient->prev = previousNode;
+                break;
+            }
+        }
+    }
+    return newClient;
+}
+
+/*
+* Hash a client name for the name index (FNV-1a).
+*
+* Parameters:
+*     name: the name to hash
+*
+* Returns:
+*     the hash of name
+*/
+unsigned int hash_name(char* name) {
+
+    unsigned int hash = 2166136261u;
+    
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+* Double the number of buckets in the name index and rehash every client into
+* the new buckets.
+*
+* Parameters:
+*     server: the server whose name index to grow
+*/
+void grow_index(struct ServerInf* server) {
+
+    int newSize = server->indexSize * 2;
+    struct ClientInf** buckets = calloc(newSize, sizeof(struct ClientInf*));
+
+    for (int index = 0; index < server->indexSize; index++) {
+        struct ClientInf* current = server->nameIndex[index];
+
+        while (current != NULL) {
+            struct ClientInf* next = current->hashNext;
+            unsigned int bucket = hash_name(current->name) % newSize;
+            current->hashNext = buckets[bucket];
+            buckets[bucket] = current;
+            current = next;
+        }
+    }
+
+    free(server->nameIndex);
+    server->nameIndex = buckets;
+    server->indexSize = newSize;
+}
+
+/*
+* Take the roster lock, tracing how long it was waited for.
+*
+* Parameters:
+*     server: the server whose roster to lock
+*/
+void lock_clients(struct ServerInf* server) {
+
+    TRACE_EVENT(TRACE_LOCK_WAIT, TRACE_BEGIN, 0);
+    take_lock(&server->clientsLock);
+    TRACE_EVENT(TRACE_LOCK_WAIT, TRACE_END, 0);
+    TRACE_EVENT(TRACE_LOCK, TRACE_BEGIN, 0);
+}
+
+/*
+* Release the roster lock taken with lock_clients.
+*
+* Parameters:
+*     server: the server whose roster to unlock
+*/
+void unlock_clients(struct ServerInf* server) {
+
+    TRACE_EVENT(TRACE_LOCK, TRACE_END, 0);
+    release_lock(&server->clientsLock);
+}
+
+/*
+* Look up a client in the roster by name in constant time. Must be called with
+* the roster lock held.
+*
+* Parameters:
+*     server: the server whose roster to search
+*     name: the name of the client to find
+*
+* Returns:
+*     the client with that name, or NULL if there is no such client.
+*/
+struct ClientInf* find_client(struct ServerInf* server, char* name) {
+
+    struct ClientInf* current = 
+            server->nameIndex[hash_name(name) % server->indexSize];
+
+    while (current != NULL && strcmp(current->name, name)) {
+        current = current->hashNext;
+    }
+    return current;
+}
+
+/*
+* Report whether a name is in use by a client here or on any other server in
+* the federation. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server whose roster to check
+*     name: the name to check
+*
+* Returns:
+*     whether the name is taken.
+*/
+bool name_taken(struct ServerInf* server, char* name) {
+    return find_client(server, name) != NULL ||
+            find_remote(&server->federation, NULL, name) != NULL;
+}
+
+/*
+* Forget every name hint. Names are still only handed out if they are free,
+* so this only costs the next clients some probing. Must be called with the
+* roster lock held.
+*
+* Parameters:
+*     server: the server whose hints to forget
+*/
+void forget_hints(struct ServerInf* server) {
+
+    for (int bucket = 0; bucket < HINT_INDEX_SIZE; bucket++) {
+        while (server->nameHints[bucket] != NULL) {
+            struct NameHint* hint = server->nameHints[bucket];
+            server->nameHints[bucket] = hint->next;
+            free(hint);
+        }
+    }
+    server->numHints = 0;
+}
+
+/*
+* Find the hint for a base name, starting a new one from 0 if there is none.
+* Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server whose hints to look in
+*     base: the base name
+*
+* Returns:
+*     the hint for base.
+*/
+struct NameHint* find_hint(struct ServerInf* server, char* base) {
+
+    unsigned int bucket = hash_name(base) % HINT_INDEX_SIZE;
+    struct NameHint* hint;
+
+    for (hint = server->nameHints[bucket]; hint != NULL; hint = hint->next) {
+        if (!strcmp(hint->base, base)) {
+            return hint;
+        }
+    }
+
+    if (server->numHints >= NAME_HINT_LIMIT) {
+        forget_hints(server);
+    }
+    hint = malloc(sizeof(struct NameHint) + strlen(base) + 1);
+    strcpy(hint->base, base);
+    hint->suffix = 0;
+    hint->next = server->nameHints[bucket];
+    server->nameHints[bucket] = hint;
+    server->numHints += 1;
+    return hint;
+}
+
+/*
+* Choose a free name for a client that lets the server pick: base itself if
+* it is free, otherwise base followed by a number, as a client retrying after
+* NAME_TAKEN: would. Numbers carry on from the last one handed out for base,
+* so a join storm of clients with the same base costs each one a single
+* probe. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server the client is joining
+*     client: the client to choose a name for
+*     base: the name the client asked for
+*
+* Returns:
+*     the free name, which lasts until the worker's arena is reset.
+*/
+char* assign_name(struct ServerInf* server, struct ClientInf* client,
+        char* base) {
+
+    if (!name_taken(server, base)) {
+        return base;
+    }
+
+    struct NameHint* hint = find_hint(server, base);
+    char* name = arena_alloc(&client->worker->arena, strlen(base) + 12);
+
+    do {
+        sprintf(name, "%s%u", base, hint->suffix++);
+    } while (name_taken(server, name));
+
+    return name;
+}
+
+/*
+* Add a client that has chosen a free name to the roster list and to the name
+* index. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server whose roster to add the client to
+*     client: the client to add
+*     name: the name the client has chosen
+*/
+void add_to_roster(struct ServerInf* server, struct ClientInf* client,
+        char* name) {
+
+    insert_client(&server->head, client, name);
+    index_client(server, client);
+}
+
+/*
+* Add a client that is already in the roster list to the name index.
+*
+* Parameters:
+*     server: the server whose index is added to
+*     client: the named client to add
+*/
+void index_client(struct ServerInf* server, struct ClientInf* client) {
+
+    if (server->numClients >= server->indexSize) {
+        grow_index(server);
+    }
+    unsigned int bucket = hash_name(client->name) % server->indexSize;
+    client->hashNext = server->nameIndex[bucket];
+    server->nameIndex[bucket] = client;
+    server->numClients += 1;
+}
+
+/*
+* Take a client out of the roster list and the name index. Must be called with
+* the roster lock held.
 *
 * Parameters:
-*     word1: the first word to compare
-*     word2: the second word to compare
-*
-* Returns:
-*     True if word1 is first lexographically or if words are equal. False
-*     otherwise.
+*     server: the server whose roster to remove the client from
+*     client: the client to remove
 */
-bool are_ordered(char* word1, char* word2) {
-    
-    int length1 = strlen(word1);
-    int length2 = strlen(word2);
+void remove_from_roster(struct ServerInf* server, struct ClientInf* client) {
 
-    int shortestLength = length1;
-    bool result = true;
+    delete_client(&server->head, client);
+    clear_filters(server, client);
 
-    if (length2 < shortestLength) {
-        shortestLength = length2;
-        result = false;
+    struct ClientInf** link = 
+            &server->nameIndex[hash_name(client->name) % server->indexSize];
+    while (*link != client) {
+        link = &(*link)->hashNext;
     }
+    *link = client->hashNext;
+    client->hashNext = NULL;
+    server->numClients -= 1;
+}
 
-    for (int index = 0; index < shortestLength; index++) {
-        if (word1[index] < word2[index]) {
-            result = true;
-            break;
-        } else if (word1[index] > word2[index]) {
-            result = false;
-            break;
-        }
-    }
-    return result;
+/*
+* Buffer a message for a client in the roster without sending it yet. The
+* client is remembered as having output pending until flush_messages is
+* called, so several messages to the same client leave in one write. Must be
+* called with the roster lock held.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the message to
+*     message: the message to send
+*/
+void queue_message(struct ServerInf* server, struct ClientInf* client, 
+        char* message) {
+
+    append_output(server, client, message, strlen(message));
+    mark_dirty(server, client);
 }
 
 /*
-* Free the resources associated with a particular client after it has been
-* disconnected.
+* Buffer a control frame for a client in the roster, ahead of any chat still
+* waiting for it, without sending it yet. Must be called with the roster lock
+* held.
 *
 * Parameters:
-*     client: the client whose resources the function will free
+*     server: the server the client is connected to
+*     client: the client to send the frame to
+*     message: the frame to send
 */
-void free_client(struct ClientInf* client) {
-    
-    free(client->name);
-    fclose(client->writeSock);
-    fclose(client->readSock);
-    free(client->clientStats);
+void queue_control(struct ServerInf* server, struct ClientInf* client,
+        char* message) {
 
-    free(client);
+    append_control(server, client, message, strlen(message));
+    mark_dirty(server, client);
 }
 
 /*
-* Remove a client from the linked list structure we have defined to store the
-* client list.
+* Remember that a client has output to be sent by the next flush_messages.
+* Must be called with the roster lock held.
 *
 * Parameters:
-*     head: a reference to the head of the list
-*     name: the name of the client to remove from the list. names must be
-*     unique among clients, so this is a reliable way to remove the correct
-*     client
+*     server: the server the client is connected to
+*     client: the client with output queued
 */
-void delete_client(struct ClientInf** head, char* name) {
-    
-    struct ClientInf* current = *head;
-    struct ClientInf* previous = NULL;
+void mark_dirty(struct ServerInf* server, struct ClientInf* client) {
 
-    while (current != NULL) {
-        
-        if (!strcmp(current->name, name)) {
-            
-            if (previous == NULL && current->next == NULL) {
-                //Element is the only one in list
-                *head = NULL;
-            } else if (previous == NULL) {
-                *head = current->next;
-            } else {
-                previous->next = current->next;
-            }
+    if (!client->dirty) {
+        client->dirty = true;
+        client->dirtyNext = server->dirty;
+        server->dirty = client;
+    }
+}
 
-            free(current);
-            break;
+/*
+* Send everything queue_message has buffered, one write per client, along with
+* anything printed to stdout. Must be called with the roster lock held, before
+* it is released, so that no client in the list can have been freed. Large
+* fanouts are flushed in parallel by the fanout threads.
+*
+* Parameters:
+*     server: the server whose pending output to send
+*/
+void flush_messages(struct ServerInf* server) {
+
+    struct FanoutPool* fanout = &server->fanout;
+    fanout->numClients = 0;
+
+    while (server->dirty != NULL) {
+        struct ClientInf* client = server->dirty;
+        server->dirty = client->dirtyNext;
+        client->dirty = false;
+
+        if (fanout->numClients == fanout->capacity) {
+            fanout->capacity = fanout->capacity * 2 + FANOUT_THRESHOLD;
+            fanout->clients = realloc(fanout->clients,
+                    sizeof(struct ClientInf*) * fanout->capacity);
         }
-        
-        previous = current;
-        current = current->next;
+        fanout->clients[fanout->numClients++] = client;
     }
-     
+
+    if (fanout->numThreads > 0 && fanout->numClients >= FANOUT_THRESHOLD) {
+        flush_fanout(server);
+    } else {
+        for (int index = 0; index < fanout->numClients; index++) {
+            flush_output(server, fanout->clients[index]);
+        }
+    }
+    fflush(stdout);
 }
 
 /*
-* Given information relating to a client, create the new client and then insert
-* the client into linked list structure in lexographical order of names.
+* Function to send out a message to every participating client in the chat.
+* This does not include those who have not passed authentication and name
+* negotiation. Only used for roster notices, which go ahead of queued chat.
+* The message is only queued, see flush_messages.
 *
 * Parameters:
-*     head: a reference to the first element in the structure
-*     name: the name of the client to insert into the list
-*     writeSock: the file pointer used to write to this client
-*     readSock: the file pointer used to read from this client
-*
-* Returns:
-*     The client that has been added to the list.
+*     server: the server whose clients to send the message to
+*     message: the message to broadcast to all participating clients
 */
-struct ClientInf* insert_client(struct ClientInf** head, char* name, 
-        FILE* writeSock, FILE* readSock) {
-     
-    struct ClientInf* newClient = malloc(sizeof(struct ClientInf));
-    newClient->name = malloc(strlen(name) + 1);
-    strcpy(newClient->name, name);
-    newClient->writeSock = writeSock;
-    newClient->readSock = readSock;
-    newClient->clientStats = malloc(sizeof(int) * 3);
-    newClient->threadId = pthread_self();
+void broadcast_message(struct ServerInf* server, char* message) {
     
-    for (int index = 0; index < 3; index++) {
-        newClient->clientStats[index] = 0;
-    }
+    struct ClientInf* current = server->head;
 
-    //Pointer to head and previous nodes
-    struct ClientInf* currentNode = *head;
-    struct ClientInf* previousNode = NULL;
-    newClient->next = NULL;
+    TRACE_EVENT(TRACE_BROADCAST, TRACE_BEGIN, server->numClients);
+    while (current != NULL) {
+        queue_control(server, current, message);
+        current = current->next;  
+    } 
+    TRACE_EVENT(TRACE_BROADCAST, TRACE_END, server->numClients);
+}
 
-    if (currentNode == NULL) {
-        *head = newClient;
-        return newClient;
-    }
+/*
+* Send a chat message to every client whose filters let it through. The
+* sender always gets its own message back.
+*
+* Parameters:
+*     server: the server to send the message on
+*     sender: the client that said the message, or NULL if it was said on
+*     another server
+*     name: the name of whoever said the message
+*     text: the text that was said
+*     message: the complete MSG: line to send
+*/
+void broadcast_said(struct ServerInf* server, struct ClientInf* sender,
+        char* name, char* text, char* message) {
 
-    while (true) {
-        
-        //If new name comes before current node alphabetically
-        if (are_ordered(newClient->name, currentNode->name)) {
-            newClient->next = currentNode;
-            
-            //Is no previous client, must be head node
-            if (previousNode == NULL) {
-                *head = newClient;
-            } else {
-                previousNode->next = newClient;
-            }
-            break;
-        } else {
-            //Update current node
-            previousNode = currentNode;
-            currentNode = currentNode->next;
+    TRACE_EVENT(TRACE_BROADCAST, TRACE_BEGIN, server->numClients);
+    mark_subscribers(server, name, text);
 
-            if (currentNode == NULL) {
-                previousNode->next = newClient;
-                break;
-            }
+    for (struct ClientInf* current = server->head; current != NULL;
+            current = current->next) {
+        if (current == sender || wants_message(server, current)) {
+            queue_message(server, current, message);
+        } else {
+            server->filters.suppressed += 1;
         }
     }
-    return newClient;
+    TRACE_EVENT(TRACE_BROADCAST, TRACE_END, server->numClients);
 }
 
 /*
-* Given the information relating to a potential client (not yet connected),
-* request a name from that client and check if it is taken. Add client if not
-* taken.
+* Given the reply to a WHO: prompt from a potential client (not yet connected),
+* add the client to the chat if the name it asked for is free here and on
+* every other server in the federation. A client that sends NAME:base:AUTO
+* instead lets the server choose a free name built on base, which is sent
+* back as OK:name, so that joining never takes more than one try. The lock
+* is only taken to check the name and insert the client. Another server
+* replies with PEER: instead, and becomes a peer link.
 *
 * Parameters:
-*     head: a reference to the first element in the list of connected clients
-*     writeSock: the file pointer needed to write to this potential client
-*     readSock: the file pointer needed to read from this potential client
-*     clientsLock: the lock needed to safely access the linked list structure
+*     server: the server the client is connecting to
+*     client: the potential client
+*     message: the line the client sent in reply to WHO:
 *
 * Returns:
-*     NULL if name given by client is taken, client object if negotiation was
-*     successful.
+*     false if the reply was invalid and the client should be disconnected,
+*     true otherwise (whether or not the name was taken).
 */
-struct ClientInf* negotiate_name(struct ClientInf** head, 
-        FILE* writeSock, FILE* readSock, sem_t* clientsLock, bool* invalid) {
+bool negotiate_name(struct ServerInf* server, struct ClientInf* client,
+        char* message) {
     
-    //Before using any sockets, take the lock
-    take_lock(clientsLock);
-    write_socket(writeSock, WHO);
+    char* terms[MAX_TERMS];
+    int numTerms = split_query(terms, MAX_TERMS, message);
+    bool assign = numTerms == 3 && !strcmp(CAUTO, terms[2]);
 
-    char* message = read_socket(readSock);    
-    char** terms = malloc(sizeof(char**));
-    int numTerms = unpack_query(terms, message);
-     
-    if (numTerms != 2) {
-        *invalid = true;
-        return NULL;
+    if (numTerms == 2 && !strcmp(CPEER, terms[0])) {
+        return join_federation(server, client, terms[1]);
+    } else if ((numTerms != 2 && !assign) || strcmp(NAME, terms[0])) {
+        return false;
     }
 
-    struct ClientInf* current = *head;
+    lock_clients(server);
 
-    while (current != NULL) {
-        
-        //Name taken
-        if (!strcmp(current->name, terms[1])) {
-            write_socket(writeSock, NAME_TAKEN);
-            return NULL;
-        }
-        
-        current = current->next;
+    char* name = assign ? assign_name(server, client, terms[1]) : terms[1];
+    if (!assign && name_taken(server, name)) {
+        unlock_clients(server);
+        send_reply(server, client, NAME_TAKEN_WHO);
+        __sync_fetch_and_add(&server->serverStats[1], 1);
+        return true;
     }
 
-    struct ClientInf* res = insert_client(head, terms[1], writeSock, readSock);
-    release_lock(clientsLock);
-    fprintf(stdout, "(%s has entered the chat)\n", terms[1]);
-    fflush(stdout);
-    return res;
+    add_to_roster(server, client, name);
+    client->weight = client_weight(server->config, client->name);
+    TRACE_EVENT(TRACE_NAME, TRACE_INSTANT, client->fd);
+    if (assign) {
+        char* namedTerms[] = {NAMED, client->name};
+        queue_control(server, client,
+                arena_message(&client->worker->arena, namedTerms, 2));
+    } else {
+        queue_control(server, client, OK);
+    }
+    char* msgTerms[] = {ENTER, client->name};
+    char* msg = arena_message(&client->worker->arena, msgTerms, 2);
+    broadcast_message(server, msg);
+    relay_join(server, client->name);
+    fprintf(stdout, "(%s has entered the chat)\n", client->name);
+    flush_messages(server);
+    unlock_clients(server);
+
+    reset_arena(&client->worker->arena);
+    return true;
 }
 
 /*
-* Given information relating to a potential client, request authentication from
-* that client.
+* Given a potential client's reply to the AUTH: prompt, check it carries the
+* right authentication string and prompt for a name if it does.
 *
 * Parameters:
-*     writeSock: the file pointer needed to write to this potential client
-*     readSock: the file pointer needed to read from this potential client
-*     auth: the authentication string to connect to this server
+*     server: the server the client is connecting to
+*     client: the potential client
+*     line: the line the client sent in reply to AUTH:
 *
 * Returns:
 *     Whether this client has provided the correct authentication string.
 */
-bool authenticate(FILE* writeSock, FILE* readSock, char* auth) {
-
-    write_socket(writeSock, AUTH); 
+bool authenticate(struct ServerInf* server, struct ClientInf* client,
+        char* line) {
 
-    char* line = read_socket(readSock);
-
-    char** terms = malloc(sizeof(char**));
-    int numTerms = unpack_query(terms, line);
+    char* terms[MAX_TERMS];
+    int numTerms = split_query(terms, MAX_TERMS, line);
      
-    if (numTerms != 2 || strcmp(auth, terms[1])) {
-        free(line);
+    if (numTerms != 2 || strcmp(CAUTH, terms[0]) || 
+            strcmp(server->auth, terms[1])) {
         return false;
     }
     
+    client->state = CONN_NAME;
+    TRACE_EVENT(TRACE_AUTH, TRACE_INSTANT, client->fd);
+    send_reply(server, client, OK_WHO);
+    __sync_fetch_and_add(&server->serverStats[1], 1);
     return true;
 }
 
+/*
+* Send the AUTH: prompt to a connection a worker has just taken up. Replies
+* are handled by process_line as they arrive, so a client may pipeline its
+* AUTH: and NAME: lines without waiting for the prompts.
+*
+* Parameters:
+*     server: the server the client is connecting to
+*     client: the connection to authenticate
+*/
+void start_handshake(struct ServerInf* server, struct ClientInf* client) {
+    __sync_fetch_and_add(&server->serverStats[0], 1);
+    send_reply(server, client, AUTH);
+}
+
 /*
 * Called in response to the LIST: command from a connected client. Will list
 * out the names of all currently participating clients and send them to the
-* requesting client.
+* requesting client. Chatters on other servers in the federation are merged
+* into the list in name order.
 *
 * Parameters:
-*     head: a reference to the first element in list structure
+*     server: the server the client is connected to
 *     client: the client who requested the list of participants
 */
-void list_names(struct ClientInf** head, struct ClientInf* client) {
+void list_names(struct ServerInf* server, struct ClientInf* client) {
     
-    struct ClientInf* current = *head;
+    struct ClientInf* current;
+    struct RemoteUser* remote;
+    size_t length = 1;
 
-    char* message = malloc(strlen(current->name) + 1);
-    strcpy(message, current->name);
-    
-    current = current->next;
+    for (current = server->head; current != NULL; current = current->next) {
+        length += strlen(current->name) + 1;
+    }
+    for (remote = server->federation.remotes; remote != NULL;
+            remote = remote->next) {
+        length += strlen(remote->name) + 1;
+    }
 
-    while (current != NULL) {
-        
-        message = realloc(message, 
-                strlen(message) + strlen(current->name) + 2);
-        sprintf(message, "%s,%s", message, current->name);
-    
+    char* message = arena_alloc(&client->worker->arena, length);
+    char* end = message;
+    current = server->head;
+    remote = server->federation.remotes;
+
+    while (current != NULL || remote != NULL) {
+        char* name;
+        if (remote == NULL || 
+                (current != NULL && are_ordered(current->name, remote->name))) {
+            name = current->name;
+            current = current->next;
+        } else {
+            name = remote->name;
+            remote = remote->next;
+        }
 
-        current = current->next;
+        if (end != message) {
+            *end++ = ',';
+        }
+        size_t nameLength = strlen(name);
+        memcpy(end, name, nameLength);
+        end += nameLength;
     } 
+    *end = '\0';
     
     char* msgTerms[] = {"LIST", message};
-    char* msg = construct_message(msgTerms, 2);    
-    write_socket(client->writeSock, msg);
-    free(msg);
-}
-
-/*
-* Function to send out a message to every participating client in the chat.
-* This does not include those who have not passed authentication and name
-* negotiation.
-*
-* Parameters:
-*     head: a reference to the first element of the list structure
-*     message: the message to broadcast to all participating clients
-*/
-void broadcast_message(struct ClientInf** head, char* message) {
-    
-    struct ClientInf* current = *head;
-
-    while (current != NULL) {
-        write_socket(current->writeSock, message);
-        current = current->next;  
-    } 
+    char* msg = arena_message(&client->worker->arena, msgTerms, 2);    
+    queue_control(server, client, msg);
 }
 
 /*
 * Called in response to a KICK:clientname request from a participating client.
 * Will search the list structure and attempt to kicked the named client. If
 * client is found, will broadcast appropriate message to the chat participants.
-* If no client found, request is silently resolved.
+* If no client found, request is silently resolved. The kicked client is taken
+* out of the roster straight away and handed to its own worker, which tears
+* the connection down as soon as it is woken.
 *
 * Parameters:
-*     head: a reference to the first element in the list structure
+*     server: the server the kicker is connected to
 *     name: the name of the client to attempt to kick
+*     kicker: the client who sent the KICK: request
+*
+* Returns:
+*     whether the kicker kicked themselves and should be disconnected.
 */
-void attempt_kick(struct ClientInf** head, char* name, 
+bool attempt_kick(struct ServerInf* server, char* name, 
         struct ClientInf* kicker) {
     
-    struct ClientInf* current = *head; 
+    struct ClientInf* current = find_client(server, name);
+
+    if (current == NULL) {
+        return false;
+    }
+
+    //KICK: goes out ahead of any chat still buffered for the kicked client,
+    //which follows it for as long as the socket takes it
+    append_control(server, current, KICK, strlen(KICK));
+    flush_output(server, current);
+    remove_from_roster(server, current);
+    current->state = CONN_GONE;
 
     char* msgTerms[] = {LEAVE, name};
-    char* msg = construct_message(msgTerms, 2);
-    
-    if (!strcmp(kicker->name, name)) {
-        write_socket(kicker->writeSock, KICK);
-        delete_client(head, kicker->name);
-        broadcast_message(head, msg);
-        fprintf(stdout, "(%s has left the chat)\n", name);
-        fflush(stdout);
-        pthread_exit((void*) 3);  
+    char* msg = arena_message(&kicker->worker->arena, msgTerms, 2);
+    broadcast_message(server, msg);
+    relay_part(server, name);
+    fprintf(stdout, "(%s has left the chat)\n", name);
+
+    if (current == kicker) {
+        return true;
     }
 
-    while (current != NULL) {
-        
-        if (!strcmp(name, current->name)) {
-            write_socket(current->writeSock, KICK);
-            pthread_cancel(current->threadId);
-            delete_client(head, current->name);
-            broadcast_message(head, msg); 
-            fprintf(stdout, "(%s has left the chat)\n", name);
-            fflush(stdout);
-        }
-        current = current->next;
+    disconnect_client(server, current);
+    return false;
+}
+
+/*
+* Called in response to a TELL:name:text request from a participating client.
+* The recipient is found through the name index and only their socket is
+* written to. If there is no such client the sender is told so instead.
+*
+* Parameters:
+*     server: the server the sender is connected to
+*     sender: the client who sent the TELL: request
+*     name: the name of the client to deliver the text to
+*     text: the text to deliver
+*/
+void tell_client(struct ServerInf* server, struct ClientInf* sender, 
+        char* name, char* text) {
+
+    struct ClientInf* recipient = find_client(server, name);
+
+    if (recipient == NULL) {
+        char* msgTerms[] = {UNKNOWN_NAME, name};
+        queue_control(server, sender, 
+                arena_message(&sender->worker->arena, msgTerms, 2));
+        return;
     }
 
-    free(msg);
+    char* msgTerms[] = {TELL, sender->name, text};
+    queue_message(server, recipient, 
+            arena_message(&sender->worker->arena, msgTerms, 3));
 }
 
 /*
 * Given a message from a client, process the message and perform the
-* appropriate actions. Invalid messages are silently ignored
+* appropriate actions. Invalid messages are silently ignored. Must be called
+* with the roster lock held.
 *
 * Parameters:
-*     head: a reference to the first element in the list structure
+*     server: the server the client is connected to
 *     client: the client from which this message was received
-*     lock: the lock needed to safely access the list structure
 *     line: the line received from client for processing
 *
 * Returns:
 *     whether this message indicates that this client is finished talking and
 *     is about to disconnect.
 */
-bool process_message(struct ClientInf** head, struct ClientInf* client, 
-        sem_t* lock, int* serverStats, char* line) {
+bool process_message(struct ServerInf* server, struct ClientInf* client, 
+        char* line) {
 
     bool isDone = false;
+    int* serverStats = server->serverStats;
 
-    char** terms = malloc(sizeof(char**));
-    int numTerms = unpack_query(terms, line);
+    char* terms[MAX_TERMS];
+    int numTerms = split_query(terms, MAX_TERMS, line);
 
     if (numTerms == 2 && !strcmp(SAY, terms[0])) {
         client->clientStats[0] += 1;
         serverStats[2] += 1;
         char* msgTerms[] = {MSG, client->name, terms[1]};
-        char* msg = construct_message(msgTerms, 3);
-        broadcast_message(head, msg);
+        char* msg = arena_message(&client->worker->arena, msgTerms, 3);
+        broadcast_said(server, client, client->name, terms[1], msg);
+        relay_said(server, client->name, terms[1]);
         fprintf(stdout, "%s: %s\n", client->name, terms[1]);
-        fflush(stdout);
-        free(msg);
 
     } else if (numTerms == 2 && !strcmp(CKICK, terms[0])) {
         client->clientStats[1] += 1;
         serverStats[3] += 1;
 
-        attempt_kick(head, terms[1], client);
+        isDone = attempt_kick(server, terms[1], client);
 
     } else if (numTerms == 1 && !strcmp(CLEAVE, terms[0])) {
         serverStats[5] += 1;
         fprintf(stdout, "(%s has left the chat)\n", client->name);
-        fflush(stdout);
-        delete_client(head, client->name);
+        remove_from_roster(server, client);
+        relay_part(server, client->name);
+        client->state = CONN_GONE;
         isDone = true;
 
     } else if (numTerms == 1 && !strcmp(LIST, terms[0])) {
         client->clientStats[2] += 1;
         serverStats[4] += 1;  
-        list_names(head, client);
+        list_names(server, client);
+
+    } else if (numTerms == 3 && !strcmp(CTELL, terms[0])) {
+        client->clientStats[3] += 1;
+        serverStats[6] += 1;
+        tell_client(server, client, terms[1], terms[2]);
+
+    } else if (numTerms == 4 && !strcmp(CSEND, terms[0])) {
+        isDone = start_upload(server, client, terms[1], terms[2], terms[3]);
+
+    } else if (numTerms == 3 && !strcmp(CFILTER, terms[0])) {
+        add_filter(server, client, terms[1], terms[2]);
+
+    } else if (numTerms == 2 && !strcmp(CFILTER, terms[0]) && 
+            !strcmp(CLEAR, terms[1])) {
+        clear_filters(server, client);
+
+    } else if (numTerms == 1 && !strcmp(CPING, terms[0])) {
+        queue_control(server, client, PONG);
+
+    } else if (numTerms == 1 && !strcmp(CSHM, terms[0]) && 
+            client->ring != NULL) {
+        //The worker attached the ring when it arrived, confirm the switch
+        queue_control(server, client, RING_OFFER);
     }
 
     return isDone;
 }   
 
 /*
-* Given the information relating to a client, enter a loop of sending and 
-* receiving messages from client and performing the proper processing on those
-* messages. Loop continues until client is kicked or has left.
+* Process a run of chat commands from a client that has joined, or of frames
+* from a peer link, all under a single acquisition of the roster lock.
+* Everything the commands send is flushed together at the end, one write per
+* recipient.
 *
 * Parameters:
-*     head: a reference to the first element of the list structure
-*     client: the client that this function is communicating with
-*     lock: the lock needed to safely access the list structurw
+*     server: the server the lines were received by
+*     client: the connection the lines were received on
+*     lines: the lines received, in order
+*     numLines: the number of lines in lines
+*
+* Returns:
+*     whether the connection should now be torn down.
 */
-void talk(struct ClientInf** head, struct ClientInf* client, sem_t* lock, 
-        int* serverStats) {
-    
-    while (true) {
-        
-        char* line = read_socket(client->readSock); 
-
-        if (!strcmp("EOF", line)) { 
-            char* msgTerms[] = {LEAVE, client->name};
-            char* msg = construct_message(msgTerms, 2);
-            fprintf(stdout, "(%s has left the chat)\n", client->name);
-            fflush(stdout);
-            delete_client(head, client->name);
-            broadcast_message(head, msg);
-            free(msg);
-            pthread_exit((void*) 2);
-        }
+bool process_batch(struct ServerInf* server, struct ClientInf* client,
+        char** lines, int numLines) {
 
-        take_lock(lock);
+    bool isDone = false;
 
-        if (process_message(head, client, lock, serverStats, line)) {
-            release_lock(lock);
-            break;
-        }
+    lock_clients(server);
+    server->batches += 1;
 
-        release_lock(lock);
-        free(line);
-        usleep(CLIENT_DELAY);
+    for (int index = 0; index < numLines && !isDone; index++) {
+
+        if (client->state == CONN_PEER) {
+            isDone = process_frame(server, client, lines[index]);
+        } else {
+            //Kicked since these lines were read
+            isDone = client->state == CONN_GONE ||
+                    process_message(server, client, lines[index]);
+        }
+        server->batchedLines += 1;
+        reset_arena(&client->worker->arena);
     }
+    
+    flush_messages(server);
+    unlock_clients(server);
+    return isDone;
 }
 
 /*
-* The thread function that begins the communciations with a client once they
-* have been officially connected. Encapsulates the entire conversation between
-* the server and a particular client.
+* Called by a worker for a line received on one of its connections. Lines
+* that arrive during the handshake answer the AUTH: and WHO: prompts, after
+* that they are chat commands processed under the roster lock.
 *
 * Parameters:
-*     arg: compulsary void* arg to thread function. Actually contains all
-*     information needed to communicate with a particular client
+*     server: the server the line was received by
+*     client: the connection the line was received on
+*     line: the line received
 *
 * Returns:
-*     compulsary void* return value. Is actually an integer value indicating
-*     whether an error has occured or if the thread has ended naturally.
+*     whether the connection should now be torn down.
 */
-void* client_thread(void* arg) {
-    
-    struct ThreadInf threadInf = *(struct ThreadInf*) arg;
-    struct ClientInf** head = threadInf.head;
-    char* auth = threadInf.auth;
-    int fd = threadInf.fd;    
-    int fd2 = dup(fd);
-    int* serverStats = threadInf.serverStats;
-    sem_t* clientsLock = threadInf.clientsLock; 
-       
-    FILE* writeSock = fdopen(fd, "w");
-    FILE* readSock = fdopen(fd2, "r"); 
-    
-    serverStats[0] += 1;
-    if (!authenticate(writeSock, readSock, auth)) {
-        fclose(writeSock);
-        fclose(readSock);
-        pthread_exit((void*)(2));
+bool process_line(struct ServerInf* server, struct ClientInf* client,
+        char* line) {
+
+    if (client->state == CONN_AUTH) {
+        return !authenticate(server, client, line);
+    } else if (client->state == CONN_NAME) {
+        return !negotiate_name(server, client, line);
     }
 
-    take_lock(clientsLock);
-    write_socket(writeSock, OK);
-    release_lock(clientsLock);
-    
-    struct ClientInf* client; 
-    bool invalid = false;
-
-    serverStats[1] += 1;
-    //While name hasn't been negotiated
-    while ((client = negotiate_name(head, writeSock, readSock, 
-                clientsLock, &invalid)) == NULL) { 
-        if (invalid) {
-            fclose(writeSock);
-            fclose(readSock);
-            pthread_exit(0);
-        }
+    return process_batch(server, client, &line, 1);
+}
 
-        release_lock(clientsLock);
-        serverStats[1] += 1;
+/*
+* Take a client whose connection is going away out of the roster and let
+* everyone else know that they have left. Clients that never joined, or that
+* have already been removed by a KICK: or LEAVE:, are left alone. A peer
+* link takes everyone announced on it with it.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client whose connection is going away
+*/
+void remove_client(struct ServerInf* server, struct ClientInf* client) {
+
+    lock_clients(server);
+
+    if (client->state == CONN_PEER) {
+        drop_link(server, client);
+        client->state = CONN_GONE;
+        flush_messages(server);
+        unlock_clients(server);
+        reset_arena(&client->worker->arena);
+        return;
+    } else if (client->state != CONN_JOINED) {
+        unlock_clients(server);
+        return;
     }
-    
-    take_lock(clientsLock);
-    write_socket(writeSock, OK);
-    char* msgTerms[] = {ENTER, client->name};
-    char* msg = construct_message(msgTerms, 2);
-    broadcast_message(head, msg);
-    release_lock(clientsLock);
 
-    talk(head, client, clientsLock, serverStats); 
-    return (void*) 0;
+    remove_from_roster(server, client);
+    client->state = CONN_GONE;
+
+    char* msgTerms[] = {LEAVE, client->name};
+    char* msg = arena_message(&client->worker->arena, msgTerms, 2);
+    broadcast_message(server, msg);
+    relay_part(server, client->name);
+    fprintf(stdout, "(%s has left the chat)\n", client->name);
+    flush_messages(server);
+    unlock_clients(server);
+
+    reset_arena(&client->worker->arena);
+}
+
+/*
+* Print how much memory the server holds for its connections: the slabs
+* every client record and buffer comes from, plus names too long to keep
+* inline. Socket buffers in the kernel are not counted.
+*
+* Parameters:
+*     server: the server to report on
+*/
+void print_memory(struct ServerInf* server) {
+
+    int clients;
+    int inputs;
+    int blocks;
+    size_t bytes = slab_usage(&server->clientSlab, &clients) +
+            slab_usage(&server->inputSlab, &inputs) +
+            slab_usage(&server->outputSlab, &blocks);
+
+    for (struct ClientInf* current = server->head; current != NULL;
+            current = current->next) {
+        if (current->name != current->shortName) {
+            bytes += strlen(current->name) + 1;
+        }
+    }
+
+    fprintf(stderr, "@MEMORY@\n");
+    fprintf(stderr, "memory:CONNS:%d:INPUT_BUFFERS:%d:OUTPUT_BLOCKS:%d:"
+            "BYTES:%zu:BYTES_PER_CONN:%zu\n", clients, inputs, blocks, bytes,
+            clients ? bytes / clients : 0);
 }
 
 /*
 * Function to print the current chat statistics when prompted.
 *
 * Parameters:
-*     head: a reference to the first element in the list structure
-*     serverStats: the statistics collected by the server at this point
-*     in the chat
+*     server: the server whose statistics to print
 */
-void print_stats(struct ClientInf** head, int* serverStats) {
+void print_stats(struct ServerInf* server) {
     
+    int* serverStats = server->serverStats;
     fprintf(stderr, "@CLIENTS@\n");
 
-    struct ClientInf* current = *head;
+    struct ClientInf* current = server->head;
 
     while (current != NULL) {
         
         int say = current->clientStats[0];
         int kick = current->clientStats[1];
         int list = current->clientStats[2];
+        int tell = current->clientStats[3];
         
-        fprintf(stderr, "%s:SAY:%d:KICK:%d:LIST:%d\n", 
-                current->name, say, kick, list);
+        fprintf(stderr, "%s:SAY:%d:KICK:%d:LIST:%d:TELL:%d\n", 
+                current->name, say, kick, list, tell);
         
         current = current->next;
     }
@@ -649,10 +1724,35 @@ void print_stats(struct ClientInf** head, int* serverStats) {
     int kick = serverStats[3];
     int list = serverStats[4];
     int leave = serverStats[5];
+    int tell = serverStats[6];
 
     fprintf(stderr, "@SERVER@\n");
     fprintf(stderr, "server:AUTH:%d:NAME:%d:SAY:%d:KICK:%d:"
-            "LIST:%d:LEAVE:%d\n", auth, name, say, kick, list, leave);
+            "LIST:%d:LEAVE:%d:TELL:%d\n", auth, name, say, kick, list, leave,
+            tell);
+    print_pool_stats(&server->pool);
+    print_timer_stats(&server->pool);
+
+    long long lines = server->batchedLines;
+    fprintf(stderr, "@BATCH@\n");
+    fprintf(stderr, "batch:LOCKS:%lld:LINES:%lld:AVG_LINES:%.2f:"
+            "FANOUT_JOBS:%lld\n", server->batches, lines, 
+            server->batches ? (double) lines / server->batches : 0.0,
+            server->fanout.jobs);
+
+    int subscribers = 0;
+    for (struct ClientFilter* filter = server->filters.head; filter != NULL;
+            filter = filter->next) {
+        subscribers += 1;
+    }
+    fprintf(stderr, "@FILTER@\n");
+    fprintf(stderr, "filter:SUBSCRIBERS:%d:SUPPRESSED:%lld\n", subscribers,
+            server->filters.suppressed);
+    print_transfer_stats(server);
+    print_federation_stats(server);
+    print_capture_stats(server);
+    print_memory(server);
+    print_schedule_stats(server);
     fflush(stderr);
 
 }
@@ -663,31 +1763,38 @@ void print_stats(struct ClientInf** head, int* serverStats) {
 * required format
 *
 * Parameters:
-*     arg: compulsary void* argument to thread function. Is actually an
-*     instance of the ThreadInf struct containing all the statistics needed.
+*     arg: compulsary void* argument to thread function. Is actually the
+*     ServerInf instance containing all the statistics needed.
 *
 * Returns:
 *     compulsary void* return value. Returns 0.
 */
 void* signal_thread(void* arg) {
     
-    struct ThreadInf threadInf = *(struct ThreadInf*) arg;
-    struct ClientInf** head = threadInf.head;
-    sem_t* clientsLock = threadInf.clientsLock;
-    int* serverStats = threadInf.serverStats;
+    struct ServerInf* server = (struct ServerInf*) arg;
 
     int signal;
     sigset_t set;
 
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+#ifdef TRACE
+    sigaddset(&set, SIGUSR1);
+#endif
     pthread_sigmask(SIG_BLOCK, &set, NULL);
+    TRACE_THREAD("signals");
 
     while (true) {
         sigwait(&set, &signal);
-        take_lock(clientsLock);
-        print_stats(head, serverStats);
-        release_lock(clientsLock);
+#ifdef TRACE
+        if (signal == SIGUSR1) {
+            trace_dump();
+            continue;
+        }
+#endif
+        lock_clients(server);
+        print_stats(server);
+        unlock_clients(server);
     }
 
     return (void*) 0;
@@ -701,85 +1808,101 @@ void init_mask() {
     sigset_t mask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGHUP);
+#ifdef TRACE
+    sigaddset(&mask, SIGUSR1);
+#endif
     pthread_sigmask(SIG_BLOCK, &mask, NULL);
 }
 
 /*
-* Function to initialise the ThreadInf instance needed in the signal_thread
-* function and then to create the new thread.
+* Function to create the thread that handles the SIGHUP signal.
 *
 * Parameters:
-*     head: a reference to the first element in the list structure
-*     serverStats: the chat statistics collected by the server at any point
-*     in time
-*     lock: the lock needed to access the list structure safely
+*     server: the server whose statistics the thread prints
 */
-void init_signal_thread(struct ClientInf** head, int* serverStats, 
-        sem_t* lock) {
+void init_signal_thread(struct ServerInf* server) {
     
-    struct ThreadInf* threadInf = malloc(sizeof(struct ThreadInf));
-    threadInf->serverStats = serverStats;
-    threadInf->head = head;
-    threadInf->clientsLock = lock;
-
     //Signal handling thread
     pthread_t threadId;
-    pthread_create(&threadId, NULL, signal_thread, threadInf);
+    pthread_create(&threadId, NULL, signal_thread, server);
 }
 
 /*
-* Sit in a loop and accept connections from clients, spawning child threads to
-* deal with connection requests from each client. Inspired heavily by lecture
-* example multithreadingserver.c.
+* Sit in a loop and accept connections from clients, handing each one to the
+* worker pool. Inspired heavily by lecture example multithreadingserver.c.
 *
 * Parameters:
-*     serverfd: the file descriptor to communicate with the server on.
+*     listeners: the sockets to accept connections and handoffs on
 *     auth: the authentication string that clients must provide in order to
 *     connect.
+*     config: the settings taken from the command line
+*     snapshot: the state taken over from an old server, or NULL
 */
-void process_connections(int serverfd, char* auth) {
+void process_connections(struct Listeners* listeners, char* auth, 
+        struct ServerConfig* config, struct Snapshot* snapshot) {
     
     //Need to maintain a linked-list structure of clients with locking
-    struct ClientInf* head = NULL;
-    sem_t clientsLock;
-    init_lock(&clientsLock);
-
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
-    int fd;
-
-    //Block SIGHUP in all threads
+    struct ServerInf server;
+    memset(&server, 0, sizeof(struct ServerInf));
+    server.head = NULL;
+    server.auth = auth;
+    server.config = config;
+    init_lock(&server.clientsLock);
+    server.indexSize = INDEX_SIZE;
+    server.nameIndex = calloc(INDEX_SIZE, sizeof(struct ClientInf*));
+    server.nameHints = calloc(HINT_INDEX_SIZE, sizeof(struct NameHint*));
+    init_slab(&server.clientSlab, sizeof(struct ClientInf), SLAB_CHUNK);
+    init_slab(&server.inputSlab, sizeof(struct LineBuf), SLAB_CHUNK);
+    init_slab(&server.outputSlab, sizeof(struct OutBlock), SLAB_CHUNK);
+
+    struct pollfd handoff = {.fd = listeners->handoffFd, .events = POLLIN};
+
+    //Tracing is set up by the first thread to trace, before any others
+    TRACE_THREAD("main");
+
+    //Block SIGHUP in all threads, and report writes to dead sockets as
+    //errors rather than dying
     init_mask();
+    signal(SIGPIPE, SIG_IGN);
 
-    int serverStats[] = {0, 0, 0, 0, 0, 0};
-
-    //Spawn signal handler thread
-    init_signal_thread(&head, serverStats, &clientsLock);
-
-    while (true) {
-        fromAddrSize = sizeof(struct sockaddr_in);
-    
-        //Will wait until connection becomes available
-        fd = accept(serverfd, (struct sockaddr*)&fromAddr, &fromAddrSize);
+    //Spawn signal handler thread and the workers
+    init_signal_thread(&server);
+    if (config->captureFd >= 0) {
+        init_capture(&server, config->captureFd);
+    }
+    init_pool(&server);
+    init_federation(&server);
 
-        //Error connecting to client
-        if (fd < 0) {
-            continue;
-        }    
+    if (snapshot != NULL) {
+        restore_snapshot(&server, snapshot);
+    }
 
-        //Have now successfully connected.
-        struct ThreadInf* threadInfo = malloc(sizeof(struct ThreadInf));
-        threadInfo->fd = fd;
-        threadInfo->head = &head;
-        threadInfo->auth = auth;
-        threadInfo->clientsLock = &clientsLock;
-        threadInfo->serverStats = serverStats;
+    //Connections are taken by the acceptors from here on
+    init_acceptors(&server, listeners);
 
-        pthread_t threadId;
-        pthread_create(&threadId, NULL, client_thread, threadInfo); 
+    while (true) {
+        //Negative descriptors are ignored by poll, so with no handoff socket
+        //this waits forever
+        if (poll(&handoff, 1, -1) > 0 && handoff.revents) {
+            hand_off(&server, listeners);
+        }
     }
 }
 
+/*
+* Print the usage message and exit.
+*/
+void usage_error() {
+    fprintf(stderr, "Usage: server [-t handshaketimeout] [-w workers] "
+            "[-q queuesize] [-m maxclients] [-s stackkb] [-b batchlimit] "
+            "[-f fanoutthreads] [-a acceptors] [-l backlog] [-r] "
+            "[-u socketpath] [-H handoffpath] [-P host:port]... "
+            "[-c capturefile] [-W name:weight]... [-p pinginterval] "
+            "[-i idletimeout] authfile [port]\n");
+    fflush(stderr);
+    exit(1);
+}
+
 /*
 * Opens auth file and performs basic error checking on command line arguments.
 * Initialises connection to the given port number and then calls
@@ -788,27 +1911,141 @@ void process_connections(int serverfd, char* auth) {
 int main(int argc, char** argv) {
     
     int fd;
+    int opt;
+    struct ServerConfig config = {
+        .handshakeTimeout = DEFAULT_HANDSHAKE_TIMEOUT,
+        .numWorkers = DEFAULT_WORKERS,
+        .queueSize = DEFAULT_QUEUE_SIZE,
+        .maxClients = DEFAULT_MAX_CLIENTS,
+        .stackSize = DEFAULT_STACK_SIZE,
+        .batchLimit = DEFAULT_BATCH_LIMIT,
+        .fanoutThreads = sysconf(_SC_NPROCESSORS_ONLN),
+        .numAcceptors = DEFAULT_ACCEPTORS,
+        .backlog = SOMAXCONN,
+        .rejectWhenFull = false,
+        .unixPath = NULL,
+        .handoffPath = NULL,
+        .peers = NULL,
+        .numPeers = 0,
+        .captureFd = -1,
+        .weights = NULL,
+        .numWeights = 0,
+        .pingInterval = DEFAULT_PING_INTERVAL,
+        .idleTimeout = 0
+    };
+
+    while ((opt = getopt(argc, argv,
+            "t:w:q:m:s:b:f:a:l:ru:H:P:c:W:p:i:")) != -1) {
+        int value = optarg ? atoi(optarg) : 0;
+
+        if (opt == 'r') {
+            config.rejectWhenFull = true;
+        } else if (opt == 'u') {
+            config.unixPath = optarg;
+        } else if (opt == 'H') {
+            config.handoffPath = optarg;
+        } else if (opt == 'P' && strrchr(optarg, ':') != NULL) {
+            config.peers = realloc(config.peers, 
+                    sizeof(char*) * (config.numPeers + 1));
+            config.peers[config.numPeers++] = optarg;
+        } else if (opt == 'P') {
+            usage_error();
+        } else if (opt == 'W' && parse_weight(optarg) > 0) {
+            config.weights = realloc(config.weights,
+                    sizeof(char*) * (config.numWeights + 1));
+            config.weights[config.numWeights++] = optarg;
+        } else if (opt == 'W') {
+            usage_error();
+        } else if (opt == 'c' && (config.captureFd = open(optarg, 
+                O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+            usage_error();
+        } else if (opt == 'c') {
+            continue;
+        } else if (opt == 'p' && !strcmp(optarg, "0")) {
+            //No heartbeats
+            config.pingInterval = 0;
+        } else if (value <= 0) {
+            usage_error();
+        } else if (opt == 't') {
+            config.handshakeTimeout = value;
+        } else if (opt == 'w') {
+            config.numWorkers = value;
+        } else if (opt == 'q') {
+            config.queueSize = value;
+        } else if (opt == 'm') {
+            config.maxClients = value;
+        } else if (opt == 's') {
+            config.stackSize = value;
+        } else if (opt == 'b') {
+            config.batchLimit = value;
+        } else if (opt == 'f') {
+            config.fanoutThreads = value;
+        } else if (opt == 'a') {
+            config.numAcceptors = value;
+        } else if (opt == 'l') {
+            config.backlog = value;
+        } else if (opt == 'p') {
+            config.pingInterval = value;
+        } else if (opt == 'i') {
+            config.idleTimeout = value;
+        } else {
+            usage_error();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    //sysconf may fail, the sending thread alone can always flush
+    if (config.fanoutThreads < 1) {
+        config.fanoutThreads = 1;
+    }
   
     if (argc < 2 || argc > 3 || (fd = open(argv[1], O_RDONLY)) == -1) {
-        fprintf(stderr, "Usage: server authfile [port]\n");
-        fflush(stderr);
-        exit(1);
+        usage_error();
     }
 
     FILE* authFile = fdopen(fd, "r");
     char* auth = read_input(authFile, true);
 
-    int serverfd = 0;
     char* port;
     unsigned int portNum = 0;
+    struct Listeners listeners = {.serverfd = 0, .unixfd = -1,
+            .handoffFd = -1};
+    struct Snapshot* snapshot = NULL;
     
     if (argc == 3) {
         port = argv[2];
     } else {
         port = "0";
     }
+
+    //Take over from a running server if there is one, keeping its sockets
+    if (config.handoffPath) {
+        snapshot = take_over(config.handoffPath, &listeners);
+    }
     
-    if (init_comms(port, &serverfd, &portNum) == 2) {
+    //The old server may still be writing the capture, so it is only
+    //started afresh when there was none to take over from
+    if (snapshot == NULL && config.captureFd >= 0 &&
+            ftruncate(config.captureFd, 0) < 0) {
+        perror("capture");
+    }
+
+    if (snapshot != NULL) {
+        struct sockaddr_in addr;
+        socklen_t length = sizeof(struct sockaddr_in);
+        getsockname(listeners.serverfd, (struct sockaddr*) &addr, &length);
+        portNum = ntohs(addr.sin_port);
+    } else if (init_comms(port, &listeners.serverfd, &portNum,
+            config.backlog) == 2 || (config.unixPath && 
+            init_unix_comms(config.unixPath, &listeners.unixfd, 
+            config.backlog, false) == 2)) {
+        fprintf(stderr, "Communications error\n");
+        return 2;
+    }
+
+    if (config.handoffPath && init_unix_comms(config.handoffPath,
+            &listeners.handoffFd, 1, true) == 2) {
         fprintf(stderr, "Communications error\n");
         return 2;
     }
@@ -816,7 +2053,7 @@ int main(int argc, char** argv) {
     fprintf(stderr, "%u\n", portNum);
     fflush(stderr);
 
-    process_connections(serverfd, auth);
+    process_connections(&listeners, auth, &config, snapshot);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "sharedfunc.h"
+#include "mempool.h"
+#include "shmring.h"
+#include "trace.h"
+#include "timerwheel.h"
+
+//Number of chat statistics for client and server
+#define NUM_CLI_STATS 4
+#define NUM_SVR_STATS 7
+
+//Settings taken from the command line
+struct ServerConfig {
+    int handshakeTimeout;
+    int numWorkers;
+    int queueSize;
+    int maxClients;
+    int stackSize;
+    int batchLimit;
+    int fanoutThreads;
+    int numAcceptors;
+    int backlog;
+    bool rejectWhenFull;
+    char* unixPath;
+    char* handoffPath;
+    char** peers;
+    int numPeers;
+    int captureFd;
+    char** weights;
+    int numWeights;
+    int pingInterval;
+    int idleTimeout;
+};
+
+//Sockets the acceptor waits on. unixfd and handoffFd are -1 when unused
+struct Listeners {
+    int serverfd;
+    int unixfd;
+    int handoffFd;
+};
+
+//Where a connection is up to. Only CONN_JOINED clients are in the roster, a
+//CONN_GONE client has been removed from it and is waiting to be torn down.
+//A CONN_PEER connection is a link to another server in the federation
+enum ConnState {
+    CONN_AUTH,
+    CONN_NAME,
+    CONN_JOINED,
+    CONN_GONE,
+    CONN_PEER
+};
+
+//Kinds of filter a client can register with FILTER:kind:text
+enum FilterKind {
+    FILTER_ALLOW,
+    FILTER_DENY,
+    FILTER_PREFIX,
+    FILTER_KEYWORD,
+    NUM_FILTER_KINDS
+};
+
+//A client's filters on the chat messages it is sent. The marks are set to
+//the current epoch while a message is matched against every filter at once
+struct ClientFilter {
+    char** items[NUM_FILTER_KINDS];
+    int counts[NUM_FILTER_KINDS];
+    unsigned int allowMark;
+    unsigned int denyMark;
+    unsigned int contentMark;
+    struct ClientFilter* next;
+};
+
+//Files sent with SEND: since the server started. Updated atomically, as
+//fanout threads send file bytes in parallel
+struct TransferStats {
+    long long sent;
+    long long refused;
+    long long bytesIn;
+    long long bytesOut;
+};
+
+//Every client's filters, and the matcher compiled from them, which is rebuilt
+//on the next message whenever stale is set
+struct FilterSet {
+    struct ClientFilter* head;
+    bool stale;
+    unsigned int epoch;
+    struct MatchNode* nodes;
+    int numNodes;
+    struct MatchOutput* outputs;
+    int numOutputs;
+    struct SenderRule* rules;
+    int* buckets;
+    int numBuckets;
+    long long suppressed;
+};
+
+//Longest id a server is known by in the federation, with the terminator
+#define NODE_ID_SIZE 17
+
+//A chatter connected to another server in the federation. via is the link
+//they were announced on. Kept in name order like the roster
+struct RemoteUser {
+    char* name;
+    char* origin;
+    struct ClientInf* via;
+    struct RemoteUser* next;
+    struct RemoteUser* prev;
+    struct RemoteUser* hashNext;
+};
+
+//A server given with -P, which this one keeps a link open to and redials
+//whenever the link drops. fd is the link's socket while it is up, and closed
+//is posted when it goes down. peerId is the id the peer last gave, and idle
+//is set while the dialer waits for another link to that peer to drop
+struct PeerDialer {
+    pthread_t threadId;
+    char* address;
+    int fd;
+    sem_t closed;
+    char peerId[NODE_ID_SIZE];
+    bool idle;
+    struct ServerInf* server;
+};
+
+//This server's part in a federation of servers sharing one chat room. links
+//lists the peer links, chained through next and prev as they are never in
+//the roster. remotes lists the chatters on other servers in name order,
+//with remoteIndex finding them by name. windows remember which messages
+//from each server have already been seen. Guarded by clientsLock
+struct Federation {
+    char nodeId[NODE_ID_SIZE];
+    unsigned long sequence;
+    struct ClientInf* links;
+    int numLinks;
+    struct PeerDialer* dialers;
+    int numDialers;
+    struct RemoteUser* remotes;
+    struct RemoteUser** remoteIndex;
+    int indexSize;
+    int numRemotes;
+    struct OriginWindow* windows;
+    long long framesIn;
+    long long framesOut;
+    long long dropped;
+};
+
+//Bytes in each pooled block of output, header included. Blocks are small
+//because a broadcast takes one for every client in the roster at once
+#define OUT_BLOCK_SIZE 256
+
+//Names at most this long (with the terminator) are kept inside the client
+#define SHORT_NAME 32
+
+//A file sent with SEND:, kept in an unlinked file until every recipient has
+//been sent it. refs counts the output blocks sending it, plus the upload
+//while it is still arriving
+struct Spool {
+    int fd;
+    int size;
+    int refs;
+    char* sender;
+    char* filename;
+};
+
+//A file arriving on a client's socket. Its bytes go through pipe into the
+//spool without being copied into the server. spool is NULL when the file was
+//refused, and the bytes are then read and thrown away
+struct Upload {
+    struct Spool* spool;
+    char* recipient;
+    long left;
+    int pipe[2];
+};
+
+//Output waiting to be written to a client's socket, chained in the order it
+//goes out. Only the bytes from start to end are still to be sent. A block with
+//a spool is a file being sent a chunk at a time: data holds the current
+//chunk's FILE: header, followed on the wire by the spool's bytes from offset
+//up to chunkEnd
+struct OutBlock {
+    struct OutBlock* next;
+    struct Spool* spool;
+    int start;
+    int end;
+    int offset;
+    int chunkEnd;
+    char data[OUT_BLOCK_SIZE - sizeof(struct OutBlock*) - 
+            sizeof(struct Spool*) - 4 * sizeof(int)];
+};
+
+//Info needed to communicate with client. An idle client holds nothing beyond
+//this record, taking blocks from the server's slabs only while bytes pend
+struct ClientInf {
+    int fd;
+    //Numbers the connection in a capture, from its first line captured
+    unsigned int connId;
+    enum ConnState state;
+    char* name;
+    struct LineBuf* input;
+    //Control frames (replies, KICK: and roster notices) go ahead of chat,
+    //with ctrlTail the last block of them at the front of the chain
+    struct OutBlock* outHead;
+    struct OutBlock* outTail;
+    struct OutBlock* ctrlTail;
+    int outPending;
+    bool dirty;
+    //Set while EPOLLOUT is being watched
+    bool writeWait;
+    bool broken;
+    //Set while on the worker's disconnect list, chained through hashNext as
+    //the client has left the name index
+    bool kicked;
+    //Set while the socket has been sent only part of a line, which must be
+    //finished before control output can go
+    bool midLine;
+    //Set while lines wait for a turn in the worker's round
+    bool scheduled;
+    struct ClientInf* dirtyNext;
+    struct ClientInf* next;
+    struct ClientInf* prev;
+    struct ClientInf* hashNext;
+    struct ClientInf* roundNext;
+    //Share of each round, bytes that may still be served in this one and
+    //when the client joined it
+    int weight;
+    int deficit;
+    long long readySince;
+    //Service had so far and the longest wait for it
+    long long serviceUs;
+    long long maxWait;
+    long long linesServed;
+    struct Worker* worker;
+    struct ShmRing* ring;
+    struct Upload* upload;
+    struct ClientFilter* filter;
+    //Armed for the handshake deadline, then for the next heartbeat check
+    struct Timer timer;
+    //Ticks anything last arrived, and a line other than PONG: last did
+    long long lastHeard;
+    long long lastActive;
+    int clientStats[NUM_CLI_STATS];
+    char shortName[SHORT_NAME];
+};
+
+//A connection that has been accepted but not yet taken up by a worker.
+//client is set for a connection restored from another server's snapshot
+struct PendingConn {
+    int fd;
+    struct ClientInf* client;
+    long long acceptTime;
+};
+
+//A place in the accept queue. sequence is the position of the producer that
+//may fill it next, or that position plus one once it is full
+struct ConnSlot {
+    unsigned long sequence;
+    struct PendingConn conn;
+};
+
+//Bounded lock-free queue of accepted connections, filled by the acceptors
+//and emptied by the workers, each claiming a position with a compare and
+//swap. freeSlots counts the space left so that acceptors can sleep while it
+//is full, and acceptErrors the times accepting failed for want of
+//descriptors or memory. Every other field is read and updated atomically
+struct ConnQueue {
+    struct ConnSlot* slots;
+    unsigned long mask;
+    unsigned long enqueuePos __attribute__((aligned(64)));
+    unsigned long dequeuePos __attribute__((aligned(64)));
+    int count __attribute__((aligned(64)));
+    int activeConns;
+    int rejected;
+    int acceptErrors;
+    long long adopted;
+    long long totalWait;
+    long long maxWait;
+    sem_t freeSlots;
+};
+
+//A thread serving many connections from its own epoll set. wheel holds a
+//timer for every connection it has taken up, arena holds whatever is built
+//while processing one line. events is the batch epoll_wait last returned,
+//with nextEvent the first not yet handled.
+//disconnects lists the connections kicked by other workers, for this one to
+//tear down when next woken. capture collects the lines it has received while
+//the server is capturing. roundHead to roundTail are the connections with
+//lines waiting to be served, taken in deficit round robin order. rounds
+//counts the rounds served and deferred the turns that ended with lines left.
+//pings counts the heartbeats sent, and the reaped counts the connections
+//closed for running out of handshake time, for being idle and for not
+//answering a heartbeat
+struct Worker {
+    pthread_t threadId;
+    int epollfd;
+    int wakefd;
+    int numConns;
+    struct epoll_event* events;
+    int numEvents;
+    int nextEvent;
+    struct Arena arena;
+    char** batch;
+    struct TimerWheel wheel;
+    struct ClientInf* disconnects;
+    struct ClientInf* roundHead;
+    struct ClientInf* roundTail;
+    long long rounds;
+    long long deferred;
+    long long pings;
+    long long handshakeReaped;
+    long long idleReaped;
+    long long deadReaped;
+    struct CaptureBuf* capture;
+    struct ServerInf* server;
+};
+
+//A thread taking new connections off the TCP and Unix listening sockets.
+//resting marks a listening socket left out of epoll for a while after
+//accepting from it ran out of descriptors or memory
+struct Acceptor {
+    pthread_t threadId;
+    int epollfd;
+    int listeners[2];
+    bool resting[2];
+    struct ServerInf* server;
+};
+
+//Fixed set of workers, the acceptors feeding them and the queue in between.
+//While draining is set each worker and acceptor posts parked and waits on
+//resume. acceptWake is written to get the acceptors' attention
+struct WorkerPool {
+    struct Worker* workers;
+    int numWorkers;
+    int nextWorker;
+    struct Acceptor* acceptors;
+    int numAcceptors;
+    int acceptWake;
+    struct ConnQueue queue;
+    bool draining;
+    sem_t parked;
+    sem_t resume;
+};
+
+//Threads that share out the flushing of one large batch of output, a chunk
+//of clients at a time. Only the holder of clientsLock starts a job, so there
+//is never more than one at once
+struct FanoutPool {
+    pthread_t* threads;
+    int numThreads;
+    struct ClientInf** clients;
+    int numClients;
+    int capacity;
+    int nextChunk;
+    long long jobs;
+    sem_t start;
+    sem_t done;
+};
+
+//State shared by every thread in the server. Everything up to batchedLines is
+//guarded by clientsLock, dirty lists the clients with unflushed output.
+//nameHints indexes the next number to try for each base name clients have
+//asked the server to build a name on
+struct ServerInf {
+    struct ClientInf* head;
+    struct ClientInf** nameIndex;
+    int indexSize;
+    int numClients;
+    struct NameHint** nameHints;
+    int numHints;
+    sem_t clientsLock;
+    int serverStats[NUM_SVR_STATS];
+    struct ClientInf* dirty;
+    long long batches;
+    long long batchedLines;
+    struct FilterSet filters;
+    struct TransferStats transfers;
+    struct Federation federation;
+    struct Capture* capture;
+    struct FanoutPool fanout;
+    char* auth;
+    struct ServerConfig* config;
+    struct WorkerPool pool;
+    struct Slab clientSlab;
+    struct Slab inputSlab;
+    struct Slab outputSlab;
+};
+
+//server.c
+struct ClientInf* new_client(struct ServerInf* server, int fd);
+void set_name(struct ClientInf* client, char* name, size_t length);
+int client_weight(struct ServerConfig* config, const char* name);
+struct LineBuf* take_input(struct ServerInf* server, struct ClientInf* client);
+void release_input(struct ServerInf* server, struct ClientInf* client);
+void append_output(struct ServerInf* server, struct ClientInf* client,
+        const char* data, size_t length);
+void append_control(struct ServerInf* server, struct ClientInf* client,
+        const char* data, size_t length);
+void flush_output(struct ServerInf* server, struct ClientInf* client);
+void queue_message(struct ServerInf* server, struct ClientInf* client, 
+        char* message);
+void queue_control(struct ServerInf* server, struct ClientInf* client,
+        char* message);
+void mark_dirty(struct ServerInf* server, struct ClientInf* client);
+void flush_messages(struct ServerInf* server);
+struct ClientInf* find_client(struct ServerInf* server, char* name);
+bool are_ordered(char* word1, char* word2);
+void delete_client(struct ClientInf** head, struct ClientInf* client);
+void broadcast_message(struct ServerInf* server, char* message);
+void broadcast_said(struct ServerInf* server, struct ClientInf* sender,
+        char* name, char* text, char* message);
+void lock_clients(struct ServerInf* server);
+void unlock_clients(struct ServerInf* server);
+void index_client(struct ServerInf* server, struct ClientInf* client);
+unsigned int hash_name(char* name);
+void free_client(struct ServerInf* server, struct ClientInf* client);
+void start_handshake(struct ServerInf* server, struct ClientInf* client);
+bool process_line(struct ServerInf* server, struct ClientInf* client,
+        char* line);
+bool process_batch(struct ServerInf* server, struct ClientInf* client,
+        char** lines, int numLines);
+void remove_client(struct ServerInf* server, struct ClientInf* client);
+
+//workerpool.c
+void init_pool(struct ServerInf* server);
+bool reserve_slot(struct WorkerPool* pool);
+void submit_connections(struct ServerInf* server, int* fds, int numFds);
+void submit_client(struct ServerInf* server, struct ClientInf* client);
+void flush_fanout(struct ServerInf* server);
+void watch_output(struct ClientInf* client, bool watch);
+void disconnect_client(struct ServerInf* server, struct ClientInf* client);
+void park_workers(struct WorkerPool* pool);
+void resume_workers(struct WorkerPool* pool);
+void print_pool_stats(struct WorkerPool* pool);
+void print_schedule_stats(struct ServerInf* server);
+void print_timer_stats(struct WorkerPool* pool);
+struct ClientInf* timer_client(struct Timer* timer);
+
+//acceptor.c
+void init_acceptors(struct ServerInf* server, struct Listeners* listeners);
+
+//filter.c
+extern const char* filterNames[NUM_FILTER_KINDS];
+void mark_subscribers(struct ServerInf* server, char* sender, char* text);
+bool wants_message(struct ServerInf* server, struct ClientInf* client);
+bool add_filter(struct ServerInf* server, struct ClientInf* client,
+        char* kindName, char* text);
+void clear_filters(struct ServerInf* server, struct ClientInf* client);
+
+//transfer.c
+void release_spool(struct Spool* spool);
+struct Spool* new_spool(int fd, char* sender, char* filename, int size);
+void resume_file(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool, int offset);
+void queue_file(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool);
+void resume_chunk(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool, int offset, int chunkEnd, const char* header,
+        int start, int end);
+int send_chunk(struct ServerInf* server, struct ClientInf* client);
+void end_upload(struct ClientInf* client);
+void resume_upload(struct ClientInf* client, char* recipient, long left,
+        struct Spool* spool);
+bool start_upload(struct ServerInf* server, struct ClientInf* client,
+        char* recipient, char* filename, char* sizeText);
+bool receive_buffered(struct ServerInf* server, struct ClientInf* client);
+bool receive_upload(struct ServerInf* server, struct ClientInf* client);
+void print_transfer_stats(struct ServerInf* server);
+
+//federation.c
+void init_federation(struct ServerInf* server);
+struct RemoteUser* find_remote(struct Federation* federation, char* origin,
+        char* name);
+bool join_federation(struct ServerInf* server, struct ClientInf* link,
+        char* nodeId);
+void drop_link(struct ServerInf* server, struct ClientInf* link);
+bool process_frame(struct ServerInf* server, struct ClientInf* link,
+        char* line);
+void relay_join(struct ServerInf* server, char* name);
+void relay_part(struct ServerInf* server, char* name);
+void relay_said(struct ServerInf* server, char* name, char* text);
+void print_federation_stats(struct ServerInf* server);
+
+//capture.c
+void capture_line(struct Worker* worker, struct ClientInf* client,
+        const char* line);
+void capture_close(struct Worker* worker, struct ClientInf* client);
+void flush_capture(struct Worker* worker, bool force);
+void init_capture(struct ServerInf* server, int fd);
+void finish_capture(struct ServerInf* server);
+unsigned int last_capture_conn(struct ServerInf* server);
+void resume_capture(struct ServerInf* server, unsigned int lastConn);
+void print_capture_stats(struct ServerInf* server);
+
+//handoff.c
+struct Snapshot;
+void hand_off(struct ServerInf* server, struct Listeners* listeners);
+struct Snapshot* take_over(const char* path, struct Listeners* listeners);
+void restore_snapshot(struct ServerInf* server, struct Snapshot* snapshot);
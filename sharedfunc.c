@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <semaphore.h>
+#include <time.h>
 
 //Commands given from server
 #define WHO "WHO"
@@ -31,12 +32,18 @@
 */
 char* read_input(FILE* stream, bool eofExpected) {
         
-    char* message = malloc(sizeof(char*));
+    //Grown by doubling rather than once per character
+    int capacity = 16;
+    char* message = malloc(capacity);
     char read; 
     int index = 0;
+    message[0] = '\0';
     
     while ((read = fgetc(stream)) != '\n' && read != EOF && !feof(stream)) {  
-        message = realloc(message, index + 2); 
+        if (index + 2 > capacity) {
+            capacity *= 2;
+            message = realloc(message, capacity); 
+        }
         message[index] = read;
         message[index + 1] = '\0';
         index += 1;
@@ -96,6 +103,36 @@ int unpack_query(char** terms, char* text) {
     return numParams;
 }
 
+/*
+* Non-allocating counterpart to unpack_query. Splits a ':' seperated line in
+* place, so the terms point into text and are only valid as long as it is.
+* Delimiters are treated exactly as unpack_query treats them.
+*
+* Parameters:
+*     terms: array of at least maxTerms strings to put the result in
+*     maxTerms: the most terms that will be stored in terms
+*     text: the string to split at the delimiter, which is modified
+*
+* Returns:
+*     the amount of terms found in text, which may be more than maxTerms
+*/
+int split_query(char** terms, int maxTerms, char* text) {
+
+    char* save = text;
+    int numParams = 0;
+    char* token = strtok_r(text, SERVER_DELIM, &save);
+
+    while (token != NULL) {
+        if (numParams < maxTerms) {
+            terms[numParams] = token;
+        }
+        token = strtok_r(NULL, SERVER_DELIM, &save);
+        numParams += 1;
+    }
+
+    return numParams;
+}
+
 /*
  * Given a file descriptor pointing to a chatfile, this function will attempt
  * to read it line by line and return the contents in a char**. Appeared in
@@ -227,3 +264,117 @@ void release_lock(sem_t* lock) {
     sem_post(lock);
 }
 
+
+/*
+* Prepare an empty line buffer for use with fill_linebuf and next_line.
+*
+* Parameters:
+*     buf: the line buffer to initialise
+*/
+void init_linebuf(struct LineBuf* buf) {
+    buf->start = 0;
+    buf->end = 0;
+    buf->discarding = false;
+}
+
+/*
+* Make room at the end of a line buffer for more data. Lines already handed
+* out by next_line are compacted away so that a partial line always has room
+* to grow. Data written to buf->data + buf->end is then added by advancing
+* buf->end.
+*
+* Parameters:
+*     buf: the line buffer to make room in
+*
+* Returns:
+*     the number of bytes that may be written.
+*/
+int linebuf_space(struct LineBuf* buf) {
+
+    if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+
+    //Leave room for the terminator next_line may need to add
+    return LINEBUF_SIZE - buf->end - 1;
+}
+
+/*
+* Perform a single read from fd into the free space of a line buffer.
+*
+* Parameters:
+*     buf: the line buffer to read into
+*     fd: the file descriptor to read from
+*
+* Returns:
+*     the number of bytes read, 0 on end of file or -1 on error.
+*/
+int fill_linebuf(struct LineBuf* buf, int fd) {
+
+    int space = linebuf_space(buf);
+    int numRead = read(fd, buf->data + buf->end, space);
+
+    if (numRead > 0) {
+        buf->end += numRead;
+    }
+
+    return numRead;
+}
+
+/*
+* Take the next complete line out of a line buffer. The newline is replaced
+* with a null terminator and the returned string stays valid until the next
+* call to fill_linebuf. A line too long to fit in the buffer is handed out in
+* pieces of at most LINEBUF_SIZE - 1 bytes, with the remainder dropped.
+*
+* Parameters:
+*     buf: the line buffer to take a line from
+*
+* Returns:
+*     the next line, or NULL if no complete line has been received yet.
+*/
+char* next_line(struct LineBuf* buf) {
+    
+    while (true) {
+        char* begin = buf->data + buf->start;
+        char* newline = memchr(begin, '\n', buf->end - buf->start);
+        
+        if (newline == NULL) {
+            if (buf->discarding) {
+                buf->start = buf->end;
+            } else if (buf->start == 0 && buf->end == LINEBUF_SIZE - 1) {
+                //Overlong line, hand out what fits and drop the rest
+                buf->data[buf->end] = '\0';
+                buf->start = buf->end;
+                buf->discarding = true;
+                return begin;
+            }
+            return NULL;
+        }
+
+        *newline = '\0';
+        buf->start = newline - buf->data + 1;
+
+        if (buf->discarding) {
+            //Tail of an overlong line that has already been handed out
+            buf->discarding = false;
+            continue;
+        }
+        return begin;
+    }
+}
+
+/*
+* Read the monotonic clock, for timing that must not jump when the wall clock
+* is changed.
+*
+* Returns:
+*     the current monotonic time in microseconds.
+*/
+long long get_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -2,7 +2,19 @@
 #include <stdbool.h>
 #include <semaphore.h>
 
+//Size of the buffer used to collect lines read straight from a socket
+#define LINEBUF_SIZE 4096
+
+//Bytes read from a socket that have not yet been handed out as lines
+struct LineBuf {
+    char data[LINEBUF_SIZE];
+    int start;
+    int end;
+    bool discarding;
+};
+
 int unpack_query(char** terms, char* text);
+int split_query(char** terms, int maxTerms, char* text);
 char** unpack_chatfile(int fd, int* cmdCount);
 void free_terms(char** terms, int numTerms);
 char* read_input(FILE* stream, bool eofExpected);
@@ -12,4 +24,9 @@ char* read_socket(FILE* socket);
 char* construct_message(char** terms, int numTerms);
 void init_lock(sem_t* lock);
 void take_lock(sem_t* lock);
-void release_lock(sem_t* lock);
\ No newline at end of file
+void release_lock(sem_t* lock);
+void init_linebuf(struct LineBuf* buf);
+int linebuf_space(struct LineBuf* buf);
+int fill_linebuf(struct LineBuf* buf, int fd);
+char* next_line(struct LineBuf* buf);
+long long get_time_us();
\ No newline at end of file
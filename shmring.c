@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "shmring.h"
+
+//Nanoseconds a producer sleeps while waiting for room in a full ring
+#define FULL_WAIT 50000
+
+/*
+* Map a ring's shared memory in from its memfd.
+*
+* Parameters:
+*     ring: the ring whose memfd is set
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int map_ring(struct ShmRing* ring) {
+
+    ring->shared = mmap(NULL, sizeof(struct RingShared),
+            PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (ring->shared == MAP_FAILED) {
+        ring->shared = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Create a new, empty ring for this process to produce into. Its memfd and
+* eventfd are then passed to the consumer with send_with_fds.
+*
+* Parameters:
+*     ring: the ring to create
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int create_ring(struct ShmRing* ring) {
+
+    ring->shared = NULL;
+    ring->memfd = memfd_create("chatring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    ring->eventfd = eventfd(0, EFD_CLOEXEC);
+
+    //Sealed at its size, so the consumer can trust its mapping
+    if (ring->memfd < 0 || ring->eventfd < 0 ||
+            ftruncate(ring->memfd, sizeof(struct RingShared)) < 0 ||
+            fcntl(ring->memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+            map_ring(ring) < 0) {
+        detach_ring(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Take up a ring created by another process, from the file descriptors it
+* passed over. The memfd must be sealed against shrinking, or the producer
+* could truncate it under the mapping and fault the consumer when it reads.
+*
+* Parameters:
+*     ring: the ring to attach
+*     memfd: the ring's shared memory
+*     eventfd: the ring's wakeup counter
+*
+* Returns:
+*     0 on success, -1 on failure.
+*/
+int attach_ring(struct ShmRing* ring, int memfd, int eventfd) {
+
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+
+    ring->shared = NULL;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+            lseek(memfd, 0, SEEK_END) < (off_t) sizeof(struct RingShared) ||
+            map_ring(ring) < 0) {
+        detach_ring(ring);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Unmap a ring and close its file descriptors.
+*
+* Parameters:
+*     ring: the ring to detach
+*/
+void detach_ring(struct ShmRing* ring) {
+
+    if (ring->shared != NULL) {
+        munmap(ring->shared, sizeof(struct RingShared));
+        ring->shared = NULL;
+    }
+    if (ring->memfd >= 0) {
+        close(ring->memfd);
+        ring->memfd = -1;
+    }
+    if (ring->eventfd >= 0) {
+        close(ring->eventfd);
+        ring->eventfd = -1;
+    }
+}
+
+/*
+* Work out how many bytes can be written into the ring without waiting.
+*
+* Parameters:
+*     ring: the ring to produce into
+*
+* Returns:
+*     the bytes of free space in the ring.
+*/
+size_t ring_space(struct ShmRing* ring) {
+
+    struct RingShared* shared = ring->shared;
+    uint32_t tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+
+    return RING_SIZE - (shared->head - tail);
+}
+
+/*
+* Copy data into the ring and wake the consumer. Waits for the consumer to
+* make room if the ring is full.
+*
+* Parameters:
+*     ring: the ring to produce into
+*     data: the bytes to write
+*     length: the number of bytes to write
+*/
+void ring_write(struct ShmRing* ring, const char* data, size_t length) {
+
+    struct RingShared* shared = ring->shared;
+    uint32_t head = shared->head;
+    uint64_t one = 1;
+
+    while (length > 0) {
+        uint32_t tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+        size_t room = RING_SIZE - (head - tail);
+
+        if (room == 0) {
+            struct timespec wait = {0, FULL_WAIT};
+            nanosleep(&wait, NULL);
+            continue;
+        }
+
+        size_t offset = head & (RING_SIZE - 1);
+        size_t chunk = length < room ? length : room;
+        if (chunk > RING_SIZE - offset) {
+            chunk = RING_SIZE - offset;
+        }
+
+        memcpy(shared->data + offset, data, chunk);
+        head += chunk;
+        data += chunk;
+        length -= chunk;
+        __atomic_store_n(&shared->head, head, __ATOMIC_RELEASE);
+
+        if (write(ring->eventfd, &one, sizeof(uint64_t)) < 0) {
+            perror("ring_write");
+        }
+    }
+}
+
+/*
+* Copy whatever the producer has published out of the ring.
+*
+* Parameters:
+*     ring: the ring to consume from
+*     dest: where to copy the bytes
+*     space: the most bytes to copy
+*
+* Returns:
+*     the number of bytes copied, or -1 if the ring has been corrupted.
+*/
+int ring_read(struct ShmRing* ring, char* dest, int space) {
+
+    struct RingShared* shared = ring->shared;
+    uint32_t tail = shared->tail;
+    uint32_t head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    int copied = 0;
+
+    //A producer that claims more than the ring holds is not trusted
+    if (head - tail > RING_SIZE) {
+        return -1;
+    }
+
+    while (tail != head && copied < space) {
+        size_t offset = tail & (RING_SIZE - 1);
+        size_t chunk = head - tail;
+        if (chunk > RING_SIZE - offset) {
+            chunk = RING_SIZE - offset;
+        }
+        if (chunk > (size_t) (space - copied)) {
+            chunk = space - copied;
+        }
+
+        memcpy(dest + copied, shared->data + offset, chunk);
+        copied += chunk;
+        tail += chunk;
+    }
+
+    __atomic_store_n(&shared->tail, tail, __ATOMIC_RELEASE);
+    return copied;
+}
+
+/*
+* Send a message over a Unix socket with file descriptors attached.
+*
+* Parameters:
+*     sock: the Unix socket to send on
+*     message: the text to send, which carries the descriptors
+*     fds: the file descriptors to pass
+*     numFds: the number of descriptors, at most MAX_PASSED_FDS
+*
+* Returns:
+*     the number of bytes sent, or -1 on failure.
+*/
+int send_with_fds(int sock, const char* message, int* fds, int numFds) {
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct iovec iov = {.iov_base = (void*) message,
+            .iov_len = strlen(message)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+
+    return sendmsg(sock, &msg, 0);
+}
+
+/*
+* Read from a socket as read() would, also collecting any file descriptors
+* passed along with the data. Descriptors beyond MAX_PASSED_FDS are closed.
+*
+* Parameters:
+*     sock: the socket to read from
+*     dest: where to put the bytes read
+*     space: the most bytes to read
+*     fds: array of MAX_PASSED_FDS filled with the descriptors received
+*     numFds: set to the number of descriptors received
+*
+* Returns:
+*     the number of bytes read, 0 on end of file or -1 on error.
+*/
+int recv_with_fds(int sock, char* dest, int space, int* fds, int* numFds) {
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct iovec iov = {.iov_base = dest, .iov_len = space};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *numFds = 0;
+    int numRead = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); numRead >= 0 &&
+            cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* passed = (int*) CMSG_DATA(cmsg);
+        for (int index = 0; index < count; index++) {
+            if (*numFds < MAX_PASSED_FDS) {
+                fds[(*numFds)++] = passed[index];
+            } else {
+                close(passed[index]);
+            }
+        }
+    }
+
+    return numRead;
+}
@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include <stddef.h>
+
+//Bytes of protocol text the shared ring holds, a power of two
+#define RING_SIZE 65536
+
+//Line a client sends over its Unix socket, with the ring's memfd and eventfd
+//attached, to move its outgoing commands onto the ring
+#define RING_OFFER "SHM:\n"
+
+//Most file descriptors passed in one message
+#define MAX_PASSED_FDS 2
+
+//Layout of the shared memory. head is only advanced by the producer and tail
+//only by the consumer, each on its own cache line. Both count bytes ever
+//written or read and wrap naturally
+struct RingShared {
+    uint32_t head;
+    char headPad[60];
+    uint32_t tail;
+    char tailPad[60];
+    char data[RING_SIZE];
+};
+
+//One end of a single producer, single consumer byte ring. eventfd is
+//written by the producer each time it publishes
+struct ShmRing {
+    struct RingShared* shared;
+    int memfd;
+    int eventfd;
+};
+
+int create_ring(struct ShmRing* ring);
+int attach_ring(struct ShmRing* ring, int memfd, int eventfd);
+void detach_ring(struct ShmRing* ring);
+size_t ring_space(struct ShmRing* ring);
+void ring_write(struct ShmRing* ring, const char* data, size_t length);
+int ring_read(struct ShmRing* ring, char* dest, int space);
+int send_with_fds(int sock, const char* message, int* fds, int numFds);
+int recv_with_fds(int sock, char* dest, int space, int* fds, int* numFds);
@@ -0,0 +1,206 @@
+#include <string.h>
+#include <stdbool.h>
+#include "timerwheel.h"
+
+//Ticks the whole wheel reaches ahead of now
+#define WHEEL_SPAN (1LL << (WHEEL_BITS * WHEEL_LEVELS))
+
+/*
+* Start a wheel with no timers in it.
+*
+* Parameters:
+*     wheel: the wheel to initialise
+*     now: the current tick
+*/
+void init_wheel(struct TimerWheel* wheel, long long now) {
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->now = now;
+}
+
+/*
+* Link a timer in at the head of a slot.
+*
+* Parameters:
+*     slot: the slot to link the timer into
+*     timer: the timer to link
+*/
+void link_timer(struct Timer** slot, struct Timer* timer) {
+
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+/*
+* Link a timer into the slot for its expiry: the lowest level whose turn
+* reaches that far, in the slot that comes round at that tick. A timer that
+* is already due goes out on the next tick, and one further ahead than the
+* wheel reaches waits in the last level to be placed again.
+*
+* Parameters:
+*     wheel: the wheel the timer is armed in
+*     timer: the timer to place, with its expiry set
+*/
+void place_timer(struct TimerWheel* wheel, struct Timer* timer) {
+
+    long long due = timer->expires > wheel->now ? timer->expires :
+            wheel->now + 1;
+    long long delta = due - wheel->now;
+    int level = 0;
+
+    if (delta >= WHEEL_SPAN) {
+        due = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    while (delta >= 1LL << (WHEEL_BITS * (level + 1))) {
+        level += 1;
+    }
+
+    link_timer(&wheel->slots[level][(due >> (WHEEL_BITS * level)) &
+            WHEEL_MASK], timer);
+}
+
+/*
+* Take an armed timer out of its slot.
+*
+* Parameters:
+*     timer: the timer to take out
+*/
+void unlink_timer(struct Timer* timer) {
+
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+}
+
+/*
+* Arm a timer to expire at the given tick, moving it if it was already armed.
+*
+* Parameters:
+*     wheel: the wheel to arm the timer in
+*     timer: the timer to arm
+*     expires: the tick the timer is due at
+*/
+void arm_timer(struct TimerWheel* wheel, struct Timer* timer,
+        long long expires) {
+
+    if (timer->pprev != NULL) {
+        unlink_timer(timer);
+    } else {
+        wheel->armed += 1;
+    }
+    timer->expires = expires;
+    place_timer(wheel, timer);
+}
+
+/*
+* Take a timer out of the wheel without it expiring. Does nothing if it is
+* not armed.
+*
+* Parameters:
+*     wheel: the wheel the timer is armed in
+*     timer: the timer to disarm
+*/
+void disarm_timer(struct TimerWheel* wheel, struct Timer* timer) {
+
+    if (timer->pprev != NULL) {
+        unlink_timer(timer);
+        wheel->armed -= 1;
+    }
+}
+
+/*
+* Report whether a timer is in a wheel waiting to expire.
+*
+* Parameters:
+*     timer: the timer to check
+*
+* Returns:
+*     whether the timer is armed.
+*/
+bool timer_armed(struct Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+/*
+* Move every timer in a level's slot for the current tick down to the levels
+* below, now that its span has come round. Those due on this very tick join
+* the first level's slot that is about to be expired.
+*
+* Parameters:
+*     wheel: the wheel to cascade
+*     level: the level whose slot to empty
+*/
+void cascade(struct TimerWheel* wheel, int level) {
+
+    struct Timer** slot = &wheel->slots[level][(wheel->now >>
+            (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct Timer* timer = *slot;
+    *slot = NULL;
+
+    while (timer != NULL) {
+        struct Timer* next = timer->next;
+        if (timer->expires <= wheel->now) {
+            link_timer(&wheel->slots[0][wheel->now & WHEEL_MASK], timer);
+        } else {
+            place_timer(wheel, timer);
+        }
+        timer = next;
+    }
+}
+
+/*
+* Advance the wheel tick by tick up to now, collecting every timer that comes
+* due on the way. Each tick empties one slot of the first level, after
+* cascading the next slot of each higher level whose turn has come round,
+* highest first.
+*
+* Parameters:
+*     wheel: the wheel to advance
+*     now: the current tick
+*
+* Returns:
+*     the expired timers, chained through next and no longer armed. As
+*     rearming a timer overwrites next, it must be read first.
+*/
+struct Timer* advance_wheel(struct TimerWheel* wheel, long long now) {
+
+    struct Timer* expired = NULL;
+
+    while (wheel->now < now) {
+        wheel->now += 1;
+
+        int level = 1;
+        while (level < WHEEL_LEVELS && (wheel->now &
+                ((1LL << (WHEEL_BITS * level)) - 1)) == 0) {
+            level += 1;
+        }
+        while (--level > 0) {
+            cascade(wheel, level);
+        }
+
+        struct Timer** slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        struct Timer* timer = *slot;
+        *slot = NULL;
+
+        while (timer != NULL) {
+            struct Timer* next = timer->next;
+            if (timer->expires > wheel->now) {
+                //Was further ahead than the wheel reaches
+                place_timer(wheel, timer);
+            } else {
+                timer->pprev = NULL;
+                timer->next = expired;
+                expired = timer;
+                wheel->armed -= 1;
+            }
+            timer = next;
+        }
+    }
+    return expired;
+}
@@ -0,0 +1,37 @@
+#include <stdbool.h>
+
+//Slots in each level of a timer wheel, as a power of two
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+//Levels in a timer wheel. Each slot of a level spans a whole turn of the
+//level below, so four levels reach 2^24 ticks ahead. Later timers wait in the
+//last level and are placed again when they come round
+#define WHEEL_LEVELS 4
+
+//A timer kept in a wheel, embedded in whatever it times. pprev points at
+//the link that points at it, and is NULL while the timer is not armed.
+//expires is the tick it is due at
+struct Timer {
+    struct Timer* next;
+    struct Timer** pprev;
+    long long expires;
+};
+
+//Hierarchical timer wheel, used by a single thread. now is the last tick
+//whose timers have been expired, armed the number of timers in the wheel.
+//Arming, disarming and each tick take constant time however many timers
+//there are, apart from timers moved down a level once per level they pass
+struct TimerWheel {
+    long long now;
+    int armed;
+    struct Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void init_wheel(struct TimerWheel* wheel, long long now);
+void arm_timer(struct TimerWheel* wheel, struct Timer* timer,
+        long long expires);
+void disarm_timer(struct TimerWheel* wheel, struct Timer* timer);
+bool timer_armed(struct Timer* timer);
+struct Timer* advance_wheel(struct TimerWheel* wheel, long long now);
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "sharedfunc.h"
+
+//Names of the traced points as they appear in the trace, in enum TraceKind
+//order
+const char* traceNames[NUM_TRACE_KINDS] = {"accept", "auth", "name", "line",
+        "lock wait", "lock held", "broadcast", "flush"};
+
+#ifdef TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//Chrome trace phases, in enum TracePhase order
+const char* tracePhases[] = {"i", "B", "E"};
+
+//The calling thread's ring, created on its first event
+__thread struct TraceRing* traceRing;
+
+//Every thread's ring, and the lock guarding the list (not the rings)
+struct TraceRing* traceRings;
+sem_t traceLock;
+
+//Clock readings taken with the first event, to turn ticks into microseconds
+uint64_t traceStartTicks;
+long long traceStartUs;
+
+/*
+* Read the cheapest clock available that only ever goes forward: the time
+* stamp counter on x86, the monotonic clock in nanoseconds elsewhere.
+*
+* Returns:
+*     the current time in ticks.
+*/
+uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*
+* Create the calling thread's ring and add it to the list of rings.
+*
+* Returns:
+*     the calling thread's new ring.
+*/
+struct TraceRing* trace_register() {
+
+    struct TraceRing* ring = calloc(1, sizeof(struct TraceRing));
+    ring->tid = syscall(SYS_gettid);
+    snprintf(ring->name, sizeof(ring->name), "thread %d", ring->tid);
+
+    //The first thread to trace sets up the lock, before any others exist
+    if (traceStartUs == 0) {
+        init_lock(&traceLock);
+        traceStartTicks = read_ticks();
+        traceStartUs = get_time_us();
+    }
+
+    take_lock(&traceLock);
+    ring->next = traceRings;
+    traceRings = ring;
+    release_lock(&traceLock);
+
+    traceRing = ring;
+    return ring;
+}
+
+/*
+* Record an event in the calling thread's ring. Takes no locks and makes no
+* system calls once the thread has its ring.
+*
+* Parameters:
+*     kind: the point reached
+*     phase: whether a span starts or ends here, or neither
+*     arg: a detail of the event, such as a socket
+*/
+void trace_event(enum TraceKind kind, enum TracePhase phase, uint32_t arg) {
+
+    struct TraceRing* ring = traceRing;
+    if (ring == NULL) {
+        ring = trace_register();
+    }
+
+    uint64_t head = ring->head;
+    struct TraceEvent* event = &ring->events[head & (TRACE_SIZE - 1)];
+    event->ticks = read_ticks();
+    event->arg = arg;
+    event->kind = kind;
+    event->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Name the calling thread in the trace. Called once when a thread starts. The
+* main thread must name itself before starting any others, as the first
+* thread to trace sets tracing up.
+*
+* Parameters:
+*     name: the name to show for the thread
+*/
+void trace_thread(const char* name) {
+
+    struct TraceRing* ring = traceRing;
+    if (ring == NULL) {
+        ring = trace_register();
+    }
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+/*
+* Write out the events still held in one thread's ring. Events the thread
+* may have overwritten while they were being copied are left out.
+*
+* Parameters:
+*     out: the trace file
+*     ring: the ring to write
+*     ticksPerUs: the rate of read_ticks
+*     first: whether this is the first ring written to the file
+*/
+void dump_ring(FILE* out, struct TraceRing* ring, double ticksPerUs,
+        bool first) {
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+    struct TraceEvent* copy = malloc(sizeof(struct TraceEvent) *
+            (head - start + 1));
+    for (uint64_t index = start; index < head; index++) {
+        copy[index - start] = ring->events[index & (TRACE_SIZE - 1)];
+    }
+
+    //The slot being written now may hold the oldest event copied
+    uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t valid = after >= TRACE_SIZE ? after - TRACE_SIZE + 1 : 0;
+    int pid = getpid();
+
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid,
+            ring->tid, ring->name);
+
+    for (uint64_t index = start > valid ? start : valid; index < head;
+            index++) {
+        struct TraceEvent* event = &copy[index - start];
+        double ts = (double) (int64_t) (event->ticks - traceStartTicks) /
+                ticksPerUs;
+
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,%s\"args\":{\"arg\":%u}}",
+                traceNames[event->kind], tracePhases[event->phase], ts, pid,
+                ring->tid, event->phase == TRACE_INSTANT ? "\"s\":\"t\"," : "",
+                event->arg);
+    }
+
+    free(copy);
+}
+
+/*
+* Write every thread's recent events to trace-<pid>.json in the current
+* directory, in Chrome's trace event format, without stopping any thread.
+*/
+void trace_dump() {
+
+    char path[64];
+    snprintf(path, sizeof(path), "trace-%d.json", getpid());
+    FILE* out = fopen(path, "w");
+
+    if (out == NULL || traceStartUs == 0) {
+        fprintf(stderr, "Nothing traced\n");
+        if (out != NULL) {
+            fclose(out);
+        }
+        return;
+    }
+
+    //Measured over the whole run, so the rate is as exact as it gets
+    long long elapsedUs = get_time_us() - traceStartUs;
+    double ticksPerUs = elapsedUs > 0 ?
+            (double) (read_ticks() - traceStartTicks) / elapsedUs : 1000.0;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    take_lock(&traceLock);
+    for (struct TraceRing* ring = traceRings; ring != NULL; ring = ring->next) {
+        dump_ring(out, ring, ticksPerUs, ring == traceRings);
+    }
+    release_lock(&traceLock);
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    fprintf(stderr, "Trace written to %s\n", path);
+}
+
+#endif
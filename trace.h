@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+//Points on the server's hot paths that can be traced, in traceNames order
+enum TraceKind {
+    TRACE_ACCEPT,
+    TRACE_AUTH,
+    TRACE_NAME,
+    TRACE_LINE,
+    TRACE_LOCK_WAIT,
+    TRACE_LOCK,
+    TRACE_BROADCAST,
+    TRACE_FLUSH,
+    NUM_TRACE_KINDS
+};
+
+//Whether an event marks a moment, or the start or end of a span
+enum TracePhase {
+    TRACE_INSTANT,
+    TRACE_BEGIN,
+    TRACE_END
+};
+
+extern const char* traceNames[NUM_TRACE_KINDS];
+
+#ifdef TRACE
+
+//Events each thread keeps, a power of two. Older events are overwritten
+#define TRACE_SIZE 65536
+
+//One recorded event. ticks are from read_ticks, arg depends on the kind
+struct TraceEvent {
+    uint64_t ticks;
+    uint32_t arg;
+    uint8_t kind;
+    uint8_t phase;
+};
+
+//A thread's events. Only the owning thread writes, head counts every event
+//it has ever recorded and is published after the event itself
+struct TraceRing {
+    struct TraceEvent events[TRACE_SIZE];
+    uint64_t head;
+    int tid;
+    char name[16];
+    struct TraceRing* next;
+};
+
+void trace_event(enum TraceKind kind, enum TracePhase phase, uint32_t arg);
+void trace_thread(const char* name);
+void trace_dump();
+
+#define TRACE_EVENT(kind, phase, arg) trace_event(kind, phase, arg)
+#define TRACE_THREAD(name) trace_thread(name)
+
+#else
+
+#define TRACE_EVENT(kind, phase, arg) ((void) 0)
+#define TRACE_THREAD(name) ((void) 0)
+
+#endif
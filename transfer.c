@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "server.h"
+
+//Messages to send to client
+#define FILE_FRAME "FILE"
+#define REFUSED "REFUSED"
+#define UNKNOWN_NAME "UNKNOWN_NAME"
+
+//Recipient of a SEND: that goes to everyone else in the chat
+#define EVERYONE "*"
+
+//Largest file a client may send
+#define MAX_FILE_SIZE (256 * 1024 * 1024)
+
+//Most bytes of a file moved in one step, both while it arrives and while it
+//is sent on. Each step is one splice or sendfile, so text on the same
+//connection never waits behind more than this
+#define FILE_CHUNK 65536
+
+//Directory the unlinked spool files are created in
+#define SPOOL_DIR "/tmp"
+
+/*
+* Drop one reference to a spool, closing and freeing it with the last.
+*
+* Parameters:
+*     spool: the spool no longer needed
+*/
+void release_spool(struct Spool* spool) {
+
+    if (__atomic_sub_fetch(&spool->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    close(spool->fd);
+    free(spool->sender);
+    free(spool->filename);
+    free(spool);
+}
+
+/*
+* Wrap a spool file in a spool.
+*
+* Parameters:
+*     fd: the spool file
+*     sender: the name of the client sending the file
+*     filename: the name the file is sent under
+*     size: the size of the file in bytes
+*
+* Returns:
+*     the new spool, holding one reference for the caller.
+*/
+struct Spool* new_spool(int fd, char* sender, char* filename, int size) {
+
+    struct Spool* spool = malloc(sizeof(struct Spool));
+    spool->fd = fd;
+    spool->size = size;
+    spool->refs = 1;
+    spool->sender = strdup(sender);
+    spool->filename = strdup(filename);
+    return spool;
+}
+
+/*
+* Create an empty spool for a file a client is about to send.
+*
+* Parameters:
+*     sender: the name of the client sending the file
+*     filename: the name the file is sent under
+*     size: the size of the file in bytes
+*
+* Returns:
+*     the new spool, holding one reference for the upload, or NULL if no
+*     spool file could be created.
+*/
+struct Spool* create_spool(char* sender, char* filename, int size) {
+
+    int fd = open(SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    return new_spool(fd, sender, filename, size);
+}
+
+/*
+* Write the FILE: header of the next chunk of a file into its output block.
+* The header is counted as pending output like any other text.
+*
+* Parameters:
+*     client: the client the file is being sent to
+*     block: the block sending the file, with offset at the chunk's start
+*/
+void start_chunk(struct ClientInf* client, struct OutBlock* block) {
+
+    struct Spool* spool = block->spool;
+    int length = spool->size - block->offset;
+    if (length > FILE_CHUNK) {
+        length = FILE_CHUNK;
+    }
+
+    block->start = 0;
+    block->end = snprintf(block->data, sizeof(block->data),
+            "%s:%s:%s:%d:%d:%d\n", FILE_FRAME, spool->sender, spool->filename,
+            spool->size, block->offset, length);
+    block->chunkEnd = block->offset + length;
+    client->outPending += block->end;
+}
+
+/*
+* Queue a finished file to be sent to a client from the given offset on,
+* after whatever output it already has waiting. Must be called with the
+* roster lock held.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the file to
+*     spool: the file to send
+*     offset: where in the file to start, at the start of a chunk
+*/
+void resume_file(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool, int offset) {
+
+    if (client->broken) {
+        return;
+    }
+
+    struct OutBlock* block = slab_alloc(&server->outputSlab);
+    block->next = NULL;
+    block->spool = spool;
+    block->offset = offset;
+    __atomic_add_fetch(&spool->refs, 1, __ATOMIC_RELAXED);
+    start_chunk(client, block);
+
+    if (client->outTail == NULL) {
+        client->outHead = block;
+    } else {
+        client->outTail->next = block;
+    }
+    client->outTail = block;
+    mark_dirty(server, client);
+}
+
+/*
+* Queue a finished file to be sent to a client, after whatever output it
+* already has waiting. Must be called with the roster lock held.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client to send the file to
+*     spool: the file to send
+*/
+void queue_file(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool) {
+    resume_file(server, client, spool, 0);
+}
+
+/*
+* Put a file chunk that another server had started sending back at the head
+* of a client's output, which must be empty, so that the rest of its header
+* and then its bytes go out before anything else.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client being sent the file
+*     spool: the file being sent
+*     offset: how far into the file the chunk has been sent
+*     chunkEnd: where in the file the chunk ends
+*     header: the chunk's FILE: header
+*     start: how much of the header has been sent
+*     end: the length of the header
+*/
+void resume_chunk(struct ServerInf* server, struct ClientInf* client,
+        struct Spool* spool, int offset, int chunkEnd, const char* header,
+        int start, int end) {
+
+    struct OutBlock* block = slab_alloc(&server->outputSlab);
+    block->next = NULL;
+    block->spool = spool;
+    block->offset = offset;
+    block->chunkEnd = chunkEnd;
+    block->start = start;
+    block->end = end;
+    memcpy(block->data, header, end);
+    __atomic_add_fetch(&spool->refs, 1, __ATOMIC_RELAXED);
+
+    client->outHead = block;
+    client->outTail = block;
+    client->outPending += end - start;
+}
+
+/*
+* Send the file bytes of the chunk at the head of a client's output, once its
+* header has gone. When the chunk is done the block moves on to the next one,
+* behind any output queued meanwhile, or is freed after the last.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client being sent the file
+*
+* Returns:
+*     1 if the chunk was finished, 0 if the socket filled up first and -1 if
+*     the socket failed.
+*/
+int send_chunk(struct ServerInf* server, struct ClientInf* client) {
+
+    struct OutBlock* block = client->outHead;
+    struct Spool* spool = block->spool;
+
+    if (block->offset < block->chunkEnd) {
+        off_t offset = block->offset;
+        ssize_t sent = sendfile(client->fd, spool->fd, &offset,
+                block->chunkEnd - block->offset);
+
+        if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 0;
+        } else if (sent <= 0) {
+            return -1;
+        }
+
+        block->offset += sent;
+        __atomic_add_fetch(&server->transfers.bytesOut, sent,
+                __ATOMIC_RELAXED);
+        if (block->offset < block->chunkEnd) {
+            return 0;
+        }
+    }
+
+    if (block->offset == spool->size) {
+        client->outHead = block->next;
+        if (client->outHead == NULL) {
+            client->outTail = NULL;
+        }
+        release_spool(spool);
+        slab_free(&server->outputSlab, block);
+        return 1;
+    }
+
+    start_chunk(client, block);
+    if (block->next != NULL) {
+        client->outHead = block->next;
+        client->outTail->next = block;
+        client->outTail = block;
+        block->next = NULL;
+    }
+    return 1;
+}
+
+/*
+* Forget a client's upload, whether finished or not, and free what it holds.
+*
+* Parameters:
+*     client: the client whose upload is over
+*/
+void end_upload(struct ClientInf* client) {
+
+    struct Upload* upload = client->upload;
+
+    if (upload->spool != NULL) {
+        close(upload->pipe[0]);
+        close(upload->pipe[1]);
+        release_spool(upload->spool);
+    }
+    free(upload->recipient);
+    free(upload);
+    client->upload = NULL;
+}
+
+/*
+* Carry on taking in a file that a client had started sending to another
+* server. If no pipe can be made the rest is read and thrown away.
+*
+* Parameters:
+*     client: the client sending the file
+*     recipient: the name of the client to send it to, or * for everyone
+*     left: the bytes of the file still to arrive
+*     spool: the file so far, with its own reference, or NULL if it was
+*     refused
+*/
+void resume_upload(struct ClientInf* client, char* recipient, long left,
+        struct Spool* spool) {
+
+    struct Upload* upload = calloc(1, sizeof(struct Upload));
+    upload->recipient = strdup(recipient);
+    upload->left = left;
+    upload->spool = spool;
+    if (spool != NULL && pipe2(upload->pipe, O_CLOEXEC) < 0) {
+        release_spool(spool);
+        upload->spool = NULL;
+    }
+    client->upload = upload;
+}
+
+/*
+* Begin taking in a file a client has announced with SEND:name:filename:size.
+* The bytes that follow are the file. Files that cannot be delivered are still
+* read, so the connection stays in step, and the sender is told why. Must be
+* called with the roster lock held.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the client sending the file
+*     recipient: the name of the client to send it to, or * for everyone
+*     filename: the name to send it under
+*     sizeText: the size of the file in bytes
+*
+* Returns:
+*     whether the size was unreadable, leaving no way to tell where the file
+*     ends, so the connection must be closed.
+*/
+bool start_upload(struct ServerInf* server, struct ClientInf* client,
+        char* recipient, char* filename, char* sizeText) {
+
+    char* end;
+    long size = strtol(sizeText, &end, 10);
+
+    if (end == sizeText || *end != '\0' || size < 0) {
+        return true;
+    }
+
+    struct Upload* upload = calloc(1, sizeof(struct Upload));
+    upload->recipient = strdup(recipient);
+    upload->left = size;
+    client->upload = upload;
+
+    //Everything in a FILE: header must fit in one output block
+    bool fits = strlen(client->name) + strlen(filename) + 48 <=
+            sizeof(((struct OutBlock*) NULL)->data);
+
+    if (strcmp(recipient, EVERYONE) && find_client(server, recipient) == NULL) {
+        char* msgTerms[] = {UNKNOWN_NAME, recipient};
+        queue_control(server, client,
+                arena_message(&client->worker->arena, msgTerms, 2));
+    } else if (size > MAX_FILE_SIZE || !fits || strchr(filename, '/') ||
+            !strcmp(filename, ".") || !strcmp(filename, "..") ||
+            (upload->spool = create_spool(client->name, filename, size)) ==
+            NULL) {
+        char* msgTerms[] = {REFUSED, filename};
+        queue_control(server, client,
+                arena_message(&client->worker->arena, msgTerms, 2));
+    } else if (pipe2(upload->pipe, O_CLOEXEC) < 0) {
+        release_spool(upload->spool);
+        upload->spool = NULL;
+    }
+
+    if (upload->spool == NULL) {
+        __atomic_add_fetch(&server->transfers.refused, 1, __ATOMIC_RELAXED);
+    }
+    return false;
+}
+
+/*
+* Hand a fully received file to its recipients and end the upload.
+*
+* Parameters:
+*     server: the server the file was sent to
+*     client: the client that sent the file
+*/
+void finish_upload(struct ServerInf* server, struct ClientInf* client) {
+
+    struct Upload* upload = client->upload;
+
+    if (upload->spool != NULL) {
+        lock_clients(server);
+        if (!strcmp(upload->recipient, EVERYONE)) {
+            for (struct ClientInf* current = server->head; current != NULL;
+                    current = current->next) {
+                if (current != client) {
+                    queue_file(server, current, upload->spool);
+                }
+            }
+        } else {
+            //Gone since the file was announced, then nobody gets it
+            struct ClientInf* recipient = find_client(server,
+                    upload->recipient);
+            if (recipient != NULL) {
+                queue_file(server, recipient, upload->spool);
+            }
+        }
+        flush_messages(server);
+        unlock_clients(server);
+        __atomic_add_fetch(&server->transfers.sent, 1, __ATOMIC_RELAXED);
+    }
+
+    end_upload(client);
+}
+
+/*
+* Take the start of a file out of the bytes already read along with its
+* SEND: line. These are the only bytes of a file that pass through the
+* server's memory.
+*
+* Parameters:
+*     server: the server the file is sent to
+*     client: the client sending the file, whose input holds the bytes
+*
+* Returns:
+*     whether the spool could not be written, and the connection should be
+*     closed.
+*/
+bool receive_buffered(struct ServerInf* server, struct ClientInf* client) {
+
+    struct Upload* upload = client->upload;
+    struct LineBuf* input = client->input;
+    int length = input->end - input->start;
+
+    if (length > upload->left) {
+        length = upload->left;
+    }
+
+    if (upload->spool != NULL && length > 0 &&
+            write(upload->spool->fd, input->data + input->start, length) !=
+            length) {
+        return true;
+    }
+
+    input->start += length;
+    upload->left -= length;
+    __atomic_add_fetch(&server->transfers.bytesIn, length, __ATOMIC_RELAXED);
+
+    if (upload->left == 0) {
+        finish_upload(server, client);
+    }
+    return false;
+}
+
+/*
+* Move up to a chunk of an arriving file from a client's socket into its
+* spool, through the upload's pipe so the bytes stay in the kernel. Called
+* whenever the socket is readable while an upload is under way.
+*
+* Parameters:
+*     server: the server the file is sent to
+*     client: the client sending the file
+*
+* Returns:
+*     whether the connection has ended or failed and should be closed.
+*/
+bool receive_upload(struct ServerInf* server, struct ClientInf* client) {
+
+    struct Upload* upload = client->upload;
+    int length = upload->left < FILE_CHUNK ? upload->left : FILE_CHUNK;
+    ssize_t moved;
+
+    if (upload->spool == NULL) {
+        //Refused, so the bytes are only read to be thrown away
+        char discard[4096];
+        moved = recv(client->fd, discard, length < (int) sizeof(discard) ?
+                length : (int) sizeof(discard), 0);
+    } else {
+        moved = splice(client->fd, NULL, upload->pipe[1], NULL, length,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    }
+
+    if (moved < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return false;
+    } else if (moved <= 0) {
+        return true;
+    }
+
+    for (ssize_t drained = 0; upload->spool != NULL && drained < moved;) {
+        ssize_t written = splice(upload->pipe[0], NULL, upload->spool->fd,
+                NULL, moved - drained, SPLICE_F_MOVE);
+        if (written <= 0) {
+            return true;
+        }
+        drained += written;
+    }
+
+    upload->left -= moved;
+    __atomic_add_fetch(&server->transfers.bytesIn, moved, __ATOMIC_RELAXED);
+
+    if (upload->left == 0) {
+        finish_upload(server, client);
+    }
+    return false;
+}
+
+/*
+* Print how many files have been sent through the server and how many bytes
+* they came to.
+*
+* Parameters:
+*     server: the server to report on
+*/
+void print_transfer_stats(struct ServerInf* server) {
+
+    struct TransferStats* stats = &server->transfers;
+
+    fprintf(stderr, "@FILES@\n");
+    fprintf(stderr, "files:SENT:%lld:REFUSED:%lld:BYTES_IN:%lld:"
+            "BYTES_OUT:%lld\n",
+            __atomic_load_n(&stats->sent, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->refused, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->bytesIn, __ATOMIC_RELAXED),
+            __atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,1358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "server.h"
+
+//Maximum number of events taken from epoll per wakeup
+#define MAX_EVENTS 64
+
+//Milliseconds in each tick of a worker's timer wheel, which is also the
+//longest a worker sleeps before advancing it
+#define TIMER_TICK 250
+
+//Bytes in each worker's per-line arena
+#define ARENA_SIZE 65536
+
+//Clients flushed by a fanout thread each time it takes more work
+#define FANOUT_CHUNK 64
+
+//Start of the line that announces a file, which the file's bytes follow
+#define FILE_COMMAND "SEND:"
+
+//Heartbeat sent to a connection that has gone quiet, and its answer, which
+//shows the connection is alive but does not count as activity
+#define PING_LINE "PING:\n"
+#define PONG_COMMAND "PONG:"
+
+//Bytes of lines a connection may have served in each round, for every unit
+//of its weight
+#define ROUND_QUANTUM 2048
+
+//What each line costs on top of its length, as the lock and the fanout it
+//causes cost the same however short it is
+#define LINE_COST 32
+
+//Set in the epoll data of a client's shared ring eventfd, to tell it apart
+//from the client's socket. Clients come from a slab so the bit is free
+#define RING_EVENT 1
+
+//Milliseconds an acceptor waits on a full accept queue before checking
+//whether the pool is being parked
+#define SLOT_WAIT 50
+
+/*
+* Initialise the queue that accepted connections wait in until a worker takes
+* them up.
+*
+* Parameters:
+*     queue: the queue to initialise
+*     capacity: the number of connections that may wait at once, rounded up
+*     to a power of two
+*/
+void init_queue(struct ConnQueue* queue, int capacity) {
+
+    unsigned long size = 1;
+    while (size < (unsigned long) capacity) {
+        size *= 2;
+    }
+
+    memset(queue, 0, sizeof(struct ConnQueue));
+    queue->slots = malloc(sizeof(struct ConnSlot) * size);
+    queue->mask = size - 1;
+    for (unsigned long index = 0; index < size; index++) {
+        queue->slots[index].sequence = index;
+    }
+    sem_init(&queue->freeSlots, 0, size);
+}
+
+/*
+* Add a connection to the queue. The caller must already have taken a free
+* slot from freeSlots, so there is always room.
+*
+* Parameters:
+*     queue: the queue to add to
+*     pending: the connection to add
+*/
+void push_connection(struct ConnQueue* queue, struct PendingConn* pending) {
+
+    unsigned long pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+    struct ConnSlot* slot;
+
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence,
+                __ATOMIC_ACQUIRE);
+
+        //A slot behind pos is still being emptied, claimed or not yet
+        if (sequence == pos && __atomic_compare_exchange_n(&queue->enqueuePos,
+                &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        } else if (sequence != pos) {
+            pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->conn = *pending;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&queue->count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+* Take the oldest connection off the queue, if there is one.
+*
+* Parameters:
+*     queue: the queue to take from
+*     pending: filled in with the connection taken
+*
+* Returns:
+*     whether a connection was taken.
+*/
+bool shift_connection(struct ConnQueue* queue, struct PendingConn* pending) {
+
+    unsigned long pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+    struct ConnSlot* slot;
+
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence,
+                __ATOMIC_ACQUIRE);
+
+        if (sequence == pos + 1 && __atomic_compare_exchange_n(
+                &queue->dequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED)) {
+            break;
+        } else if (sequence == pos) {
+            //Not filled yet, the queue is empty from here on
+            return false;
+        } else if (sequence != pos + 1) {
+            pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *pending = slot->conn;
+    __atomic_store_n(&slot->sequence, pos + queue->mask + 1,
+            __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&queue->count, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+* Take the oldest connection off the queue if there is still room for another
+* active connection, recording how long it waited. Room is claimed before the
+* queue is looked at, so the limit holds however many workers race for it.
+*
+* Parameters:
+*     queue: the queue to take the connection from
+*     maxClients: the most connections that may be active at once
+*     pending: filled in with the connection taken off the queue
+*
+* Returns:
+*     whether a connection was taken off the queue.
+*/
+bool pop_connection(struct ConnQueue* queue, int maxClients,
+        struct PendingConn* pending) {
+
+    int active = __atomic_load_n(&queue->activeConns, __ATOMIC_RELAXED);
+    do {
+        if (active >= maxClients) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&queue->activeConns, &active,
+            active + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (!shift_connection(queue, pending)) {
+        __atomic_fetch_sub(&queue->activeConns, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    release_lock(&queue->freeSlots);
+
+    long long wait = get_time_us() - pending->acceptTime;
+    __atomic_fetch_add(&queue->adopted, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&queue->totalWait, wait, __ATOMIC_RELAXED);
+    long long maxWait = __atomic_load_n(&queue->maxWait, __ATOMIC_RELAXED);
+    while (wait > maxWait && !__atomic_compare_exchange_n(&queue->maxWait,
+            &maxWait, wait, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return true;
+}
+
+/*
+* Wake a worker blocked in epoll_wait so that it looks at the queue.
+*
+* Parameters:
+*     worker: the worker to wake
+*/
+void wake_worker(struct Worker* worker) {
+    uint64_t one = 1;
+    if (write(worker->wakefd, &one, sizeof(uint64_t)) < 0) {
+        perror("wake_worker");
+    }
+}
+
+/*
+* Add a client's shared ring eventfd to the worker's epoll set.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection with the ring
+*/
+void watch_ring(struct Worker* worker, struct ClientInf* client) {
+    struct epoll_event event = {.events = EPOLLIN,
+            .data.u64 = (uint64_t) (uintptr_t) client | RING_EVENT};
+    epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, client->ring->eventfd, &event);
+}
+
+/*
+* Start or stop watching for a client's socket becoming writable, while it
+* has output its socket had no room for. A client not yet taken up by a
+* worker is watched once it is.
+*
+* Parameters:
+*     client: the client whose socket to watch
+*     watch: whether to watch for EPOLLOUT
+*/
+void watch_output(struct ClientInf* client, bool watch) {
+
+    if (client->worker == NULL) {
+        return;
+    }
+
+    struct epoll_event event = {.events = watch ? EPOLLIN | EPOLLOUT :
+            EPOLLIN, .data.ptr = client};
+    epoll_ctl(client->worker->epollfd, EPOLL_CTL_MOD, client->fd, &event);
+    client->writeWait = watch;
+}
+
+/*
+* Hand a client kicked from the roster to the worker that owns it, to be torn
+* down there as soon as the worker is woken. Must be called with the roster
+* lock held, after the client has been taken out of the roster.
+*
+* Parameters:
+*     server: the server the client is connected to
+*     client: the kicked client
+*/
+void disconnect_client(struct ServerInf* server, struct ClientInf* client) {
+
+    struct Worker* worker = client->worker;
+    client->kicked = true;
+
+    //Not taken up yet, the worker that adopts it closes it instead
+    if (worker == NULL) {
+        return;
+    }
+
+    client->hashNext = __atomic_load_n(&worker->disconnects, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&worker->disconnects,
+            &client->hashNext, client, true, __ATOMIC_RELEASE,
+            __ATOMIC_RELAXED)) {
+    }
+    wake_worker(worker);
+}
+
+/*
+* Put a connection on the back of its worker's round.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection with lines waiting
+*/
+void join_round(struct Worker* worker, struct ClientInf* client) {
+
+    client->scheduled = true;
+    client->roundNext = NULL;
+    if (worker->roundTail == NULL) {
+        worker->roundHead = client;
+    } else {
+        worker->roundTail->roundNext = client;
+    }
+    worker->roundTail = client;
+}
+
+/*
+* Take a connection that is being torn down out of its worker's round.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection to take out
+*/
+void leave_round(struct Worker* worker, struct ClientInf* client) {
+
+    struct ClientInf* prev = NULL;
+    struct ClientInf** link = &worker->roundHead;
+
+    while (*link != client) {
+        prev = *link;
+        link = &prev->roundNext;
+    }
+    *link = client->roundNext;
+    if (worker->roundTail == client) {
+        worker->roundTail = prev;
+    }
+    client->scheduled = false;
+}
+
+/*
+* Note that a connection has new input to be served in its worker's rounds,
+* unless it is already waiting for its turn.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection that has been read from
+*/
+void schedule_client(struct Worker* worker, struct ClientInf* client) {
+
+    if (!client->scheduled) {
+        client->readySince = get_time_us();
+        join_round(worker, client);
+    }
+}
+
+/*
+* Work out the current tick of the workers' timer wheels.
+*
+* Returns:
+*     the number of TIMER_TICK periods since the epoch.
+*/
+long long current_tick() {
+    return get_time_us() / 1000 / TIMER_TICK;
+}
+
+/*
+* Convert a setting in milliseconds to whole ticks, rounding up.
+*
+* Parameters:
+*     ms: the milliseconds to convert
+*
+* Returns:
+*     the number of ticks.
+*/
+long long to_ticks(int ms) {
+    return (ms + TIMER_TICK - 1) / TIMER_TICK;
+}
+
+/*
+* Find the connection a timer from a worker's wheel belongs to.
+*
+* Parameters:
+*     timer: the timer embedded in the connection
+*
+* Returns:
+*     the connection.
+*/
+struct ClientInf* timer_client(struct Timer* timer) {
+    return (struct ClientInf*) ((char*) timer - 
+            offsetof(struct ClientInf, timer));
+}
+
+/*
+* Take up as many queued connections as the active connection limit allows,
+* adding each one to this worker's epoll set and starting its handshake.
+* Each gets a timer, for its handshake deadline or, if it is restored from a
+* snapshot already joined, for its first heartbeat check on the next tick.
+*
+* Parameters:
+*     worker: the worker taking up the connections
+*/
+void adopt_connections(struct Worker* worker) {
+
+    struct ServerInf* server = worker->server;
+    struct PendingConn pending;
+
+    while (pop_connection(&server->pool.queue, server->config->maxClients,
+            &pending)) {
+
+        bool restored = pending.client != NULL;
+        struct ClientInf* client = restored ? pending.client :
+                new_client(server, pending.fd);
+        worker->numConns += 1;
+
+        client->lastHeard = worker->wheel.now;
+        client->lastActive = worker->wheel.now;
+        if (client->state == CONN_AUTH || client->state == CONN_NAME) {
+            arm_timer(&worker->wheel, &client->timer, worker->wheel.now +
+                    to_ticks(server->config->handshakeTimeout));
+        } else {
+            arm_timer(&worker->wheel, &client->timer, worker->wheel.now + 1);
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+
+        if (!restored) {
+            client->worker = worker;
+            epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, client->fd, &event);
+            start_handshake(server, client);
+            continue;
+        }
+
+        //A restored client may already have been sent output by others, or
+        //been kicked before it had a worker to hand it to
+        lock_clients(server);
+        client->worker = worker;
+        epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, client->fd, &event);
+        if (client->outHead != NULL) {
+            watch_output(client, true);
+        }
+        if (client->kicked) {
+            disconnect_client(server, client);
+        }
+        unlock_clients(server);
+
+        if (client->ring != NULL) {
+            watch_ring(worker, client);
+        }
+
+        //Lines that arrived before the handoff are served as usual
+        if (client->input != NULL || client->ring != NULL) {
+            schedule_client(worker, client);
+        }
+    }
+}
+
+/*
+* Stop handling events for a connection, including any still waiting later in
+* the batch being handled.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection to forget
+*/
+void forget_connection(struct Worker* worker, struct ClientInf* client) {
+
+    for (int index = worker->nextEvent; index < worker->numEvents; index++) {
+        if ((worker->events[index].data.u64 & ~(uint64_t) RING_EVENT) ==
+                (uint64_t) (uintptr_t) client) {
+            worker->events[index].events = 0;
+        }
+    }
+
+    epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+    if (client->ring != NULL) {
+        epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, client->ring->eventfd, NULL);
+    }
+}
+
+/*
+* Tear down a connection owned by this worker. Clients still in the roster are
+* removed from it first so that everyone else is told they have left. The
+* freed slot is handed straight to the next queued connection, if any. A
+* kicked client is only forgotten here, as it is already on the disconnect
+* list and is torn down from there.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection to tear down
+*/
+void close_connection(struct Worker* worker, struct ClientInf* client) {
+
+    struct ServerInf* server = worker->server;
+    remove_client(server, client);
+
+    //Seen under the roster lock taken by remove_client, so it cannot change
+    //after this
+    if (client->kicked) {
+        forget_connection(worker, client);
+        return;
+    }
+
+    if (client->scheduled) {
+        leave_round(worker, client);
+    }
+
+    disarm_timer(&worker->wheel, &client->timer);
+
+    //A connection closed from the disconnect list may have events waiting
+    //later in this batch, as may the other descriptor of one with a ring
+    forget_connection(worker, client);
+    capture_close(worker, client);
+    free_client(server, client);
+    worker->numConns -= 1;
+
+    __atomic_fetch_sub(&server->pool.queue.activeConns, 1, __ATOMIC_RELAXED);
+
+    adopt_connections(worker);
+}
+
+/*
+* Tear down every connection other workers have kicked since this worker
+* last looked.
+*
+* Parameters:
+*     worker: the worker that owns the connections
+*/
+void close_disconnects(struct Worker* worker) {
+
+    struct ClientInf* client = __atomic_exchange_n(&worker->disconnects, NULL,
+            __ATOMIC_ACQUIRE);
+
+    while (client != NULL) {
+        struct ClientInf* next = client->hashNext;
+        client->hashNext = NULL;
+        client->kicked = false;
+        close_connection(worker, client);
+        client = next;
+    }
+}
+
+/*
+* Send a heartbeat to a connection that has gone quiet. Clients get it ahead
+* of any chat waiting for them, links to other servers in turn.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection to send the heartbeat to
+*/
+void send_ping(struct Worker* worker, struct ClientInf* client) {
+
+    struct ServerInf* server = worker->server;
+
+    lock_clients(server);
+    if (client->state == CONN_PEER) {
+        queue_message(server, client, PING_LINE);
+    } else {
+        queue_control(server, client, PING_LINE);
+    }
+    flush_messages(server);
+    unlock_clients(server);
+    worker->pings += 1;
+}
+
+/*
+* Act on a connection's timer running out. One still in its handshake has
+* run out of time. Otherwise it is closed if nothing has arrived from it for
+* twice the ping interval, or if it is a client that has sent no command for
+* the idle timeout. One that has been quiet for the ping interval is sent
+* PING:, which a live client answers with PONG:. The timer is then armed for
+* the next of these checks that could come due.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection whose timer ran out
+*/
+void check_connection(struct Worker* worker, struct ClientInf* client) {
+
+    struct ServerConfig* config = worker->server->config;
+    long long now = worker->wheel.now;
+    long long pingTicks = to_ticks(config->pingInterval);
+    long long idleTicks = to_ticks(config->idleTimeout);
+    long long next = LLONG_MAX;
+
+    if (client->state == CONN_AUTH || client->state == CONN_NAME) {
+        worker->handshakeReaped += 1;
+        close_connection(worker, client);
+        return;
+    } else if (client->state == CONN_GONE) {
+        //Kicked, and torn down from the disconnect list
+        return;
+    } else if (pingTicks > 0 && now - client->lastHeard >= 2 * pingTicks) {
+        worker->deadReaped += 1;
+        close_connection(worker, client);
+        return;
+    } else if (idleTicks > 0 && client->state == CONN_JOINED &&
+            now - client->lastActive >= idleTicks) {
+        worker->idleReaped += 1;
+        close_connection(worker, client);
+        return;
+    }
+
+    if (pingTicks > 0 && now - client->lastHeard >= pingTicks) {
+        send_ping(worker, client);
+        next = client->lastHeard + 2 * pingTicks;
+    } else if (pingTicks > 0) {
+        next = client->lastHeard + pingTicks;
+    }
+    if (idleTicks > 0 && client->state == CONN_JOINED &&
+            client->lastActive + idleTicks < next) {
+        next = client->lastActive + idleTicks;
+    }
+
+    if (next != LLONG_MAX) {
+        arm_timer(&worker->wheel, &client->timer, next);
+    }
+}
+
+/*
+* Advance this worker's timer wheel to the current tick, and check every
+* connection whose timer has run out on the way.
+*
+* Parameters:
+*     worker: the worker whose wheel to advance
+*/
+void expire_timers(struct Worker* worker) {
+
+    struct Timer* timer = advance_wheel(&worker->wheel, current_tick());
+
+    while (timer != NULL) {
+        struct Timer* next = timer->next;
+        check_connection(worker, timer_client(timer));
+        timer = next;
+    }
+}
+
+/*
+* Take up the shared ring a client on the Unix socket has passed over, and
+* start watching its eventfd. A client that passes anything else, or passes a
+* second ring, is dropped.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection the descriptors came from
+*     fds: the descriptors passed
+*     numFds: the number of descriptors passed
+*
+* Returns:
+*     whether the connection should be closed.
+*/
+bool attach_client_ring(struct Worker* worker, struct ClientInf* client,
+        int* fds, int numFds) {
+
+    struct ShmRing* ring = malloc(sizeof(struct ShmRing));
+
+    if (numFds != 2 || client->ring != NULL) {
+        for (int index = 0; index < numFds; index++) {
+            close(fds[index]);
+        }
+        free(ring);
+        return true;
+    } else if (attach_ring(ring, fds[0], fds[1]) < 0) {
+        //attach_ring has closed them already
+        free(ring);
+        return true;
+    }
+
+    client->ring = ring;
+    watch_ring(worker, client);
+    return false;
+}
+
+/*
+* Account for a line taken from a connection's input: trace and capture it,
+* charge it to the connection's deficit, and note the connection as active
+* unless it is only answering a heartbeat.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection the line came from
+*     line: the line taken
+*/
+void take_line(struct Worker* worker, struct ClientInf* client, char* line) {
+
+    TRACE_EVENT(TRACE_LINE, TRACE_INSTANT, client->fd);
+    capture_line(worker, client, line);
+    client->deficit -= strlen(line) + LINE_COST;
+    client->linesServed += 1;
+    if (strcmp(line, PONG_COMMAND)) {
+        client->lastActive = worker->wheel.now;
+    }
+}
+
+/*
+* Process the complete lines buffered for a connection while its deficit
+* lasts, each line costing its length plus LINE_COST. Handshake lines are
+* handled one at a time, chat commands and peer frames are handed over in
+* batches of up to the configured limit so that each batch costs one lock
+* acquisition and one write per recipient. A SEND: line ends its batch, as
+* the bytes after it are the file rather than more lines.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection whose lines are processed
+*
+* Returns:
+*     -1 if the connection was closed, 1 if its deficit ran out first and
+*     lines may still be waiting, and 0 otherwise.
+*/
+int process_lines(struct Worker* worker, struct ClientInf* client) {
+
+    int batchLimit = worker->server->config->batchLimit;
+    char* line;
+
+    while (client->deficit > 0 && client->upload == NULL && 
+            client->input != NULL &&
+            (line = next_line(client->input)) != NULL) {
+        take_line(worker, client, line);
+
+        if (client->state != CONN_JOINED && client->state != CONN_PEER) {
+            if (process_line(worker->server, client, line)) {
+                close_connection(worker, client);
+                return -1;
+            }
+            //Heartbeat checks take over from the handshake deadline
+            if (client->state == CONN_JOINED || client->state == CONN_PEER) {
+                arm_timer(&worker->wheel, &client->timer, 
+                        worker->wheel.now + 1);
+            }
+            continue;
+        }
+
+        //Lines stay valid until the next fill_linebuf
+        int numLines = 0;
+        worker->batch[numLines++] = line;
+        while (numLines < batchLimit && client->deficit > 0 &&
+                strncmp(line, FILE_COMMAND, strlen(FILE_COMMAND)) &&
+                (line = next_line(client->input)) != NULL) {
+            worker->batch[numLines++] = line;
+            take_line(worker, client, line);
+        }
+
+        if (process_batch(worker->server, client, worker->batch, numLines) ||
+                (client->upload != NULL && 
+                receive_buffered(worker->server, client))) {
+            close_connection(worker, client);
+            return -1;
+        }
+    }
+    return client->deficit <= 0 && client->upload == NULL;
+}
+
+/*
+* Read the next commands from a client's shared ring into its input buffer.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection with the ring
+*
+* Returns:
+*     the number of bytes read, or -1 if the ring was broken and the
+*     connection has been closed.
+*/
+int read_ring(struct Worker* worker, struct ClientInf* client) {
+
+    struct LineBuf* input = take_input(worker->server, client);
+    int numRead = ring_read(client->ring, input->data + input->end,
+            linebuf_space(input));
+
+    if (numRead < 0) {
+        close_connection(worker, client);
+        return -1;
+    } else if (numRead == 0) {
+        release_input(worker->server, client);
+        return 0;
+    }
+
+    input->end += numRead;
+    return numRead;
+}
+
+/*
+* Give every connection in the worker's round one turn, in the order they
+* became ready. Each has its deficit topped up by ROUND_QUANTUM for every unit
+* of its weight and has lines served until it is spent, so a flooder gets no
+* more than its share however much it sends. One with lines left over goes to
+* the back for the next round and is not read from meanwhile, so its backlog
+* stays in its own socket or ring. The rest leave the round with their
+* deficit cleared.
+*
+* Parameters:
+*     worker: the worker whose round to serve
+*/
+void serve_round(struct Worker* worker) {
+
+    struct ClientInf* last = worker->roundTail;
+    bool done = last == NULL;
+
+    if (!done) {
+        worker->rounds += 1;
+    }
+
+    while (!done) {
+        struct ClientInf* client = worker->roundHead;
+        worker->roundHead = client->roundNext;
+        if (worker->roundHead == NULL) {
+            worker->roundTail = NULL;
+        }
+        client->scheduled = false;
+        done = client == last;
+
+        long long start = get_time_us();
+        client->deficit += ROUND_QUANTUM * client->weight;
+        int result = process_lines(worker, client);
+
+        //A ring only signals new commands, so it is read again here
+        if (result == 0 && client->ring != NULL) {
+            int numRead = read_ring(worker, client);
+            result = numRead < 0 ? -1 : numRead > 0;
+        }
+        if (result < 0) {
+            continue;
+        }
+
+        long long now = get_time_us();
+        client->serviceUs += now - start;
+        if (result > 0) {
+            worker->deferred += 1;
+            join_round(worker, client);
+        } else {
+            client->deficit = 0;
+            if (now - client->readySince > client->maxWait) {
+                client->maxWait = now - client->readySince;
+            }
+            release_input(worker->server, client);
+        }
+    }
+}
+
+/*
+* Read whatever a connection has sent, and give it a place in the worker's
+* round to have its lines served. A connection still waiting for its turn is
+* not read from. A client on the Unix socket may pass its shared ring along
+* with the data. While a file is arriving its bytes are moved to the spool
+* instead.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection that has become readable
+*/
+void service_connection(struct Worker* worker, struct ClientInf* client) {
+
+    client->lastHeard = worker->wheel.now;
+
+    //The rest of a file goes straight to its spool, a chunk at a time
+    if (client->upload != NULL) {
+        client->lastActive = worker->wheel.now;
+        if (receive_upload(worker->server, client)) {
+            close_connection(worker, client);
+        } else if (client->upload == NULL &&
+                (client->input != NULL || client->ring != NULL)) {
+            //Commands put in the ring while the file arrived have been
+            //waiting for it
+            schedule_client(worker, client);
+        }
+        return;
+    } else if (client->scheduled) {
+        return;
+    }
+
+    struct LineBuf* input = take_input(worker->server, client);
+    int fds[MAX_PASSED_FDS];
+    int numFds;
+    int numRead = recv_with_fds(client->fd, input->data + input->end,
+            linebuf_space(input), fds, &numFds);
+
+    if (numRead < 0 && (errno == EINTR || errno == EAGAIN)) {
+        release_input(worker->server, client);
+        return;
+    } else if (numRead <= 0 || 
+            (numFds > 0 && attach_client_ring(worker, client, fds, numFds))) {
+        close_connection(worker, client);
+        return;
+    }
+
+    input->end += numRead;
+    schedule_client(worker, client);
+}
+
+/*
+* Write out whatever a slow client's socket has room for now.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection that has become writable
+*/
+void service_output(struct Worker* worker, struct ClientInf* client) {
+
+    struct ServerInf* server = worker->server;
+
+    lock_clients(server);
+    flush_output(server, client);
+    unlock_clients(server);
+}
+
+/*
+* Take in the commands a client has written to its shared ring, to be served
+* in the worker's round exactly as if they had arrived on the socket. A
+* client waiting for its turn has its ring read when the turn comes.
+*
+* Parameters:
+*     worker: the worker that owns the connection
+*     client: the connection whose ring has been written to
+*/
+void service_ring(struct Worker* worker, struct ClientInf* client) {
+
+    uint64_t count;
+
+    client->lastHeard = worker->wheel.now;
+    if (read(client->ring->eventfd, &count, sizeof(uint64_t)) < 0 ||
+            client->scheduled) {
+        return;
+    }
+
+    if (read_ring(worker, client) > 0) {
+        schedule_client(worker, client);
+    }
+}
+
+/*
+* Thread function for a worker. Waits on the worker's epoll set and services
+* whichever of its connections are ready, taking up queued connections when
+* woken by the acceptor.
+*
+* Parameters:
+*     arg: compulsary void* arg to thread function. Actually the worker this
+*     thread runs as.
+*
+* Returns:
+*     compulsary void* return value. Never returns.
+*/
+void* worker_thread(void* arg) {
+
+    struct Worker* worker = (struct Worker*) arg;
+    struct WorkerPool* pool = &worker->server->pool;
+    struct epoll_event events[MAX_EVENTS];
+
+    worker->events = events;
+    TRACE_THREAD("worker");
+
+    while (true) {
+        //Safe point to stop at, nothing is half processed
+        if (__atomic_load_n(&pool->draining, __ATOMIC_ACQUIRE)) {
+            release_lock(&pool->parked);
+            take_lock(&pool->resume);
+        }
+
+        //Connections with lines waiting are served between polls
+        worker->numEvents = epoll_wait(worker->epollfd, events, MAX_EVENTS,
+                worker->roundHead != NULL ? 0 : TIMER_TICK);
+
+        for (int index = 0; index < worker->numEvents; index++) {
+            uint64_t data = events[index].data.u64;
+            worker->nextEvent = index + 1;
+
+            if (events[index].events == 0) {
+                //Its client was closed earlier in this batch
+                continue;
+            } else if (data == 0) {
+                uint64_t count;
+                if (read(worker->wakefd, &count, sizeof(uint64_t)) > 0) {
+                    close_disconnects(worker);
+                    adopt_connections(worker);
+                }
+            } else if (data & RING_EVENT) {
+                service_ring(worker, 
+                        (struct ClientInf*) (uintptr_t) (data & ~RING_EVENT));
+            } else {
+                //Writing never closes the connection, reading may
+                if (events[index].events & EPOLLOUT) {
+                    service_output(worker, events[index].data.ptr);
+                }
+                if (events[index].events & ~EPOLLOUT) {
+                    service_connection(worker, events[index].data.ptr);
+                }
+            }
+        }
+        worker->numEvents = 0;
+
+        serve_round(worker);
+        expire_timers(worker);
+        if (worker->server->capture != NULL) {
+            flush_capture(worker, false);
+        }
+
+        //Connections left queued if this worker lost a race for room
+        if (__atomic_load_n(&pool->queue.count, __ATOMIC_RELAXED) > 0) {
+            adopt_connections(worker);
+        }
+    }
+
+    return (void*) 0;
+}
+
+/*
+* Flush chunks of the current fanout job until none are left. Called by the
+* fanout threads and by the thread that started the job alike.
+*
+* Parameters:
+*     server: the server whose fanout job is running
+*/
+void flush_chunks(struct ServerInf* server) {
+
+    struct FanoutPool* fanout = &server->fanout;
+
+    while (true) {
+        int first = __atomic_fetch_add(&fanout->nextChunk, 1,
+                __ATOMIC_RELAXED) * FANOUT_CHUNK;
+        if (first >= fanout->numClients) {
+            return;
+        }
+
+        int last = first + FANOUT_CHUNK;
+        if (last > fanout->numClients) {
+            last = fanout->numClients;
+        }
+        for (int index = first; index < last; index++) {
+            flush_output(server, fanout->clients[index]);
+        }
+    }
+}
+
+/*
+* Thread function for a fanout thread. Waits for a job and helps flush it.
+*
+* Parameters:
+*     arg: compulsary void* arg to thread function. Actually the server whose
+*     fanout pool the thread belongs to.
+*
+* Returns:
+*     compulsary void* return value. Never returns.
+*/
+void* fanout_thread(void* arg) {
+
+    struct ServerInf* server = (struct ServerInf*) arg;
+    struct FanoutPool* fanout = &server->fanout;
+
+    TRACE_THREAD("fanout");
+    while (true) {
+        take_lock(&fanout->start);
+        flush_chunks(server);
+        release_lock(&fanout->done);
+    }
+
+    return (void*) 0;
+}
+
+/*
+* Flush every client in fanout->clients, sharing the chunks out between the
+* calling thread and as many fanout threads as there is work for. Returns
+* only once every client has been flushed, so output from one batch can never
+* be overtaken by the next.
+*
+* Parameters:
+*     server: the server whose fanout pool has its clients filled in
+*/
+void flush_fanout(struct ServerInf* server) {
+
+    struct FanoutPool* fanout = &server->fanout;
+
+    int numChunks = (fanout->numClients + FANOUT_CHUNK - 1) / FANOUT_CHUNK;
+    int helpers = numChunks - 1 < fanout->numThreads ? numChunks - 1 :
+            fanout->numThreads;
+
+    fanout->nextChunk = 0;
+    fanout->jobs += 1;
+    for (int index = 0; index < helpers; index++) {
+        release_lock(&fanout->start);
+    }
+
+    flush_chunks(server);
+
+    for (int index = 0; index < helpers; index++) {
+        take_lock(&fanout->done);
+    }
+}
+
+/*
+* Create the accept queue and start every worker thread with the configured
+* (small) stack size.
+*
+* Parameters:
+*     server: the server the pool belongs to
+*/
+void init_pool(struct ServerInf* server) {
+
+    struct ServerConfig* config = server->config;
+    struct WorkerPool* pool = &server->pool;
+
+    init_queue(&pool->queue, config->queueSize);
+    pool->draining = false;
+    sem_init(&pool->parked, 0, 0);
+    sem_init(&pool->resume, 0, 0);
+    pool->numWorkers = config->numWorkers;
+    pool->nextWorker = 0;
+    pool->workers = calloc(config->numWorkers, sizeof(struct Worker));
+
+    size_t stackSize = (size_t) config->stackSize * 1024;
+    if (stackSize < PTHREAD_STACK_MIN) {
+        stackSize = PTHREAD_STACK_MIN;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stackSize);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (int index = 0; index < pool->numWorkers; index++) {
+        struct Worker* worker = &pool->workers[index];
+        worker->server = server;
+        init_arena(&worker->arena, ARENA_SIZE);
+        init_wheel(&worker->wheel, current_tick());
+        worker->batch = malloc(sizeof(char*) * config->batchLimit);
+        worker->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->wakefd, &event);
+
+        pthread_create(&worker->threadId, &attr, worker_thread, worker);
+    }
+
+    //The calling thread is one of the fanout threads
+    struct FanoutPool* fanout = &server->fanout;
+    fanout->numThreads = config->fanoutThreads - 1;
+    fanout->threads = calloc(fanout->numThreads + 1, sizeof(pthread_t));
+    sem_init(&fanout->start, 0, 0);
+    sem_init(&fanout->done, 0, 0);
+
+    for (int index = 0; index < fanout->numThreads; index++) {
+        pthread_create(&fanout->threads[index], &attr, fanout_thread, server);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/*
+* Add a connection to the accept queue, waiting for space if it is full.
+*
+* Parameters:
+*     pool: the pool to queue the connection for
+*     fd: the connection's socket
+*     client: the restored client, or NULL for a new connection
+*/
+void enqueue_connection(struct WorkerPool* pool, int fd,
+        struct ClientInf* client) {
+
+    struct PendingConn pending = {.fd = fd, .client = client,
+            .acceptTime = get_time_us()};
+
+    take_lock(&pool->queue.freeSlots);
+    push_connection(&pool->queue, &pending);
+}
+
+/*
+* Take a slot in the accept queue for a connection about to be accepted,
+* waiting while the queue is full. The wait is given up once the pool starts
+* draining, so an acceptor can still be parked when the workers are behind.
+*
+* Parameters:
+*     pool: the pool to queue the connection for
+*
+* Returns:
+*     true if a slot was taken, false if the pool is draining
+*/
+bool reserve_slot(struct WorkerPool* pool) {
+
+    while (!__atomic_load_n(&pool->draining, __ATOMIC_ACQUIRE)) {
+        if (sem_trywait(&pool->queue.freeSlots) == 0) {
+            return true;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SLOT_WAIT * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(&pool->queue.freeSlots, &deadline) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+* Wake the next few workers in turn to take up newly queued connections.
+*
+* Parameters:
+*     pool: the pool whose workers to wake
+*     count: the number of connections queued
+*/
+void wake_workers(struct WorkerPool* pool, int count) {
+
+    if (count > pool->numWorkers) {
+        count = pool->numWorkers;
+    }
+    for (int index = 0; index < count; index++) {
+        int next = __atomic_fetch_add(&pool->nextWorker, 1, __ATOMIC_RELAXED);
+        wake_worker(&pool->workers[(unsigned int) next % pool->numWorkers]);
+    }
+}
+
+/*
+* Hand a batch of freshly accepted connections to the pool, each of which
+* already holds a slot taken with reserve_slot. When the server is saturated
+* each one is either rejected outright or made to wait for a free slot,
+* depending on the configuration.
+*
+* Parameters:
+*     server: the server the connections were accepted on
+*     fds: the accepted connections
+*     numFds: the number of connections in fds
+*/
+void submit_connections(struct ServerInf* server, int* fds, int numFds) {
+
+    struct WorkerPool* pool = &server->pool;
+    struct ConnQueue* queue = &pool->queue;
+    int queued = 0;
+
+    for (int index = 0; index < numFds; index++) {
+        struct PendingConn pending = {.fd = fds[index], .client = NULL,
+                .acceptTime = get_time_us()};
+
+        if (server->config->rejectWhenFull &&
+                __atomic_load_n(&queue->activeConns, __ATOMIC_RELAXED) +
+                __atomic_load_n(&queue->count, __ATOMIC_RELAXED) >=
+                server->config->maxClients) {
+            __atomic_fetch_add(&queue->rejected, 1, __ATOMIC_RELAXED);
+            close(fds[index]);
+            release_lock(&queue->freeSlots);
+            continue;
+        }
+
+        push_connection(queue, &pending);
+        queued += 1;
+    }
+
+    wake_workers(pool, queued);
+}
+
+/*
+* Hand a client restored from another server's snapshot to the pool. It is
+* queued like a new connection but keeps its state when taken up.
+*
+* Parameters:
+*     server: the server the client was restored into
+*     client: the restored client
+*/
+void submit_client(struct ServerInf* server, struct ClientInf* client) {
+    enqueue_connection(&server->pool, client->fd, client);
+    wake_workers(&server->pool, 1);
+}
+
+/*
+* Stop every worker and acceptor at its next safe point, between batches of
+* events, and wait until they all have.
+*
+* Parameters:
+*     pool: the pool to park
+*/
+void park_workers(struct WorkerPool* pool) {
+
+    uint64_t one = 1;
+
+    __atomic_store_n(&pool->draining, true, __ATOMIC_RELEASE);
+    for (int index = 0; index < pool->numWorkers; index++) {
+        wake_worker(&pool->workers[index]);
+    }
+    if (pool->numAcceptors > 0 &&
+            write(pool->acceptWake, &one, sizeof(uint64_t)) < 0) {
+        perror("park_workers");
+    }
+    for (int index = 0; index < pool->numWorkers + pool->numAcceptors;
+            index++) {
+        take_lock(&pool->parked);
+    }
+}
+
+/*
+* Let workers parked by park_workers carry on.
+*
+* Parameters:
+*     pool: the pool to resume
+*/
+void resume_workers(struct WorkerPool* pool) {
+
+    uint64_t count;
+
+    //Cleared first so that acceptors do not wake again straight away
+    if (pool->numAcceptors > 0 &&
+            read(pool->acceptWake, &count, sizeof(uint64_t)) < 0) {
+        perror("resume_workers");
+    }
+    __atomic_store_n(&pool->draining, false, __ATOMIC_RELEASE);
+    for (int index = 0; index < pool->numWorkers + pool->numAcceptors;
+            index++) {
+        release_lock(&pool->resume);
+    }
+}
+
+/*
+* Print the pool's admission statistics alongside the chat statistics.
+*
+* Parameters:
+*     pool: the pool to report on
+*/
+void print_pool_stats(struct WorkerPool* pool) {
+
+    struct ConnQueue* queue = &pool->queue;
+
+    long long adopted = __atomic_load_n(&queue->adopted, __ATOMIC_RELAXED);
+    long long totalWait = __atomic_load_n(&queue->totalWait,
+            __ATOMIC_RELAXED);
+    fprintf(stderr, "@POOL@\n");
+    fprintf(stderr, "pool:WORKERS:%d:ACCEPTORS:%d:ACTIVE:%d:QUEUED:%d:"
+            "REJECTED:%d:ACCEPT_ERRORS:%d:ADOPTED:%lld:WAIT_AVG_US:%lld:"
+            "WAIT_MAX_US:%lld\n",
+            pool->numWorkers, pool->numAcceptors,
+            __atomic_load_n(&queue->activeConns, __ATOMIC_RELAXED),
+            __atomic_load_n(&queue->count, __ATOMIC_RELAXED),
+            __atomic_load_n(&queue->rejected, __ATOMIC_RELAXED),
+            __atomic_load_n(&queue->acceptErrors, __ATOMIC_RELAXED), adopted,
+            adopted ? totalWait / adopted : 0,
+            __atomic_load_n(&queue->maxWait, __ATOMIC_RELAXED));
+}
+
+/*
+* Print how the workers' rounds have shared out their time, and the service
+* each client in the roster has had. Must be called with the roster lock
+* held.
+*
+* Parameters:
+*     server: the server to report on
+*/
+void print_schedule_stats(struct ServerInf* server) {
+
+    long long rounds = 0;
+    long long deferred = 0;
+
+    for (int index = 0; index < server->pool.numWorkers; index++) {
+        rounds += server->pool.workers[index].rounds;
+        deferred += server->pool.workers[index].deferred;
+    }
+
+    fprintf(stderr, "@SCHEDULE@\n");
+    fprintf(stderr, "schedule:ROUNDS:%lld:DEFERRED:%lld\n", rounds, deferred);
+    for (struct ClientInf* current = server->head; current != NULL;
+            current = current->next) {
+        fprintf(stderr, "%s:WEIGHT:%d:LINES:%lld:SERVICE_US:%lld:"
+                "MAX_WAIT_US:%lld\n", current->name, current->weight,
+                current->linesServed, current->serviceUs, current->maxWait);
+    }
+}
+
+/*
+* Print how many timers the workers have armed, the heartbeats sent and the
+* connections reaped, by reason.
+*
+* Parameters:
+*     pool: the pool to report on
+*/
+void print_timer_stats(struct WorkerPool* pool) {
+
+    int armed = 0;
+    long long pings = 0;
+    long long handshake = 0;
+    long long idle = 0;
+    long long dead = 0;
+
+    for (int index = 0; index < pool->numWorkers; index++) {
+        struct Worker* worker = &pool->workers[index];
+        armed += worker->wheel.armed;
+        pings += worker->pings;
+        handshake += worker->handshakeReaped;
+        idle += worker->idleReaped;
+        dead += worker->deadReaped;
+    }
+
+    fprintf(stderr, "@TIMERS@\n");
+    fprintf(stderr, "timers:ARMED:%d:PINGS:%lld:HANDSHAKE:%lld:IDLE:%lld:"
+            "DEAD:%lld\n", armed, pings, handshake, idle, dead);
+}